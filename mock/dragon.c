@@ -0,0 +1,16 @@
+// stand-in for the Dragon app: loading libmaclink starts the command server,
+// and creating an engine through it starts the mock engine in server.so
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+extern int DSXEngine_Create(char *s, uint64_t val, void **engine);
+
+int main() {
+    void *engine = NULL;
+    if (DSXEngine_Create("mock", 0, &engine)) {
+        printf("engine creation failed\n");
+        return 1;
+    }
+    while (1) pause();
+}
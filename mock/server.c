@@ -0,0 +1,648 @@
+// stand-in for Dragon's server.so, so the command server and phrase matcher
+// can be run and benchmarked without Dragon
+//
+// grammars are decoded from the same CFG blob grammar_compile() builds, and a
+// background thread drives the registered callbacks with random phrases
+// generated from the active rules
+//
+// environment:
+//   DSX_MOCK_RATE        phrases per second, 0 = as fast as possible (10)
+//   DSX_MOCK_COUNT       stop after this many phrases, 0 = never (0)
+//   DSX_MOCK_SEED        random seed (time)
+//   DSX_MOCK_HYPOTHESES  hypothesis callbacks per phrase (1)
+//   DSX_MOCK_MAXREP      max repetitions generated for a REP (3)
+//   DSX_MOCK_DICTATION   max words generated for a dgn* import (3)
+//   DSX_MOCK_REPORT      phrases per latency report, 0 = no reports (1000)
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dsx.h"
+
+// blob layout, see src/grammar/compile.c
+enum { start_type = 1, end_type = 2, word_type = 3, rule_type = 4, list_type = 6 };
+enum { seq_val = 1, alt_val = 2, rep_val = 3, opt_val = 4 };
+
+typedef struct {
+    uint16_t type, prob;
+    uint32_t val;
+} __attribute__((packed)) rule_def;
+
+typedef struct {
+    uint32_t size, id;
+} __attribute__((packed)) rule_header;
+
+typedef struct {
+    uint32_t type, size;
+    uint8_t data[0];
+} __attribute__((packed)) chunk_header;
+
+typedef struct {
+    uint32_t type, flags;
+} __attribute__((packed)) grammar_header;
+
+typedef struct {
+    uint32_t size, id;
+    char name[0];
+} __attribute__((packed)) id_entry;
+
+// dragon reports words matched by the global imports under these rule numbers
+static const struct {
+    const char *name;
+    uint32_t rule;
+} dgn_rules[] = {
+    {"dgndictation", 1000000},
+    {"dgnwords", 1000001},
+    {"dgnletters", 1000002},
+    {NULL, 0},
+};
+
+static const char *dictation[] = {
+    "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel",
+};
+
+typedef struct {
+    void *cb, *user;
+    unsigned int key;
+} callback;
+
+typedef struct {
+    const id_entry **ents;
+    uint32_t count;
+} id_table;
+
+typedef struct mock_grammar {
+    uint8_t *raw;
+    size_t size;
+    id_table words, lists, exports, imports;
+    const rule_header **rules;
+    uint32_t rule_count;
+    dsx_dataptr *listdata;
+
+    uint32_t active_rule;
+    bool active;
+    int priority;
+    callback begin, end, hypo;
+    struct mock_grammar *next;
+} mock_grammar;
+
+typedef struct {
+    uint32_t id, rule;
+    char *word;
+} mock_word;
+
+typedef struct {
+    mock_word *words;
+    uint32_t count, cap;
+} mock_result;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static mock_grammar *grammars = NULL;
+// the grammar the engine thread last generated a phrase from, cleared if it's destroyed
+static mock_grammar *cursor = NULL;
+static unsigned int next_key = 1;
+static drg_engine *engine = NULL;
+static pthread_t engine_tid;
+
+static struct {
+    double rate;
+    long count;
+    int hypotheses, maxrep, dictation, report;
+} config;
+
+static int env_int(const char *name, int def) {
+    const char *val = getenv(name);
+    return val ? atoi(val) : def;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* blob decoding */
+
+static int decode_ids(id_table *table, const chunk_header *chunk) {
+    const uint8_t *pos = chunk->data, *end = chunk->data + chunk->size;
+    uint32_t max = 0;
+    while (pos < end) {
+        const id_entry *ent = (const id_entry *)pos;
+        if (ent->size < sizeof(id_entry) || pos + ent->size > end)
+            return -1;
+        if (ent->id > max)
+            max = ent->id;
+        pos += ent->size;
+    }
+    table->count = max;
+    table->ents = calloc(max + 1, sizeof(id_entry *));
+    for (pos = chunk->data; pos < end; pos += ((const id_entry *)pos)->size) {
+        const id_entry *ent = (const id_entry *)pos;
+        table->ents[ent->id] = ent;
+    }
+    return 0;
+}
+
+static int decode_rules(mock_grammar *g, const chunk_header *chunk) {
+    const uint8_t *pos = chunk->data, *end = chunk->data + chunk->size;
+    uint32_t max = 0;
+    while (pos < end) {
+        const rule_header *rule = (const rule_header *)pos;
+        if (rule->size < sizeof(rule_header) || pos + rule->size > end)
+            return -1;
+        if (rule->id > max)
+            max = rule->id;
+        pos += rule->size;
+    }
+    g->rule_count = max;
+    g->rules = calloc(max + 1, sizeof(rule_header *));
+    for (pos = chunk->data; pos < end; pos += ((const rule_header *)pos)->size) {
+        const rule_header *rule = (const rule_header *)pos;
+        g->rules[rule->id] = rule;
+    }
+    return 0;
+}
+
+static void grammar_free(mock_grammar *g) {
+    for (uint32_t i = 0; g->listdata && i <= g->lists.count; i++) {
+        free(g->listdata[i].data);
+    }
+    free(g->listdata);
+    free(g->words.ents);
+    free(g->lists.ents);
+    free(g->exports.ents);
+    free(g->imports.ents);
+    free(g->rules);
+    free(g->raw);
+    free(g);
+}
+
+static mock_grammar *grammar_decode(const void *data, size_t size) {
+    if (size < sizeof(grammar_header))
+        return NULL;
+    mock_grammar *g = calloc(1, sizeof(mock_grammar));
+    g->raw = malloc(size);
+    g->size = size;
+    memcpy(g->raw, data, size);
+
+    uint8_t *pos = g->raw + sizeof(grammar_header), *end = g->raw + size;
+    int rc = 0;
+    while (pos < end && rc == 0) {
+        chunk_header *chunk = (chunk_header *)pos;
+        if (pos + sizeof(chunk_header) > end || chunk->data + chunk->size > end) {
+            rc = -1;
+            break;
+        }
+        switch (chunk->type) {
+            case 2: rc = decode_ids(&g->words, chunk); break;
+            case 3: rc = decode_rules(g, chunk); break;
+            case 4: rc = decode_ids(&g->exports, chunk); break;
+            case 5: rc = decode_ids(&g->imports, chunk); break;
+            case 6: rc = decode_ids(&g->lists, chunk); break;
+            default: rc = -1; break;
+        }
+        pos = chunk->data + chunk->size;
+    }
+    if (rc) {
+        grammar_free(g);
+        return NULL;
+    }
+    g->listdata = calloc(g->lists.count + 1, sizeof(dsx_dataptr));
+    return g;
+}
+
+/* phrase generation */
+
+static void result_push(mock_result *r, uint32_t id, uint32_t rule, const char *word) {
+    if (r->count == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 16;
+        r->words = realloc(r->words, r->cap * sizeof(mock_word));
+    }
+    mock_word *w = &r->words[r->count++];
+    w->id = id;
+    w->rule = rule;
+    w->word = strdup(word);
+}
+
+static void result_free(mock_result *r) {
+    for (uint32_t i = 0; i < r->count; i++) {
+        free(r->words[i].word);
+    }
+    free(r->words);
+    free(r);
+}
+
+// returns the def following the element starting at def
+static const rule_def *def_skip(const rule_def *def, const rule_def *end) {
+    if (def->type != start_type)
+        return def + 1;
+    int depth = 0;
+    for (; def < end; def++) {
+        if (def->type == start_type) depth++;
+        if (def->type == end_type && --depth == 0)
+            return def + 1;
+    }
+    return end;
+}
+
+static int gen_rule(mock_grammar *g, uint32_t id, mock_result *r, int depth);
+
+static int gen_def(mock_grammar *g, uint32_t rule, const rule_def *def, const rule_def *end, mock_result *r, int depth) {
+    switch (def->type) {
+        case word_type: {
+            const id_entry *ent = def->val <= g->words.count ? g->words.ents[def->val] : NULL;
+            if (!ent) return -1;
+            result_push(r, ent->id, rule, ent->name);
+            return 0;
+        }
+        case list_type: {
+            dsx_dataptr *dp = def->val <= g->lists.count ? &g->listdata[def->val] : NULL;
+            if (!dp || dp->size == 0) return -1;
+            int count = 0;
+            uint8_t *pos = dp->data;
+            for (; pos < (uint8_t *)dp->data + dp->size; pos += ((id_entry *)pos)->size) count++;
+            int pick = rand() % count;
+            pos = dp->data;
+            while (pick--) pos += ((id_entry *)pos)->size;
+            // list words aren't in the word table, so dragon reports them without an id
+            result_push(r, 0, rule, ((id_entry *)pos)->name);
+            return 0;
+        }
+        case rule_type:
+            return gen_rule(g, def->val, r, depth + 1);
+        case start_type: {
+            const rule_def *body = def + 1, *body_end = def_skip(def, end) - 1;
+            const rule_def *child;
+            switch (def->val) {
+                case alt_val: {
+                    int count = 0;
+                    for (child = body; child < body_end; child = def_skip(child, body_end)) count++;
+                    if (count == 0) return 0;
+                    int pick = rand() % count;
+                    for (child = body; pick--; child = def_skip(child, body_end));
+                    return gen_def(g, rule, child, body_end, r, depth);
+                }
+                case opt_val:
+                    if (rand() % 2) return 0;
+                    break;
+            }
+            int reps = def->val == rep_val ? 1 + rand() % config.maxrep : 1;
+            while (reps--) {
+                for (child = body; child < body_end; child = def_skip(child, body_end)) {
+                    if (gen_def(g, rule, child, body_end, r, depth)) return -1;
+                }
+            }
+            return 0;
+        }
+        default:
+            return -1;
+    }
+}
+
+static int gen_rule(mock_grammar *g, uint32_t id, mock_result *r, int depth) {
+    if (depth > 32)
+        return -1;
+    const rule_header *rule = id <= g->rule_count ? g->rules[id] : NULL;
+    if (!rule) {
+        const id_entry *import = id <= g->imports.count ? g->imports.ents[id] : NULL;
+        if (!import) return -1;
+        for (int i = 0; dgn_rules[i].name; i++) {
+            if (strcmp(import->name, dgn_rules[i].name) == 0) {
+                int count = 1 + rand() % config.dictation;
+                while (count--) {
+                    const char *word = dictation[rand() % (sizeof(dictation) / sizeof(dictation[0]))];
+                    result_push(r, 0, dgn_rules[i].rule, word);
+                }
+                return 0;
+            }
+        }
+        return -1;
+    }
+    const rule_def *def = (const rule_def *)((uint8_t *)rule + sizeof(rule_header));
+    const rule_def *end = (const rule_def *)((uint8_t *)rule + rule->size);
+    while (def < end) {
+        if (gen_def(g, id, def, end, r, depth)) return -1;
+        def = def_skip(def, end);
+    }
+    return 0;
+}
+
+// dragon's phrase format: total length, then one id_entry per word
+static char *phrase_pack(mock_result *r, uint32_t count) {
+    uint32_t size = sizeof(uint32_t);
+    for (uint32_t i = 0; i < count; i++) {
+        size += sizeof(id_entry) + ((strlen(r->words[i].word) + 4) & ~3);
+    }
+    char *phrase = calloc(1, size);
+    *(uint32_t *)phrase = size;
+    char *pos = phrase + sizeof(uint32_t);
+    for (uint32_t i = 0; i < count; i++) {
+        id_entry *ent = (id_entry *)pos;
+        ent->size = sizeof(id_entry) + ((strlen(r->words[i].word) + 4) & ~3);
+        ent->id = r->words[i].id;
+        strcpy(ent->name, r->words[i].word);
+        pos += ent->size;
+    }
+    return phrase;
+}
+
+// the callee owns the result (maclink calls DSXResult_Destroy), so each callback gets a copy
+static mock_result *result_copy(mock_result *r, uint32_t count) {
+    mock_result *copy = calloc(1, sizeof(mock_result));
+    for (uint32_t i = 0; i < count; i++) {
+        result_push(copy, r->words[i].id, r->words[i].rule, r->words[i].word);
+    }
+    return copy;
+}
+
+static uint64_t phrase_emit(mock_grammar *g, mock_result *r) {
+    typedef void (*begin_cb)(void *user);
+    typedef int (*phrase_cb)(void *user, dsx_end_phrase *phrase);
+
+    if (g->begin.cb)
+        ((begin_cb)g->begin.cb)(g->begin.user);
+    for (int i = 1; g->hypo.cb && i <= config.hypotheses; i++) {
+        uint32_t count = r->count * i / config.hypotheses;
+        if (count == 0) continue;
+        dsx_end_phrase hypo = {0};
+        hypo.phrase = phrase_pack(r, count);
+        hypo.result = (dsx_result *)result_copy(r, count);
+        ((phrase_cb)g->hypo.cb)(g->hypo.user, &hypo);
+        free(hypo.phrase);
+    }
+    dsx_end_phrase end = {0};
+    end.phrase = phrase_pack(r, r->count);
+    end.result = (dsx_result *)result_copy(r, r->count);
+    uint64_t start = now_ns();
+    ((phrase_cb)g->end.cb)(g->end.user, &end);
+    uint64_t elapsed = now_ns() - start;
+    free(end.phrase);
+    return elapsed;
+}
+
+/* engine thread */
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(uint64_t *samples, int count, uint64_t elapsed) {
+    qsort(samples, count, sizeof(uint64_t), cmp_u64);
+    uint64_t total = 0;
+    for (int i = 0; i < count; i++) total += samples[i];
+    fprintf(stderr, "[mock] %d phrases in %.3fs (%.1f/s), end callback latency us: avg %.1f p50 %.1f p99 %.1f max %.1f\n",
+            count, elapsed / 1e9, count / (elapsed / 1e9),
+            total / 1e3 / count, samples[count / 2] / 1e3,
+            samples[count * 99 / 100] / 1e3, samples[count - 1] / 1e3);
+}
+
+static void *engine_thread(void *user) {
+    uint64_t *samples = calloc(config.report > 0 ? config.report : 1, sizeof(uint64_t));
+    int sampled = 0;
+    uint64_t window = 0, next = now_ns();
+    long emitted = 0;
+    while (config.count == 0 || emitted < config.count) {
+        if (config.rate > 0) {
+            uint64_t now = now_ns();
+            if (next > now)
+                usleep((next - now) / 1000);
+            next += 1e9 / config.rate;
+        }
+
+        pthread_mutex_lock(&lock);
+        // round-robin over grammars with an active rule and an end phrase callback
+        mock_grammar *g = NULL;
+        mock_grammar *start = cursor ? cursor->next : grammars;
+        for (mock_grammar *pos = start; pos && !g; pos = pos->next) {
+            if (pos->active && pos->end.cb) g = pos;
+        }
+        for (mock_grammar *pos = grammars; pos != start && !g; pos = pos->next) {
+            if (pos->active && pos->end.cb) g = pos;
+        }
+        cursor = g;
+        if (!g) {
+            pthread_mutex_unlock(&lock);
+            if (config.rate <= 0) usleep(1000);
+            continue;
+        }
+        mock_result *r = calloc(1, sizeof(mock_result));
+        int rc = gen_rule(g, g->active_rule, r, 0);
+        if (rc == 0 && r->count > 0) {
+            if (sampled == 0)
+                window = now_ns();
+            uint64_t latency = phrase_emit(g, r);
+            if (config.report > 0)
+                samples[sampled++] = latency;
+            emitted++;
+        }
+        pthread_mutex_unlock(&lock);
+        result_free(r);
+
+        if (config.report > 0 && sampled == config.report) {
+            report(samples, sampled, now_ns() - window);
+            sampled = 0;
+        }
+    }
+    if (config.report > 0 && sampled > 0)
+        report(samples, sampled, now_ns() - window);
+    fprintf(stderr, "[mock] emitted %ld phrases\n", emitted);
+    free(samples);
+    return NULL;
+}
+
+static void engine_start() {
+    if (engine)
+        return;
+    engine = calloc(1, 1);
+    config.rate = getenv("DSX_MOCK_RATE") ? atof(getenv("DSX_MOCK_RATE")) : 10;
+    config.count = env_int("DSX_MOCK_COUNT", 0);
+    config.hypotheses = env_int("DSX_MOCK_HYPOTHESES", 1);
+    config.maxrep = env_int("DSX_MOCK_MAXREP", 3);
+    config.dictation = env_int("DSX_MOCK_DICTATION", 3);
+    config.report = env_int("DSX_MOCK_REPORT", 1000);
+    if (config.maxrep < 1) config.maxrep = 1;
+    if (config.dictation < 1) config.dictation = 1;
+    srand(getenv("DSX_MOCK_SEED") ? env_int("DSX_MOCK_SEED", 0) : time(NULL));
+    pthread_create(&engine_tid, NULL, engine_thread, NULL);
+}
+
+/* exported DSX api */
+
+drg_engine *DSXEngine_New() {
+    engine_start();
+    return engine;
+}
+
+int DSXEngine_Create(char *s, uint64_t val, drg_engine **out) {
+    engine_start();
+    *out = engine;
+    return 0;
+}
+
+int DSXEngine_LoadGrammar(drg_engine *e, int type, dsx_dataptr *data, drg_grammar **out) {
+    if (type != 1 || data == NULL || data->data == NULL)
+        return 1;
+    mock_grammar *g = grammar_decode(data->data, data->size);
+    if (!g)
+        return 2;
+    pthread_mutex_lock(&lock);
+    g->next = grammars;
+    grammars = g;
+    pthread_mutex_unlock(&lock);
+    *out = (drg_grammar *)g;
+    return 0;
+}
+
+int DSXGrammar_Activate(drg_grammar *grammar, uint64_t unk1, bool unk2, const char *main_rule) {
+    mock_grammar *g = (mock_grammar *)grammar;
+    for (uint32_t i = 1; i <= g->exports.count; i++) {
+        const id_entry *ent = g->exports.ents[i];
+        if (ent && (!main_rule || strcmp(ent->name, main_rule) == 0)) {
+            pthread_mutex_lock(&lock);
+            g->active_rule = ent->id;
+            g->active = true;
+            pthread_mutex_unlock(&lock);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int DSXGrammar_Deactivate(drg_grammar *grammar, uint64_t unk1, const char *main_rule) {
+    mock_grammar *g = (mock_grammar *)grammar;
+    pthread_mutex_lock(&lock);
+    g->active = false;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+int DSXGrammar_Destroy(drg_grammar *grammar) {
+    mock_grammar *g = (mock_grammar *)grammar;
+    pthread_mutex_lock(&lock);
+    for (mock_grammar **pos = &grammars; *pos; pos = &(*pos)->next) {
+        if (*pos == g) {
+            *pos = g->next;
+            break;
+        }
+    }
+    if (cursor == g)
+        cursor = NULL;
+    pthread_mutex_unlock(&lock);
+    grammar_free(g);
+    return 0;
+}
+
+static int register_callback(callback *slot, void *cb, void *user, unsigned int *key) {
+    pthread_mutex_lock(&lock);
+    slot->cb = cb;
+    slot->user = user;
+    slot->key = *key = next_key++;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+int DSXGrammar_RegisterBeginPhraseCallback(drg_grammar *grammar, void *cb, void *user, unsigned int *key) {
+    return register_callback(&((mock_grammar *)grammar)->begin, cb, user, key);
+}
+
+int DSXGrammar_RegisterEndPhraseCallback(drg_grammar *grammar, void *cb, void *user, unsigned int *key) {
+    return register_callback(&((mock_grammar *)grammar)->end, cb, user, key);
+}
+
+int DSXGrammar_RegisterPhraseHypothesisCallback(drg_grammar *grammar, void *cb, void *user, unsigned int *key) {
+    return register_callback(&((mock_grammar *)grammar)->hypo, cb, user, key);
+}
+
+int DSXGrammar_Unregister(drg_grammar *grammar, unsigned int key) {
+    mock_grammar *g = (mock_grammar *)grammar;
+    callback *slots[] = {&g->begin, &g->end, &g->hypo};
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < 3; i++) {
+        if (slots[i]->key == key) {
+            memset(slots[i], 0, sizeof(callback));
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+void *DSXGrammar_SetSpecialGrammar() {
+    return NULL;
+}
+
+int DSXGrammar_SetApplicationName(drg_grammar *grammar, const char *name) {
+    return 0;
+}
+
+int DSXGrammar_SetPriority(drg_grammar *grammar, int priority) {
+    ((mock_grammar *)grammar)->priority = priority;
+    return 0;
+}
+
+static dsx_dataptr *list_find(mock_grammar *g, const char *name) {
+    for (uint32_t i = 1; i <= g->lists.count; i++) {
+        const id_entry *ent = g->lists.ents[i];
+        if (ent && strcmp(ent->name, name) == 0) {
+            return &g->listdata[i];
+        }
+    }
+    return NULL;
+}
+
+int DSXGrammar_SetList(drg_grammar *grammar, const char *name, dsx_dataptr *data) {
+    mock_grammar *g = (mock_grammar *)grammar;
+    dsx_dataptr *dp = list_find(g, name);
+    if (!dp)
+        return 1;
+    void *copy = malloc(data->size);
+    memcpy(copy, data->data, data->size);
+    pthread_mutex_lock(&lock);
+    free(dp->data);
+    dp->data = copy;
+    dp->size = data->size;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+int DSXGrammar_GetList(drg_grammar *grammar, const char *name, dsx_dataptr *data) {
+    dsx_dataptr *dp = list_find((mock_grammar *)grammar, name);
+    if (!dp)
+        return 1;
+    *data = *dp;
+    return 0;
+}
+
+int DSXResult_BestPathWord(dsx_result *result, int choice, uint32_t *path, size_t pathSize, size_t *needed) {
+    mock_result *r = (mock_result *)result;
+    *needed = r->count * sizeof(uint32_t);
+    if (pathSize < *needed)
+        return 33;
+    for (uint32_t i = 0; i < r->count; i++) {
+        path[i] = i;
+    }
+    return 0;
+}
+
+int DSXResult_GetWordNode(dsx_result *result, uint32_t path, void *node, uint32_t *num, char **name) {
+    mock_result *r = (mock_result *)result;
+    if (path >= r->count)
+        return 1;
+    dsx_word_node *wn = node;
+    memset(wn, 0, sizeof(dsx_word_node));
+    wn->rule = r->words[path].rule;
+    *num = r->words[path].id;
+    *name = r->words[path].word;
+    return 0;
+}
+
+int DSXResult_Destroy(dsx_result *result) {
+    result_free((mock_result *)result);
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define align(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static arena_block *block_new(size_t size) {
+    arena_block *block = malloc(sizeof(arena_block) + size);
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+arena *arena_new(size_t block_size) {
+    arena *a = calloc(1, sizeof(arena));
+    a->block_size = block_size;
+    return a;
+}
+
+void *arena_alloc(arena *a, size_t size) {
+    size = align(size);
+    a->total += size;
+    arena_block *head = a->head;
+    if (head && head->size - head->used >= size) {
+        void *ptr = head->data + head->used;
+        head->used += size;
+        return ptr;
+    }
+    // big allocations get their own block behind the current one, so it keeps filling
+    if (head && size > a->block_size / 4) {
+        arena_block *block = block_new(size);
+        block->used = size;
+        block->next = head->next;
+        head->next = block;
+        return block->data;
+    }
+    arena_block *block = block_new(size > a->block_size ? size : a->block_size);
+    block->used = size;
+    block->next = head;
+    a->head = block;
+    return block->data;
+}
+
+void *arena_calloc(arena *a, size_t size) {
+    void *ptr = arena_alloc(a, size);
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+char *arena_strdup(arena *a, const char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(a, len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+char *arena_strndup(arena *a, const char *str, size_t len) {
+    char *copy = arena_alloc(a, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = 0;
+    return copy;
+}
+
+void arena_free(arena *a) {
+    if (a == NULL)
+        return;
+    arena_block *block = a->head;
+    while (block) {
+        arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(a);
+}
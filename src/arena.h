@@ -0,0 +1,26 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// bump allocator: allocations are only freed all at once, by arena_free
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size, used;
+    char data[];
+} arena_block;
+
+typedef struct {
+    arena_block *head;
+    size_t block_size, total;
+} arena;
+
+arena *arena_new(size_t block_size);
+void *arena_alloc(arena *a, size_t size);
+void *arena_calloc(arena *a, size_t size);
+char *arena_strdup(arena *a, const char *str);
+// copies len bytes of str and terminates them
+char *arena_strndup(arena *a, const char *str, size_t len);
+void arena_free(arena *a);
+
+#endif
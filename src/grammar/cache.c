@@ -0,0 +1,556 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "intern.h"
+#include "nfa.h"
+#include "node.h"
+
+// an entry is a header followed by 8-byte aligned sections. everything that
+// refers to a string (names, rule keys) is an offset into the strings section,
+// since interned ids don't survive a restart. the body, nfa rules and edges and
+// the rule graph are used straight from the mapping. the canonical json the entry
+// was compiled from is kept too, and must match on load, so a hash collision misses.
+
+#define CACHE_MAGIC 0x43474c4d
+#define CACHE_VERSION 5
+#define CACHE_LAYOUT (sizeof(nfa_state) | sizeof(nfa_rule) << 8 | sizeof(bool) << 16)
+
+enum {
+    SEC_BODY,
+    SEC_STRINGS,
+    SEC_WORDS,
+    SEC_RULES,
+    SEC_LISTS,
+    SEC_EXPORTS,
+    SEC_IMPORTS,
+    SEC_NFA_RULES,
+    SEC_NFA_STATES,
+    SEC_NFA_EDGES,
+    SEC_GRAPH_INDEX,
+    SEC_GRAPH_PARENTS,
+    SEC_GRAPH_NULLABLE,
+    SEC_DEPENDENT,
+    SEC_SOURCE,
+    SEC_COUNT,
+};
+
+typedef struct {
+    uint32_t magic, version, layout;
+    struct {
+        uint32_t offset, count;
+    } sections[SEC_COUNT];
+} cache_header;
+
+// words, lists, exports and imports only use id and name.
+// rules also have their rule_defs at data in the blob (size 0 = not defined)
+typedef struct {
+    uint32_t id, name;
+    uint32_t data, size;
+} cache_id;
+
+static const size_t section_size[SEC_COUNT] = {
+    [SEC_BODY] = 1,
+    [SEC_STRINGS] = 1,
+    [SEC_WORDS] = sizeof(cache_id),
+    [SEC_RULES] = sizeof(cache_id),
+    [SEC_LISTS] = sizeof(cache_id),
+    [SEC_EXPORTS] = sizeof(cache_id),
+    [SEC_IMPORTS] = sizeof(cache_id),
+    [SEC_NFA_RULES] = sizeof(nfa_rule),
+    [SEC_NFA_STATES] = sizeof(nfa_state),
+    [SEC_NFA_EDGES] = sizeof(uint32_t),
+    [SEC_GRAPH_INDEX] = sizeof(uint32_t),
+    [SEC_GRAPH_PARENTS] = sizeof(uint32_t),
+    [SEC_GRAPH_NULLABLE] = sizeof(bool),
+    [SEC_DEPENDENT] = sizeof(bool),
+    [SEC_SOURCE] = 1,
+};
+
+static char *cache_dir;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static void cache_init(void) {
+    const char *dir = getenv("MACLINK_CACHE");
+    if (dir) {
+        if (*dir) cache_dir = strdup(dir);
+    } else if ((dir = getenv("HOME"))) {
+        char *path;
+        asprintf(&path, "%s/.cache", dir);
+        mkdir(path, 0755);
+        free(path);
+        asprintf(&cache_dir, "%s/.cache/maclink", dir);
+    }
+    if (cache_dir && mkdir(cache_dir, 0755) && errno != EEXIST) {
+        printf("warning: grammar cache disabled, can't create %s\n", cache_dir);
+        free(cache_dir);
+        cache_dir = NULL;
+    }
+}
+
+static char *cache_path(const char *key) {
+    char *path;
+    asprintf(&path, "%s/%s.grammar", cache_dir, key);
+    return path;
+}
+
+static uint64_t fnv64(const char *str, size_t len, uint64_t h) {
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)str[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+// only the rules, so g.load's other options and the grammar's name don't miss
+static char *canonical_json(json_t *public, json_t *private) {
+    json_t *source = json_object();
+    json_object_set(source, "public", public);
+    if (private) json_object_set(source, "private", private);
+    char *text = json_dumps(source, JSON_COMPACT | JSON_SORT_KEYS);
+    json_decref(source);
+    return text;
+}
+
+void cache_hash(json_t *public, json_t *private, cache_key *key) {
+    char *text = canonical_json(public, private);
+    size_t len = strlen(text);
+    // two differently seeded hashes make a 128 bit key, and the enabled
+    // optimizer passes are mixed in so entries built with other passes miss
+    uint64_t passes = node_passes();
+    snprintf(key->name, sizeof(key->name), "%016llx%016llx",
+             (unsigned long long)fnv64(text, len, 0xcbf29ce484222325ull ^ passes),
+             (unsigned long long)fnv64(text, len, 0x84222325cbf29ce4ull ^ passes));
+    free(text);
+}
+
+// load
+
+typedef struct {
+    const uint8_t *base;
+    const cache_header *header;
+    const char *strings;
+    uint32_t strings_size;
+} cache_view;
+
+static const void *section(cache_view *v, int sec) {
+    return v->base + v->header->sections[sec].offset;
+}
+
+static uint32_t section_count(cache_view *v, int sec) {
+    return v->header->sections[sec].count;
+}
+
+static const char *view_str(cache_view *v, uint32_t offset) {
+    return offset < v->strings_size ? v->strings + offset : NULL;
+}
+
+static bool view_check(cache_view *v, size_t size, const char *source) {
+    const cache_header *header = v->header;
+    if (size < sizeof(cache_header) || header->magic != CACHE_MAGIC || header->version != CACHE_VERSION ||
+            header->layout != CACHE_LAYOUT)
+        return false;
+    for (int i = 0; i < SEC_COUNT; i++) {
+        uint64_t end = header->sections[i].offset + (uint64_t)header->sections[i].count * section_size[i];
+        // write_bytes aligns every section
+        if (end > size || header->sections[i].offset % 8)
+            return false;
+    }
+    if (section_count(v, SEC_SOURCE) != strlen(source) || memcmp(section(v, SEC_SOURCE), source, strlen(source)))
+        return false;
+    v->strings = section(v, SEC_STRINGS);
+    v->strings_size = section_count(v, SEC_STRINGS);
+    if (v->strings_size == 0 || v->strings[v->strings_size - 1] != 0)
+        return false;
+    uint32_t rule_count = section_count(v, SEC_NFA_RULES);
+    const uint32_t *index = section(v, SEC_GRAPH_INDEX);
+    return section_count(v, SEC_RULES) == rule_count && section_count(v, SEC_GRAPH_NULLABLE) == rule_count &&
+           section_count(v, SEC_DEPENDENT) == rule_count &&
+           section_count(v, SEC_GRAPH_INDEX) == rule_count + 2 &&
+           index[rule_count + 1] == section_count(v, SEC_GRAPH_PARENTS);
+}
+
+// fills list from an id section, returning false on a bad name or an id past max
+static bool load_ids(grammar_core *c, cache_view *v, int sec, tack_t *list, uint32_t max) {
+    const cache_id *ids = section(v, sec);
+    for (uint32_t i = 0; i < section_count(v, sec); i++) {
+        const char *name = view_str(v, ids[i].name);
+        if (!name || ids[i].id == 0 || ids[i].id > max)
+            return false;
+        node_id *ent = id_new(c->arena, name, ids[i].id);
+        tack_push(list, ent);
+        tack_hset(list, ent->name, ent);
+    }
+    return true;
+}
+
+// the matcher indexes by every state, edge, rule and list id without checking them
+static bool nfa_check(grammar_core *c) {
+    const nfa *n = c->nfa;
+    for (uint32_t r = 0; r < n->rule_count; r++) {
+        const nfa_rule *rule = &n->rules[r];
+        if ((uint64_t)rule->state + rule->state_count > n->state_count ||
+                (uint64_t)rule->entry + rule->entry_count > n->edge_count)
+            return false;
+    }
+    for (uint32_t s = 0; s < n->state_count; s++) {
+        const nfa_state *state = &n->states[s];
+        if ((uint64_t)state->edge + state->count > n->edge_count)
+            return false;
+        tack_t *ids = state->type == NFA_WORD ? &c->words : state->type == NFA_LIST ? &c->lists : &c->rules;
+        if (state->type > NFA_RULE || state->id == 0 || state->id > (uint32_t)tack_len(ids))
+            return false;
+    }
+    for (uint32_t e = 0; e < n->edge_count; e++) {
+        if (n->edges[e] != NFA_END && n->edges[e] >= n->state_count)
+            return false;
+    }
+    return true;
+}
+
+static bool graph_check(const rule_graph *graph, uint32_t parent_count) {
+    if (graph->index[0] != 0)
+        return false;
+    for (int r = 0; r <= graph->count; r++) {
+        if (graph->index[r] > graph->index[r + 1])
+            return false;
+    }
+    for (uint32_t p = 0; p < parent_count; p++) {
+        if (graph->parents[p] == 0 || graph->parents[p] > (uint32_t)graph->count)
+            return false;
+    }
+    return true;
+}
+
+static bool load_core(grammar_core *c, cache_view *v) {
+    uint32_t rule_count = section_count(v, SEC_RULES);
+    if (!load_ids(c, v, SEC_WORDS, &c->words, section_count(v, SEC_WORDS)) ||
+            !load_ids(c, v, SEC_RULES, &c->rules, rule_count) ||
+            !load_ids(c, v, SEC_LISTS, &c->lists, section_count(v, SEC_LISTS)) ||
+            !load_ids(c, v, SEC_EXPORTS, &c->exports, rule_count) || !tack_hexists(&c->rules, CORE_MAIN))
+        return false;
+
+    c->body = arena_alloc(c->arena, sizeof(buffer));
+    c->body->data = (uint8_t *)section(v, SEC_BODY);
+    c->body->size = section_count(v, SEC_BODY);
+    for (size_t pos = 0; pos + sizeof(chunk_header) <= c->body->size;) {
+        chunk_header *chunk = (chunk_header *)(c->body->data + pos);
+        size_t size = sizeof(chunk_header) + chunk->size;
+        if (pos + size > c->body->size)
+            return false;
+        if (chunk->type < CHUNK_COUNT)
+            c->chunks[chunk->type] = (chunk_span){.offset = pos, .size = size};
+        pos += size;
+    }
+    // rule_defs point into the body, so g.update can reuse them
+    const cache_id *rules = section(v, SEC_RULES);
+    for (uint32_t i = 0; i < section_count(v, SEC_RULES); i++) {
+        if (rules[i].size == 0)
+            continue;
+        if ((uint64_t)rules[i].data + rules[i].size > c->body->size)
+            return false;
+        buffer *buf = arena_alloc(c->arena, sizeof(buffer));
+        buf->data = c->body->data + rules[i].data;
+        buf->size = rules[i].size;
+        node_id *ent = tack_get(&c->rules, i);
+        ent->data = buf;
+    }
+    const cache_id *imports = section(v, SEC_IMPORTS);
+    for (uint32_t i = 0; i < section_count(v, SEC_IMPORTS); i++) {
+        if (imports[i].id == 0 || imports[i].id > (uint32_t)tack_len(&c->rules))
+            return false;
+        tack_push(&c->imports, tack_get(&c->rules, imports[i].id - 1));
+    }
+
+    nfa *n = c->nfa = arena_calloc(c->arena, sizeof(nfa));
+    n->rule_count = section_count(v, SEC_NFA_RULES);
+    n->state_count = section_count(v, SEC_NFA_STATES);
+    n->edge_count = section_count(v, SEC_NFA_EDGES);
+    n->rules = (nfa_rule *)section(v, SEC_NFA_RULES);
+    n->edges = (uint32_t *)section(v, SEC_NFA_EDGES);
+    // states hold interned ids, so they're copied and re-interned
+    n->states = arena_alloc(c->arena, n->state_count * sizeof(nfa_state));
+    memcpy(n->states, section(v, SEC_NFA_STATES), n->state_count * sizeof(nfa_state));
+    if (!nfa_check(c))
+        return false;
+    for (uint32_t s = 0; s < n->state_count; s++) {
+        nfa_state *state = &n->states[s];
+        if (state->type == NFA_WORD) {
+            node_id *word = state->id > 0 ? tack_get(&c->words, state->id - 1) : NULL;
+            if (!word)
+                return false;
+            state->sym = word->sym;
+        } else if (state->type == NFA_RULE && state->key) {
+            const char *key = view_str(v, state->key);
+            if (!key)
+                return false;
+            state->key = intern(key);
+        }
+    }
+
+    c->graph.count = n->rule_count;
+    c->graph.index = (uint32_t *)section(v, SEC_GRAPH_INDEX);
+    c->graph.parents = (uint32_t *)section(v, SEC_GRAPH_PARENTS);
+    c->graph.nullable = (bool *)section(v, SEC_GRAPH_NULLABLE);
+    c->dependent = (bool *)section(v, SEC_DEPENDENT);
+    return graph_check(&c->graph, section_count(v, SEC_GRAPH_PARENTS));
+}
+
+grammar_core *cache_load(cache_key *key, json_t *public, json_t *private) {
+    pthread_once(&cache_once, cache_init);
+    if (!cache_dir)
+        return NULL;
+    char *path = cache_path(key->name);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        free(path);
+        return NULL;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        free(path);
+        return NULL;
+    }
+
+    cache_view v = {.base = map, .header = map};
+    grammar_core *c = NULL;
+    char *source = canonical_json(public, private);
+    if (view_check(&v, st.st_size, source)) {
+        c = calloc(1, sizeof(grammar_core));
+        c->refs = 1;
+        c->arena = arena_new(64 * 1024);
+        c->map = map;
+        c->map_size = st.st_size;
+        c->public = json_incref(public);
+        c->private = private ? json_incref(private) : NULL;
+        if (load_core(c, &v)) {
+            // mtime is the lru clock
+            utimes(path, NULL);
+        } else {
+            printf("warning: removing corrupt grammar cache entry %s\n", path);
+            core_free(c);
+            c = NULL;
+            unlink(path);
+        }
+    } else {
+        // stale or from other rules with the same hash. it's replaced when this core is stored
+        munmap(map, st.st_size);
+        unlink(path);
+    }
+    free(source);
+    free(path);
+    return c;
+}
+
+// store
+
+typedef struct {
+    uint8_t *data;
+    size_t size, cap;
+} cache_writer;
+
+static uint32_t write_bytes(cache_writer *w, const void *data, size_t size) {
+    size_t offset = (w->size + 7) & ~(size_t)7;
+    if (offset + size > w->cap) {
+        w->cap = (offset + size) * 2;
+        w->data = realloc(w->data, w->cap);
+    }
+    memset(w->data + w->size, 0, offset - w->size);
+    if (size) memcpy(w->data + offset, data, size);
+    w->size = offset + size;
+    return offset;
+}
+
+static void write_section(cache_writer *w, int sec, const void *data, uint32_t count) {
+    uint32_t offset = write_bytes(w, data, count * section_size[sec]);
+    cache_header *header = (cache_header *)w->data;
+    header->sections[sec].offset = offset;
+    header->sections[sec].count = count;
+}
+
+// string offsets are assigned in order, with the empty string at 0
+typedef struct {
+    cache_writer text;
+    tack_t offsets;
+} string_table;
+
+static uint32_t string_add(string_table *t, const char *str) {
+    uintptr_t offset = (uintptr_t)tack_hget(&t->offsets, str);
+    if (offset == 0 && *str) {
+        offset = t->text.size;
+        size_t len = strlen(str) + 1;
+        if (t->text.size + len > t->text.cap) {
+            t->text.cap = (t->text.size + len) * 2;
+            t->text.data = realloc(t->text.data, t->text.cap);
+        }
+        memcpy(t->text.data + t->text.size, str, len);
+        t->text.size += len;
+        tack_hset(&t->offsets, str, (void *)offset);
+    }
+    return offset;
+}
+
+static cache_id *ids_flatten(string_table *t, tack_t *list) {
+    cache_id *ids = calloc(tack_len(list) + 1, sizeof(cache_id));
+    node_id *ent;
+    tack_foreach(list, ent) {
+        ids[i] = (cache_id){.id = ent->id, .name = string_add(t, ent->name)};
+    }
+    return ids;
+}
+
+// each rule's defs are its slice of the body's rules chunk
+static bool rules_locate(grammar_core *c, cache_id *rules) {
+    chunk_span span = c->chunks[CHUNK_RULES];
+    node_id *ent;
+    tack_foreach(&c->rules, ent) {
+        buffer *buf = ent->data;
+        if (!buf) continue;
+        size_t offset = buf->data - c->body->data;
+        if (buf->data < c->body->data || offset < span.offset || offset + buf->size > span.offset + span.size)
+            return false;
+        rules[i].data = offset;
+        rules[i].size = buf->size;
+    }
+    return true;
+}
+
+typedef struct {
+    time_t mtime;
+    off_t size;
+    char *path;
+} cache_file;
+
+static int cmp_mtime(const void *a, const void *b) {
+    const cache_file *x = a, *y = b;
+    return x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
+}
+
+// drops the least recently used entries until the cache fits its limit
+static void cache_evict(void) {
+    DIR *dir = opendir(cache_dir);
+    if (!dir)
+        return;
+    cache_file *entries = NULL;
+    int count = 0, cap = 0;
+    off_t total = 0;
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        size_t len = strlen(de->d_name);
+        if (len < 8 || strcmp(de->d_name + len - 8, ".grammar") != 0)
+            continue;
+        char *path;
+        asprintf(&path, "%s/%s", cache_dir, de->d_name);
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            free(path);
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            entries = realloc(entries, cap * sizeof(cache_file));
+        }
+        entries[count].mtime = st.st_mtime;
+        entries[count].size = st.st_size;
+        entries[count].path = path;
+        count++;
+        total += st.st_size;
+    }
+    closedir(dir);
+    qsort(entries, count, sizeof(cache_file), cmp_mtime);
+    for (int i = 0; i < count; i++) {
+        if (total > CACHE_LIMIT && unlink(entries[i].path) == 0)
+            total -= entries[i].size;
+        free(entries[i].path);
+    }
+    free(entries);
+}
+
+void cache_store(cache_key *key, grammar_core *c) {
+    pthread_once(&cache_once, cache_init);
+    if (!cache_dir)
+        return;
+    string_table strings = {.text = {.data = calloc(1, 1), .size = 1, .cap = 1}};
+    cache_id *words = ids_flatten(&strings, &c->words);
+    cache_id *rules = ids_flatten(&strings, &c->rules);
+    cache_id *lists = ids_flatten(&strings, &c->lists);
+    cache_id *exports = ids_flatten(&strings, &c->exports);
+    cache_id *imports = ids_flatten(&strings, &c->imports);
+    nfa *n = c->nfa;
+    nfa_state *states = malloc(n->state_count * sizeof(nfa_state) + 1);
+    memcpy(states, n->states, n->state_count * sizeof(nfa_state));
+    for (uint32_t s = 0; s < n->state_count; s++) {
+        if (states[s].type == NFA_WORD) {
+            states[s].sym = 0;
+        } else if (states[s].type == NFA_RULE && states[s].key) {
+            states[s].key = string_add(&strings, intern_str(states[s].key));
+        }
+    }
+
+    char *source = canonical_json(c->public, c->private);
+    cache_writer w = {0};
+    if (rules_locate(c, rules)) {
+        cache_header header = {
+            .magic = CACHE_MAGIC,
+            .version = CACHE_VERSION,
+            .layout = CACHE_LAYOUT,
+        };
+        write_bytes(&w, &header, sizeof(header));
+        write_section(&w, SEC_BODY, c->body->data, c->body->size);
+        write_section(&w, SEC_STRINGS, strings.text.data, strings.text.size);
+        write_section(&w, SEC_WORDS, words, tack_len(&c->words));
+        write_section(&w, SEC_RULES, rules, tack_len(&c->rules));
+        write_section(&w, SEC_LISTS, lists, tack_len(&c->lists));
+        write_section(&w, SEC_EXPORTS, exports, tack_len(&c->exports));
+        write_section(&w, SEC_IMPORTS, imports, tack_len(&c->imports));
+        write_section(&w, SEC_NFA_RULES, n->rules, n->rule_count);
+        write_section(&w, SEC_NFA_STATES, states, n->state_count);
+        write_section(&w, SEC_NFA_EDGES, n->edges, n->edge_count);
+        write_section(&w, SEC_GRAPH_INDEX, c->graph.index, c->graph.count + 2);
+        write_section(&w, SEC_GRAPH_PARENTS, c->graph.parents, c->graph.index[c->graph.count + 1]);
+        write_section(&w, SEC_GRAPH_NULLABLE, c->graph.nullable, c->graph.count);
+        write_section(&w, SEC_DEPENDENT, c->dependent, tack_len(&c->rules));
+        write_section(&w, SEC_SOURCE, source, strlen(source));
+
+        // written under a unique temporary name, so readers never see a partial entry
+        // and compiles of the same grammar on other threads don't write over it
+        char *path = cache_path(key->name), *tmp;
+        asprintf(&tmp, "%s.XXXXXX", path);
+        int fd = mkstemp(tmp);
+        FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+        if (fd >= 0 && !f) close(fd);
+        bool ok = f && fwrite(w.data, 1, w.size, f) == w.size;
+        if (f && fclose(f) != 0) ok = false;
+        if (ok && rename(tmp, path) == 0) {
+            cache_evict();
+        } else {
+            printf("warning: failed to write grammar cache entry %s\n", path);
+            if (fd >= 0) unlink(tmp);
+        }
+        free(tmp);
+        free(path);
+    }
+
+    free(w.data);
+    free(source);
+    free(states);
+    free(words);
+    free(rules);
+    free(lists);
+    free(exports);
+    free(imports);
+    free(strings.text.data);
+    tack_clear(&strings.offsets);
+}
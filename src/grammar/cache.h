@@ -0,0 +1,25 @@
+#ifndef GRAMMAR_CACHE_H
+#define GRAMMAR_CACHE_H
+
+#include <jansson.h>
+#include <stdbool.h>
+
+#include "compile.h"
+
+// compiled grammar cores are cached on disk under a hash of their rules' canonical
+// json, in $MACLINK_CACHE (default ~/.cache/maclink, set it empty to disable).
+// entries are mmapped on load, and the least recently used are evicted past the limit.
+
+#define CACHE_LIMIT (256 << 20)
+
+typedef struct {
+    char name[33];
+} cache_key;
+
+// the key is also used to share cores in memory, so it's made even if caching is disabled
+void cache_hash(json_t *public, json_t *private, cache_key *key);
+// returns NULL on a miss, a stale or corrupt entry, or if caching is disabled
+grammar_core *cache_load(cache_key *key, json_t *public, json_t *private);
+void cache_store(cache_key *key, grammar_core *core);
+
+#endif
@@ -1,69 +1,51 @@
 #include <jansson.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdarg.h>
+#include <sys/mman.h>
 
+#include "cache.h"
 #include "compile.h"
+#include "dfa.h"
+#include "intern.h"
 #include "nfa.h"
+#include "pool.h"
+#include "raw.h"
+#include "rulecache.h"
 
-enum gram_type {
-    start_type = 1,
-    end_type = 2,
-    word_type = 3,
-    rule_type = 4,
-    list_type = 6,
-};
-
-enum gram_val {
-    seq_val = 1,
-    alt_val = 2,
-    rep_val = 3,
-    opt_val = 4,
-};
-
-typedef struct {
-    uint16_t type, prob;
-    uint32_t val;
-} __attribute__((packed)) rule_def;
-
-typedef struct {
-    uint32_t size, id;
-} __attribute__((packed)) rule_header;
+// rules per batch handed to the worker pool
+#define RULE_BATCH 256
+// private rules up to this size (once their own inlined rules are expanded) are
+// inlined into every caller. rules with a single use are inlined at any size
+#define INLINE_SIZE (16 * sizeof(rule_def))
+// groups at least this big are split out into shared rules by the share pass
+#define SHARE_SIZE (24 * sizeof(rule_def))
 
-typedef struct {
-    uint32_t type, size;
-    uint8_t data[0];
-} __attribute__((packed)) chunk_header;
-
-typedef struct {
-    uint32_t type, flags;
-} __attribute__((packed)) grammar_header;
+// cores of loaded grammars by cache key, so identical grammars share one
+static tack_t cores;
+static pthread_mutex_t cores_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void pbuf(buffer *buf) {
-    for (int i = 0; i < buf->size; i++) {
+    for (size_t i = 0; i < buf->size; i++) {
         printf("%02x", buf->data[i]);
     }
     printf("\n");
 }
 
-node_id *id_new(const char *name, int id) {
-    node_id *new = malloc(sizeof(node_id));
+node_id *id_new(arena *a, const char *name, int id) {
+    node_id *new = arena_alloc(a, sizeof(node_id));
     new->id = id;
-    new->name = name ? strdup(name) : NULL;
+    new->sym = name ? intern(name) : 0;
+    new->name = intern_str(new->sym);
+    new->len = name ? strlen(name) : 0;
     new->data = NULL;
     return new;
 }
 
-void id_free(node_id *ent) {
-    free(ent->data);
-    free((void *)ent->name);
-    free(ent);
-}
-
-static int get_id(tack_t *list, char *name) {
+static int get_id(arena *a, tack_t *list, const char *name) {
     node_id *ent;
     if (! tack_hexists(list, name)) {
-        ent = id_new(name, tack_len(list) + 1);
+        ent = id_new(a, name, tack_len(list) + 1);
         tack_push(list, ent);
         tack_hset(list, name, ent);
     } else {
@@ -72,94 +54,80 @@ static int get_id(tack_t *list, char *name) {
     return ent->id;
 }
 
-static buffer *pack_ids(tack_t *list, int type) {
-    buffer *buf = calloc(1, sizeof(buffer));
-    if (tack_len(list) == 0) {
-        buf->data = malloc(0);
-        buf->size = 0;
-        return buf;
-    }
+// an id entry's name is NUL terminated and padded to a word
+static size_t id_entry_size(size_t len) {
+    return sizeof(id_entry) + ((len + 4) & ~3);
+}
+
+// size of an id chunk, with each name prefixed by prefix_len bytes. empty lists have no chunk
+static size_t ids_size(tack_t *list, size_t prefix_len) {
+    if (tack_len(list) == 0)
+        return 0;
+    size_t size = sizeof(chunk_header);
     node_id *el;
     tack_foreach(list, el) {
-        if (!el->name) {
-            printf("%p, %d has no name!\n", el, el->id);
-            continue;
-        }
-        // name size is aligned to word
-        buf->size += sizeof(id_entry) + align4(strlen(el->name));
+        size += id_entry_size(prefix_len + el->len);
     }
-    buf->data = calloc(1, sizeof(chunk_header) + buf->size);
-    chunk_header *chunk = (chunk_header *)buf->data;
-    // chunk types: words=2, rules=3, exports=4, imports=5, lists=6
-    chunk->type = type;
-    chunk->size = buf->size;
-    buf->size += sizeof(chunk_header);
+    return size;
+}
 
-    uint8_t *pos = chunk->data;
+// writes an id chunk of exactly ids_size bytes at pos, returning the end
+static uint8_t *write_ids(uint8_t *pos, tack_t *list, int type, const char *prefix, size_t prefix_len) {
+    if (tack_len(list) == 0)
+        return pos;
+    chunk_header *chunk = (chunk_header *)pos;
+    chunk->type = type;
+    pos = chunk->data;
+    node_id *el;
     tack_foreach(list, el) {
         id_entry *entry = (id_entry *)pos;
-        size_t len = strlen(el->name);
-        // name size is word-aligned
-        entry->size = sizeof(id_entry) + align4(strlen(el->name));
+        size_t len = prefix_len + el->len;
+        entry->size = id_entry_size(len);
         entry->id = el->id;
-        strcpy(entry->name, el->name);
+        if (prefix_len)
+            memcpy(entry->name, prefix, prefix_len);
+        memcpy(entry->name + prefix_len, el->name, el->len);
+        memset(entry->name + len, 0, entry->size - sizeof(id_entry) - len);
         pos += entry->size;
     }
-    return buf;
+    chunk->size = pos - chunk->data;
+    return pos;
 }
 
-static buffer *pack_rules(tack_t *list, int type) {
-    buffer *buf = calloc(1, sizeof(buffer));
-    node_id *el;
-    tack_foreach(list, el) {
-        buffer *rule = el->data;
-        if (rule) {
-            buf->size += rule->size;
-        }
+// sizes the body exactly, then writes the id chunks into it once: imports, lists, words.
+// the rules chunk comes last, and each defined rule's buffer is pointed at its slot there
+// (in id order), so rules are emitted straight into the body
+static void core_layout(grammar_core *c) {
+    tack_t *lists[] = {&c->imports, &c->lists, &c->words};
+    int types[] = {CHUNK_IMPORTS, CHUNK_LISTS, CHUNK_WORDS};
+    size_t size = sizeof(chunk_header);
+    for (int t = 0; t < 3; t++) size += ids_size(lists[t], 0);
+    node_id *ent;
+    tack_foreach(&c->rules, ent) {
+        buffer *buf = ent->data;
+        if (buf) size += buf->size;
     }
-    buf->data = calloc(1, sizeof(chunk_header) + buf->size);
-    chunk_header *chunk = (chunk_header *)buf->data;
-    chunk->type = type;
-    chunk->size = buf->size;
-    buf->size += sizeof(chunk_header);
+    buffer *body = c->body = arena_alloc(c->arena, sizeof(buffer));
+    body->size = size;
+    body->data = arena_alloc(c->arena, size);
 
-    uint8_t *pos = chunk->data;
-    tack_foreach(list, el) {
-        buffer *rule = el->data;
-        if (rule) {
-            memcpy(pos, rule->data, rule->size);
-            pos += rule->size;
-        }
+    uint8_t *pos = body->data;
+    for (int t = 0; t < 3; t++) {
+        uint8_t *end = write_ids(pos, lists[t], types[t], NULL, 0);
+        c->chunks[types[t]] = (chunk_span){.offset = pos - body->data, .size = end - pos};
+        pos = end;
     }
-    return buf;
-}
-
-static buffer *buf_concat_free(buffer *first, ...) {
-    size_t size = first->size;
-    va_list args;
-    buffer *cur;
-    va_start(args, first);
-    while ((cur = va_arg(args, buffer *)))
-        size += cur->size;
-    va_end(args);
-
-    buffer *ret = malloc(sizeof(buffer));
-    ret->data = malloc(size);
-    ret->size = size;
-
-    uintptr_t pos = (uintptr_t)ret->data;
-    memcpy((void *)pos, first->data, first->size);
-    pos += first->size;
-    free(first);
-
-    va_start(args, first);
-    while ((cur = va_arg(args, buffer *))) {
-        memcpy((void *)pos, cur->data, cur->size);
-        pos += cur->size;
-        free(cur);
+    c->chunks[CHUNK_RULES] = (chunk_span){.offset = pos - body->data, .size = body->data + size - pos};
+    chunk_header *chunk = (chunk_header *)pos;
+    chunk->type = CHUNK_RULES;
+    chunk->size = c->chunks[CHUNK_RULES].size - sizeof(chunk_header);
+    pos = chunk->data;
+    tack_foreach(&c->rules, ent) {
+        buffer *buf = ent->data;
+        if (!buf) continue;
+        buf->data = pos;
+        pos += buf->size;
     }
-    va_end(args);
-    return ret;
 }
 
 static size_t node_sizeof(Node *node) {
@@ -189,15 +157,33 @@ static size_t node_sizeof(Node *node) {
     def++;                  \
 } while (0)
 
-#define emit_id(typ, list) do { \
-    int id = get_id(list, node->name); \
-    def->type = typ;            \
-    def->val = id;              \
-    node->id = id;              \
-    def++;                      \
-} while (0)
+// numbers words, rule refs and lists locally, in the order the tree first uses them.
+// seen holds index + 1 by name for each of the three types
+static void node_number(Node *node, tack_t *seen, tack_t *first) {
+    Node *child;
+    switch (node->type) {
+        case LITERAL:
+        case RULE:
+        case LIST: {
+            tack_t *table = &seen[node->type - LITERAL];
+            uintptr_t index = (uintptr_t)tack_hget(table, node->name);
+            if (!index) {
+                tack_push(first, node);
+                index = tack_len(first);
+                tack_hset(table, node->name, (void *)index);
+            }
+            node->id = index - 1;
+            break;
+        }
+        default:
+            node_foreach(node, child) {
+                node_number(child, seen, first);
+            }
+            break;
+    }
+}
 
-static int node_compile(Grammar *g, rule_def **pos, Node *node) {
+static void node_emit(rule_def **pos, Node *node) {
     rule_def *def = *pos;
     // start_type
     switch (node->type) {
@@ -217,31 +203,18 @@ static int node_compile(Grammar *g, rule_def **pos, Node *node) {
         case REP:
             *pos = def;
             node_foreach(node, child) {
-                if (node_compile(g, pos, child)) {
-                    return -1;
-                }
+                node_emit(pos, child);
             }
             def = *pos;
             break;
         case LITERAL:
-            emit_id(word_type, &g->words);
+            emit(word_type, node->id);
             break;
         case RULE:
-            emit_id(rule_type, &g->rules);
-            // make sure g->nfa keeps up on IDs
-            if (node->id >= tack_len(&g->nfa)) {
-                tack_push(&g->nfa, NULL);
-            }
-            if (strcmp(node->name, "dgndictation") == 0) {
-                node->id = 1000000;
-            } else if (strcmp(node->name, "dgnwords") == 0) {
-                node->id = 1000001;
-            } else if (strcmp(node->name, "dgnletters") == 0) {
-                node->id = 1000002;
-            }
+            emit(rule_type, node->id);
             break;
         case LIST:
-            emit_id(list_type, &g->lists);
+            emit(list_type, node->id);
             break;
     }
 
@@ -254,58 +227,47 @@ static int node_compile(Grammar *g, rule_def **pos, Node *node) {
         default: break;
     }
     *pos = def;
-    return 0;
 }
 
 #undef emit
-#undef emit_id
 
-static int root_compile(Grammar *g, Node *root, const char *name, char **err) {
-    if (!root)
-        return -1;
-
-    // add rule to grammar
-    node_id *ent = tack_hget(&g->rules, name);
-    if (ent == NULL) {
-        ent = id_new(name, tack_len(&g->rules) + 1);
-        tack_push(&g->rules, ent);
-        tack_hset(&g->rules, name, ent);
-    } else if (ent->data != NULL) {
-        printf("warning: duplicate rule %s\n", name);
-        node_free(root);
-        return 0;
-    }
-    // node_dump(root);
-    root = node_optimize(root);
-
-    // nfa is used to triage recognized phrases
-    // nfa indices MUST be consistent with rule numbers
-    tack_push(&g->nfa, nfa_compile(root));
-
-    // compile rule
-    buffer *buf = ent->data = calloc(1, sizeof(buffer));
-    buf->size = node_sizeof(root) + sizeof(rule_header);
-    buf->data = calloc(1, buf->size);
-    rule_header *header = (rule_header *)buf->data;
-    header->size = buf->size;
-    header->id = ent->id;
-    rule_def *def = (rule_def *)(buf->data + sizeof(rule_header));
-    int rc = node_compile(g, &def, root);
-    if (rc) {
-        free(buf->data);
-        free(buf);
-    }
-    // nodes are referenced by NFAs, so we need a list to free later
-    tack_push(&g->nodes, root);
-    return rc;
-}
+// a rule is compiled (or found in the rule cache) on the worker pool, planned
+// and given grammar ids on the calling thread in grammar order, then linked to
+// those ids on the pool again. on update, rules with unchanged source copy prev instead.
+typedef struct rule_job {
+    const char *name;
+    json_t *value;
+    cached_rule *rule;
+    // grammar id of each of rule's symbols
+    uint32_t *ids;
+    char *err;
+    buffer *buf;
+    nfa_frag *frag;
+    int id;
+    // the old core prev is from, whose ids its rule_defs and nfa use, and the core it moves to
+    const buffer *prev;
+    grammar_core *old, *core;
 
-static int rule_compile(Grammar *g, const char *rule, const char *name, char **err) {
-    Node *root = grammar_parse(rule, err);
-    return root_compile(g, root, name, err);
-}
+    // job index of each rule this one calls, once per use,
+    // and of the rule each local symbol names (-1 for words, lists and imports)
+    tack_t calls;
+    int *callees;
+    // live rules are reachable from an export. attributed rules are exported or
+    // called straight from a public rule, so matched words are reported under their name
+    bool duplicate, live, attributed, recursive, inlined;
+    int uses;
+    // size of the rule_defs, once inlined rules are expanded
+    size_t size;
+    // the inlined rule each local symbol expands to, NULL if none do
+    struct rule_job **inlines;
+    // an inlined rule's expanded rule_defs, which its callers copy
+    rule_def *defs;
+    // strongly connected component search
+    int index, low;
+    bool stacked;
+} rule_job;
 
-static int json_rule_compile(Grammar *g, json_t *rule, const char *name, char **err) {
+static Node *json_rule_parse(arena *a, json_t *rule, const char *name, char **err) {
     switch (json_typeof(rule)) {
         case JSON_ARRAY: {
             int index;
@@ -313,50 +275,563 @@ static int json_rule_compile(Grammar *g, json_t *rule, const char *name, char **
             json_array_foreach(rule, index, ent) {
                 if (json_typeof(ent) != JSON_STRING) {
                     asprintf(err, "Rule array \"%s\" contains a non-string rule.", name);
-                    return -1;
+                    return NULL;
                 }
             }
-            Node *root = node_new(ALT, NULL);
+            Node *root = node_new(a, ALT, NULL);
             json_array_foreach(rule, index, ent) {
-                Node *node = grammar_parse(json_string_value(ent), err);
+                Node *node = grammar_parse(a, json_string_value(ent), err);
                 if (!node) {
                     node_free(root);
-                    return -1;
+                    return NULL;
                 }
                 node_push(root, node);
             }
-            return root_compile(g, root, name, err);
+            return root;
         }
         case JSON_STRING:
-            return rule_compile(g, json_string_value(rule), name, err);
+            return grammar_parse(a, json_string_value(rule), err);
         default:
             asprintf(err, "Rule \"%s\" has unsupported json type. Must be a string or array of strings.", name);
-            return -1;
+            return NULL;
+    }
+}
+
+// compiles an optimized tree into a rule that can be linked into any grammar
+static cached_rule *rule_build(Node *root) {
+    tack_t seen[3] = {{0}}, first = {0};
+    node_number(root, seen, &first);
+    cached_rule *rule = calloc(1, sizeof(cached_rule));
+    rule->refs = 1;
+    rule->sym_count = tack_len(&first);
+    rule->syms = malloc(rule->sym_count * sizeof(rule_symbol) + 1);
+    Node *node;
+    tack_foreach(&first, node) {
+        rule->syms[i] = (rule_symbol){.type = node->type, .name = intern_name(node->name)};
     }
+    rule->defs_size = node_sizeof(root);
+    rule->defs = calloc(1, rule->defs_size);
+    rule_def *def = (rule_def *)rule->defs;
+    node_emit(&def, root);
+    // nfa is used to triage recognized phrases
+    rule->frag = nfa_compile(root);
+    rule->size = sizeof(cached_rule) + rule->sym_count * sizeof(rule_symbol) + rule->defs_size +
+                 rule->frag->state_count * sizeof(nfa_state) + rule->frag->edge_count * sizeof(uint32_t);
+    for (int t = 0; t < 3; t++) tack_clear(&seen[t]);
+    tack_clear(&first);
+    return rule;
+}
+
+bool rule_shared(const char *name) {
+    return name[0] == ':' && strcmp(name, CORE_MAIN) != 0;
 }
 
-static char *global_imports[] = {
-    "dgndictation",
-    "dgnletters",
-    "dgnwords",
-    NULL,
+// whether two shared rules of the same name compiled from the same subtree
+static bool rule_same(const cached_rule *a, const cached_rule *b) {
+    if (a == b)
+        return true;
+    if (a->sym_count != b->sym_count || a->defs_size != b->defs_size || memcmp(a->defs, b->defs, a->defs_size))
+        return false;
+    for (uint32_t i = 0; i < a->sym_count; i++) {
+        if (a->syms[i].type != b->syms[i].type || a->syms[i].name != b->syms[i].name)
+            return false;
+    }
+    return true;
+}
+
+// replaces large groups with references to rules named by their structural hash, so
+// rules (and parts of one rule) with the same subtree call one definition of it.
+// shared gets each distinct subtree by name, inner subtrees before the ones holding them
+static void rule_share(Node *node, tack_t *shared) {
+    Node *child;
+    for (int i = 0; i < tack_len(&node->children); i++) {
+        child = tack_get(&node->children, i);
+        if (child->type > REP)
+            continue;
+        rule_share(child, shared);
+        if (node_sizeof(child) < SHARE_SIZE)
+            continue;
+        char name[34];
+        snprintf(name, sizeof(name), ":%016llx%016llx",
+                 (unsigned long long)node_hash(child, NODE_HASH_SEED),
+                 (unsigned long long)node_hash(child, ~NODE_HASH_SEED));
+        Node *prev = tack_hget(shared, name);
+        if (prev) {
+            // the hash only names the subtree, so a different one that hashes the same stays
+            // where it is. prev has taken the shared name already
+            char *own = child->name;
+            child->name = prev->name;
+            bool same = node_equal(prev, child);
+            child->name = own;
+            if (!same)
+                continue;
+            node_free(child);
+        } else {
+            // groups are unnamed, so the subtree keeps its rule name there
+            child->name = arena_strdup(node->arena, name);
+            child->parent = NULL;
+            tack_hset(shared, name, child);
+            tack_push(shared, child);
+        }
+        Node *ref = node_new(node->arena, RULE, arena_strdup(node->arena, name));
+        ref->parent = node;
+        tack_set(&node->children, i, ref);
+    }
+}
+
+static void rule_compile_job(void *ctx, int index) {
+    rule_job *job = (rule_job *)ctx + index;
+    if (job->rule || job->prev || (job->rule = rule_cache_get(job->value)))
+        return;
+    // the rule's tree lives in its own arena, freed once the rule is built
+    arena *nodes = arena_new(4 * 1024);
+    Node *root = json_rule_parse(nodes, job->value, job->name, &job->err);
+    if (!root) {
+        arena_free(nodes);
+        return;
+    }
+    root = node_optimize(root);
+    tack_t shared = {0};
+    if (node_passes() & PASS_SHARE)
+        rule_share(root, &shared);
+    job->rule = rule_build(root);
+    node_free(root);
+    if (tack_len(&shared)) {
+        cached_rule *rule = job->rule;
+        rule->shared_count = tack_len(&shared);
+        rule->shared = malloc(rule->shared_count * sizeof(cached_rule *));
+        Node *sub;
+        tack_foreach(&shared, sub) {
+            cached_rule *split = rule->shared[i] = rule_build(sub);
+            split->name = intern_name(sub->name);
+            rule->size += split->size;
+            node_free(sub);
+        }
+    }
+    tack_clear(&shared);
+    arena_free(nodes);
+    rule_cache_put(job->value, job->rule);
+}
+
+static tack_t *symbol_table(grammar_core *c, uint32_t type) {
+    switch (type) {
+        case LITERAL: return &c->words;
+        case RULE: return &c->rules;
+        default: return &c->lists;
+    }
+}
+
+// the same, by rule_def or nfa state type. NULL for types that aren't symbols
+static tack_t *def_table(grammar_core *c, uint32_t type) {
+    if (type == word_type) return &c->words;
+    if (type == rule_type) return &c->rules;
+    if (type == list_type) return &c->lists;
+    return NULL;
+}
+
+static tack_t *state_table(grammar_core *c, uint32_t type) {
+    switch (type) {
+        case NFA_WORD: return &c->words;
+        case NFA_RULE: return &c->rules;
+        default: return &c->lists;
+    }
+}
+
+// the id in to of the symbol named by id in from
+static uint32_t id_move(tack_t *from, tack_t *to, uint32_t id) {
+    node_id *ent = tack_get(from, id - 1);
+    return ((node_id *)tack_hget(to, ent->name))->id;
+}
+
+// adds a parsed rule to the grammar and numbers its nodes, or drops it if it's a duplicate.
+// inlined rules only number their nodes, as they're copied into their callers
+static void rule_define(grammar_core *c, rule_job *job, rule_job *jobs) {
+    node_id *ent = tack_hget(&c->rules, job->name);
+    if (!job->inlined && ent == NULL) {
+        ent = id_new(c->arena, job->name, tack_len(&c->rules) + 1);
+        tack_push(&c->rules, ent);
+        tack_hset(&c->rules, job->name, ent);
+    } else if (!job->inlined && ent->data != NULL) {
+        printf("warning: duplicate rule %s\n", job->name);
+        rule_cache_release(job->rule);
+        job->rule = NULL;
+        job->prev = NULL;
+        return;
+    }
+
+    // ids are assigned one rule after another, so they (and the packed
+    // grammar) don't depend on which worker finished first. on update, a
+    // reused rule's symbols are named by the old core's ids, and only the
+    // ones still used get an id here
+    if (job->prev) {
+        const rule_def *def = (const rule_def *)(job->prev->data + sizeof(rule_header));
+        for (size_t i = 0; i < job->size / sizeof(rule_def); i++) {
+            tack_t *table = def_table(job->old, def[i].type);
+            if (table) {
+                node_id *sym = tack_get(table, def[i].val - 1);
+                get_id(c->arena, def_table(c, def[i].type), sym->name);
+            }
+        }
+    } else {
+        cached_rule *rule = job->rule;
+        job->ids = malloc(rule->sym_count * sizeof(uint32_t) + 1);
+        for (uint32_t i = 0; i < rule->sym_count; i++) {
+            rule_symbol *sym = &rule->syms[i];
+            rule_job *callee = job->callees && job->callees[i] >= 0 ? &jobs[job->callees[i]] : NULL;
+            if (callee && callee->inlined) {
+                if (!job->inlines) job->inlines = calloc(rule->sym_count, sizeof(rule_job *));
+                job->inlines[i] = callee;
+                job->ids[i] = 0;
+            } else {
+                job->ids[i] = get_id(c->arena, symbol_table(c, sym->type), sym->name);
+            }
+        }
+    }
+    if (job->inlined)
+        return;
+
+    // the buffer is sized here, and placed in the body by core_layout once every rule is
+    buffer *buf = arena_alloc(c->arena, sizeof(buffer));
+    buf->size = job->size + sizeof(rule_header);
+    buf->data = NULL;
+    ent->data = job->buf = buf;
+    job->id = ent->id;
+}
+
+// writes a rule's rule_defs in grammar ids, copying inlined rules in place of their references
+static void rule_expand(rule_job *job, rule_def *def) {
+    cached_rule *rule = job->rule;
+    const rule_def *src = (const rule_def *)rule->defs;
+    for (size_t i = 0; i < rule->defs_size / sizeof(rule_def); i++) {
+        rule_job *callee = job->inlines && src[i].type == rule_type ? job->inlines[src[i].val] : NULL;
+        if (callee) {
+            memcpy(def, callee->defs, callee->size);
+            def += callee->size / sizeof(rule_def);
+            continue;
+        }
+        *def = src[i];
+        if (def->type == word_type || def->type == rule_type || def->type == list_type)
+            def->val = job->ids[def->val];
+        def++;
+    }
+}
+
+// inlined rules are emitted before their callers, which copy their rule_defs and nfa
+static void rule_emit(rule_job *job) {
+    rule_def *def;
+    if (job->inlined) {
+        def = job->defs = malloc(job->size + 1);
+    } else {
+        rule_header *header = (rule_header *)job->buf->data;
+        header->size = job->buf->size;
+        header->id = job->id;
+        def = (rule_def *)(job->buf->data + sizeof(rule_header));
+    }
+    if (job->prev) {
+        // moved from the old core's ids to this one's
+        grammar_core *old = job->old;
+        memcpy(def, job->prev->data + sizeof(rule_header), job->size);
+        for (size_t i = 0; i < job->size / sizeof(rule_def); i++) {
+            tack_t *table = def_table(old, def[i].type);
+            if (table) def[i].val = id_move(table, def_table(job->core, def[i].type), def[i].val);
+        }
+        job->frag = nfa_extract(old->nfa, ((rule_header *)job->prev->data)->id);
+        for (uint32_t i = 0; i < job->frag->state_count; i++) {
+            nfa_state *state = &job->frag->states[i];
+            state->id = id_move(state_table(old, state->type), state_table(job->core, state->type), state->id);
+        }
+        return;
+    }
+    cached_rule *rule = job->rule;
+    rule_expand(job, def);
+    nfa_frag **subs = NULL;
+    if (job->inlines) {
+        subs = calloc(rule->sym_count, sizeof(nfa_frag *));
+        for (uint32_t i = 0; i < rule->sym_count; i++) {
+            if (job->inlines[i]) subs[i] = job->inlines[i]->frag;
+        }
+    }
+    job->frag = nfa_relabel(rule->frag, job->ids, subs);
+    free(subs);
+    rule_cache_release(rule);
+    job->rule = NULL;
+    free(job->ids);
+    job->ids = NULL;
+}
+
+static void rule_emit_job(void *ctx, int index) {
+    rule_job *job = (rule_job *)ctx + index;
+    if (job->live && !job->inlined)
+        rule_emit(job);
+}
+
+// dragon reports words matched by its global rules under these rule numbers
+static const struct {
+    const char *name;
+    uint32_t id;
+} global_imports[] = {
+    {"dgndictation", 1000000},
+    {"dgnletters", 1000002},
+    {"dgnwords", 1000001},
+    {NULL, 0},
 };
 
-int grammar_compile(Grammar **grammar, json_t *j, char **err) {
-    int ret = 0;
+uint32_t dragon_rule_id(const char *name) {
+    for (int i = 0; global_imports[i].name; i++) {
+        if (strcmp(global_imports[i].name, name) == 0) {
+            return global_imports[i].id;
+        }
+    }
+    return 0;
+}
 
-    char *data = NULL, *name = NULL;
-    json_t *public = NULL, *private = NULL;
-    json_error_t json_err;
-    if (json_unpack_ex(j, &json_err, 0, "{s:s, s:o}", "name", &name, "public", &public)) {
-        *err = strdup(json_err.text);
-        return -1;
+// finds the job each of a compiled rule's symbols calls. returns the name of a rule that isn't defined
+static const char *rule_resolve(rule_job *job, tack_t *names) {
+    cached_rule *rule = job->rule;
+    job->callees = malloc(rule->sym_count * sizeof(int) + 1);
+    for (uint32_t i = 0; i < rule->sym_count; i++) {
+        job->callees[i] = -1;
+        if (rule->syms[i].type != RULE)
+            continue;
+        uintptr_t callee = (uintptr_t)tack_hget(names, rule->syms[i].name);
+        if (callee) {
+            job->callees[i] = callee - 1;
+        } else if (!dragon_rule_id(rule->syms[i].name)) {
+            return rule->syms[i].name;
+        }
     }
-    json_unpack(j, "{s:o}", "private", &private);
-    Grammar *g = *grammar = calloc(1, sizeof(Grammar));
-    g->name = strdup(name);
+    return NULL;
+}
+
+// collects the jobs a rule calls, once per use. returns the name of a rule it calls that isn't defined
+static const char *rule_calls(rule_job *job, tack_t *names) {
+    const rule_def *def;
+    size_t count;
+    const char *undefined = NULL;
+    if (job->prev) {
+        def = (const rule_def *)(job->prev->data + sizeof(rule_header));
+        count = (job->prev->size - sizeof(rule_header)) / sizeof(rule_def);
+    } else {
+        def = (const rule_def *)job->rule->defs;
+        count = job->rule->defs_size / sizeof(rule_def);
+        undefined = rule_resolve(job, names);
+    }
+    job->size = count * sizeof(rule_def);
+    for (size_t i = 0; !undefined && i < count; i++) {
+        if (def[i].type != rule_type)
+            continue;
+        if (!job->prev) {
+            if (job->callees[def[i].val] >= 0) tack_push_int(&job->calls, job->callees[def[i].val]);
+            continue;
+        }
+        // a reused rule's values are the old grammar's ids
+        node_id *ent = tack_get(&job->old->rules, def[i].val - 1);
+        uintptr_t callee = (uintptr_t)tack_hget(names, ent->name);
+        if (callee) {
+            tack_push_int(&job->calls, callee - 1);
+        } else if (!dragon_rule_id(ent->name)) {
+            undefined = ent->name;
+        }
+    }
+    return undefined;
+}
+
+// tarjan's strongly connected components, from the exports down. rules are appended
+// to order callees first, and any rule in a cycle is marked recursive
+static void rule_visit(rule_job *jobs, int i, int *counter, tack_t *stack, tack_t *order) {
+    rule_job *job = &jobs[i];
+    job->live = true;
+    job->index = job->low = ++*counter;
+    job->stacked = true;
+    tack_push_int(stack, i);
+    bool self = false;
+    for (int k = 0; k < tack_len(&job->calls); k++) {
+        int callee = tack_get_int(&job->calls, k);
+        rule_job *next = &jobs[callee];
+        self = self || callee == i;
+        if (!next->index) {
+            rule_visit(jobs, callee, counter, stack, order);
+            if (next->low < job->low) job->low = next->low;
+        } else if (next->stacked && next->index < job->low) {
+            job->low = next->index;
+        }
+    }
+    if (job->low != job->index)
+        return;
+    int top, members = 0;
+    do {
+        top = tack_pop_int(stack);
+        jobs[top].stacked = false;
+        tack_push_int(order, top);
+        members++;
+    } while (top != i);
+    if (members > 1 || self) {
+        for (int k = tack_len(order) - members; k < tack_len(order); k++) {
+            jobs[tack_get_int(order, k)].recursive = true;
+        }
+    }
+}
+
+// marks the rules a public rule calls as attributed. shared rules are part of their
+// callers for attribution, so the rules they call are marked instead
+static void rule_attribute(rule_job *jobs, rule_job *job) {
+    for (int k = 0; k < tack_len(&job->calls); k++) {
+        rule_job *callee = &jobs[tack_get_int(&job->calls, k)];
+        if (rule_shared(callee->name)) {
+            rule_attribute(jobs, callee);
+        } else {
+            callee->attributed = true;
+        }
+    }
+}
 
-    // when we see a rule ref during rule_compile:
+// finds the rules reachable from an export, and picks the private rules to inline into
+// their callers: those used once or small enough to copy, unless they're recursive or
+// attributed. rules no export reaches aren't defined at all, so neither are their words,
+// but their lists still are.
+// jobs from public_end on are shared rules, which are private but never attributed
+static int rule_plan(rule_job *jobs, int count, int public_start, int public_end,
+                     tack_t *names, tack_t *order, char **err) {
+    for (int i = 0; i < count; i++) {
+        if (tack_hget(names, jobs[i].name)) {
+            jobs[i].duplicate = true;
+        } else {
+            tack_hset(names, jobs[i].name, (void *)(uintptr_t)(i + 1));
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].duplicate)
+            continue;
+        const char *undefined = rule_calls(&jobs[i], names);
+        if (undefined) {
+            asprintf(err, "rule referenced but not defined \"%s\"", undefined);
+            return -1;
+        }
+    }
+
+    // a name that's both private and public is exported with the private definition
+    tack_t stack = {0};
+    int counter = 0;
+    for (int i = public_start; i < public_end; i++) {
+        rule_job *job = &jobs[(uintptr_t)tack_hget(names, jobs[i].name) - 1];
+        job->attributed = true;
+        rule_attribute(jobs, job);
+        if (!job->index)
+            rule_visit(jobs, job - jobs, &counter, &stack, order);
+    }
+    tack_clear(&stack);
+
+    for (int n = 0; n < tack_len(order); n++) {
+        rule_job *job = &jobs[tack_get_int(order, n)];
+        for (int k = 0; k < tack_len(&job->calls); k++) {
+            jobs[tack_get_int(&job->calls, k)].uses++;
+        }
+    }
+    // callees are decided first, so a rule's size counts the rules expanded into it
+    for (int n = 0; n < tack_len(order); n++) {
+        int i = tack_get_int(order, n);
+        rule_job *job = &jobs[i];
+        for (int k = 0; k < tack_len(&job->calls); k++) {
+            rule_job *callee = &jobs[tack_get_int(&job->calls, k)];
+            if (callee->inlined) job->size += callee->size - sizeof(rule_def);
+        }
+        job->inlined = (i < public_start || i >= public_end) && !job->attributed && !job->recursive &&
+                       (job->uses == 1 || job->size <= INLINE_SIZE);
+    }
+    return 0;
+}
+
+// whether rule id can end without consuming words, given the rules already known to be nullable
+static bool rule_nullable(nfa *n, uint32_t id, bool *nullable, uint32_t *seen, uint32_t stamp, tack_t *stack) {
+    nfa_rule *rule = &n->rules[id - 1];
+    for (uint32_t e = rule->entry; e < rule->entry + rule->entry_count; e++) {
+        tack_push_int(stack, n->edges[e]);
+    }
+    bool found = false;
+    while (!found && tack_len(stack) > 0) {
+        uint32_t target = tack_pop_int(stack);
+        if (target == NFA_END) {
+            found = true;
+        } else if (seen[target] != stamp) {
+            seen[target] = stamp;
+            nfa_state *state = &n->states[target];
+            if (state->type == NFA_RULE && nullable[state->id - 1]) {
+                for (uint32_t e = state->edge; e < state->edge + state->count; e++) {
+                    tack_push_int(stack, n->edges[e]);
+                }
+            }
+        }
+    }
+    while (tack_len(stack) > 0) tack_pop_int(stack);
+    return found;
+}
+
+// builds the reverse rule reference graph and nullable rule table used for guided matching
+void grammar_graph(grammar_core *c) {
+    rule_graph *graph = &c->graph;
+    nfa *n = c->nfa;
+    uint32_t count = graph->count = n->rule_count;
+    graph->index = arena_calloc(c->arena, (count + 2) * sizeof(uint32_t));
+    graph->nullable = arena_calloc(c->arena, count * sizeof(bool));
+
+    // bucket (child, parent) pairs by child
+    for (uint32_t r = 0; r < count; r++) {
+        nfa_rule *rule = &n->rules[r];
+        for (uint32_t s = rule->state; s < rule->state + rule->state_count; s++) {
+            if (n->states[s].type == NFA_RULE) graph->index[n->states[s].id + 1]++;
+        }
+    }
+    for (uint32_t i = 1; i <= count + 1; i++) {
+        graph->index[i] += graph->index[i - 1];
+    }
+    graph->parents = arena_calloc(c->arena, graph->index[count + 1] * sizeof(uint32_t));
+    uint32_t *fill = malloc((count + 1) * sizeof(uint32_t));
+    memcpy(fill, graph->index, (count + 1) * sizeof(uint32_t));
+    for (uint32_t r = 0; r < count; r++) {
+        nfa_rule *rule = &n->rules[r];
+        for (uint32_t s = rule->state; s < rule->state + rule->state_count; s++) {
+            if (n->states[s].type == NFA_RULE) graph->parents[fill[n->states[s].id]++] = r + 1;
+        }
+    }
+    free(fill);
+
+    uint32_t *seen = calloc(n->state_count + 1, sizeof(uint32_t));
+    uint32_t stamp = 0;
+    tack_t stack = {0};
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uint32_t id = 1; id <= count; id++) {
+            if (!graph->nullable[id - 1] && !n->rules[id - 1].import &&
+                    rule_nullable(n, id, graph->nullable, seen, ++stamp, &stack)) {
+                graph->nullable[id - 1] = true;
+                changed = true;
+            }
+        }
+    }
+    tack_clear(&stack);
+    free(seen);
+}
+
+// the source the old grammar compiled name from (private wins over public, as in rule_define)
+static json_t *rule_source(grammar_core *c, const char *name) {
+    json_t *value = c->private ? json_object_get(c->private, name) : NULL;
+    return value ? value : json_object_get(c->public, name);
+}
+
+// compiles rules into a new core. with old, unchanged rules are copied from it
+static int core_build(grammar_core **core, grammar_core *old, json_t *public, json_t *private, char **err) {
+    int ret = 0;
+
+    grammar_core *c = *core = calloc(1, sizeof(grammar_core));
+    c->refs = 1;
+    // everything that lives as long as the core comes from its arena
+    c->arena = arena_new(64 * 1024);
+    tack_t frags = {0}, names = {0}, order = {0};
+    c->public = json_incref(public);
+    c->private = private ? json_incref(private) : NULL;
+
+    // when we see a rule ref during rule_define:
     // 1. tack_hget(rules, "rulename") - if this exists, that's the `node_id`
     // 2. tack_hset(rules, "rulename", id_new("rulename", tack_len())); tack_push(rules, id_ent); - that's the rule_id
     // add to exports if this is an exported rule, but with the same id
@@ -365,159 +840,457 @@ int grammar_compile(Grammar **grammar, json_t *j, char **err) {
     // warn on: duplicate rule
     // warn on: undefined rule (at end of grammar compile) - this means undefined rules need their name in the iterable list
     /*
-    tack_hset(&g->exports, "rulename", id_new("rulename", tack_len(...)));
-    tack_hset(&g->rules, "rulename", id_new("rulename", tack_len(...)));
-    tack_hset(&g->lists, "listname", id_new("rulename", tack_len(...)));
-    tack_hset(&g->words, "wordname", id_new("rulename", tack_len(...)));
+    tack_hset(&c->exports, "rulename", id_new("rulename", tack_len(...)));
+    tack_hset(&c->rules, "rulename", id_new("rulename", tack_len(...)));
+    tack_hset(&c->lists, "listname", id_new("rulename", tack_len(...)));
+    tack_hset(&c->words, "wordname", id_new("rulename", tack_len(...)));
     */
 
-    // parse private rules
+    // private rules first, then public rules
     const char *key;
     json_t *value;
+    int job_count = 0, public_start, public_end;
+    rule_job *jobs = calloc((private ? json_object_size(private) : 0) + json_object_size(public) + 1,
+                            sizeof(rule_job));
     if (private) {
         json_object_foreach(private, key, value) {
-            if (json_rule_compile(g, value, key, err)) {
-                ret = -1;
-                goto cleanup;
-            }
+            jobs[job_count++] = (rule_job){.name = key, .value = value};
         }
     }
-
-    // parse public rules
+    public_start = job_count;
     json_object_foreach(public, key, value) {
-        if (json_rule_compile(g, value, key, err)) {
+        jobs[job_count++] = (rule_job){.name = key, .value = value};
+    }
+    // names starting with ':' are the compiler's, for the main rule and shared subtrees
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i].name[0] == ':') {
+            asprintf(err, "rule name \"%s\" can't start with ':'", jobs[i].name);
             ret = -1;
             goto cleanup;
         }
-        // add to exports
-        if (tack_hexists(&g->exports, key)) {
-            printf("warning: skipping duplicate export of \"%s\"\n", key);
-        } else {
-            node_id *ent = tack_hget(&g->rules, key);
-            node_id *export = id_new(NULL, ent->id);
-            asprintf((char **)&export->name, "%s:%s", name, ent->name);
-            tack_hset(&g->exports, key, export);
-            tack_push(&g->exports, export);
-            // leave a trail back so final rule compile will get the right name
-            tack_hset(&g->exports, export->name, ent);
+    }
+    for (int i = 0; old && i < job_count; i++) {
+        json_t *source = rule_source(old, jobs[i].name);
+        node_id *ent = tack_hget(&old->rules, jobs[i].name);
+        // rules with others inlined into them or calling shared rules are compiled
+        // again, as those may have changed
+        if (source && ent && ent->data && !old->dependent[ent->id - 1] && json_equal(source, jobs[i].value)) {
+            jobs[i].prev = ent->data;
+            jobs[i].old = old;
+            jobs[i].core = c;
         }
     }
 
-    // sanity check rules and autoimport
-    node_id *ent;
-    tack_foreach(&g->rules, ent) {
-        if (ent->data == NULL) {
-            // autoimport global dragon rules
-            char **pos = global_imports;
-            bool dgn = false;
-            while (*pos) {
-                if (strcmp(*pos++, ent->name) == 0) {
-                    tack_push(&g->imports, ent);
-                    dgn = true;
+    // rules go through the pool a batch at a time
+    pool *workers = pool_shared();
+    for (int start = 0; start < job_count; start += RULE_BATCH) {
+        int count = job_count - start < RULE_BATCH ? job_count - start : RULE_BATCH;
+        pool_run(workers, count, rule_compile_job, jobs + start);
+    }
+    // report the first failure in grammar order, as a serial compile would
+    for (int i = 0; i < job_count; i++) {
+        if (!jobs[i].rule && !jobs[i].prev) {
+            *err = jobs[i].err;
+            jobs[i].err = NULL;
+            ret = -1;
+            goto cleanup;
+        }
+    }
+    // subtrees split out of the rules become jobs of their own, defined once however
+    // many rules share them
+    public_end = job_count;
+    size_t shared_count = 0;
+    for (int i = 0; i < public_end; i++) {
+        if (jobs[i].rule) shared_count += jobs[i].rule->shared_count;
+    }
+    if (shared_count) {
+        jobs = realloc(jobs, (job_count + shared_count + 1) * sizeof(rule_job));
+        tack_t seen = {0};
+        for (int i = 0; i < public_end; i++) {
+            cached_rule *rule = jobs[i].rule;
+            for (uint32_t k = 0; rule && k < rule->shared_count; k++) {
+                cached_rule *shared = rule->shared[k];
+                cached_rule *prev = tack_hget(&seen, shared->name);
+                if (prev && !rule_same(prev, shared)) {
+                    asprintf(err, "rule \"%s\" has a subtree whose shared name another one has", jobs[i].name);
+                    tack_clear(&seen);
+                    ret = -1;
+                    goto cleanup;
                 }
+                if (prev)
+                    continue;
+                tack_hset(&seen, shared->name, shared);
+                rule_cache_retain(shared);
+                jobs[job_count++] = (rule_job){.name = shared->name, .rule = shared};
             }
-            if (dgn) {
-                // compile a RULESTUB nfa for imports (nfa->edges = NULL, nfa->node = RULE)
-                nfa *n = calloc(1, sizeof(nfa));
-                n->count = 0;
-                n->node = calloc(1, sizeof(Node));
-                n->node->type = RULE;
-                n->node->id = ent->id;
-                n->node->name = strdup(ent->name);
-                tack_set(&g->nfa, ent->id - 1, n);
-                tack_push(&g->nodes, n->node);
-            } else {
-                asprintf(err, "rule referenced but not defined \"%s\"", ent->name);
+        }
+        tack_clear(&seen);
+    }
+    if (rule_plan(jobs, job_count, public_start, public_end, &names, &order, err)) {
+        ret = -1;
+        goto cleanup;
+    }
+    // a reused rule's rule_defs can't have rules that are inlined now expanded into them
+    bool recompile = false;
+    for (int i = 0; i < job_count; i++) {
+        rule_job *job = &jobs[i];
+        for (int k = 0; job->live && job->prev && k < tack_len(&job->calls); k++) {
+            if (jobs[tack_get_int(&job->calls, k)].inlined) {
+                job->prev = NULL;
+                recompile = true;
+            }
+        }
+    }
+    if (recompile) {
+        pool_run(workers, job_count, rule_compile_job, jobs);
+        for (int i = 0; i < job_count; i++) {
+            if (jobs[i].live && !jobs[i].rule && !jobs[i].prev) {
+                *err = jobs[i].err;
+                jobs[i].err = NULL;
                 ret = -1;
                 goto cleanup;
             }
+            // rules that are reused don't call shared rules, and those compile the same as before
+            const char *undefined = NULL;
+            if (jobs[i].live && !jobs[i].callees && !jobs[i].prev)
+                undefined = rule_resolve(&jobs[i], &names);
+            if (undefined) {
+                asprintf(err, "rule referenced but not defined \"%s\"", undefined);
+                ret = -1;
+                goto cleanup;
+            }
+        }
+    }
+
+    for (int i = 0; i < job_count; i++) {
+        rule_job *job = &jobs[i];
+        key = job->name;
+        // rules no export reaches are dropped, and duplicates are warned about
+        if (job->live || (i >= public_start && i < public_end))
+            rule_define(c, job, jobs);
+        if (i < public_start || i >= public_end)
+            continue;
+        // add to exports. they're named per grammar when packed
+        if (tack_hexists(&c->exports, key)) {
+            printf("warning: skipping duplicate export of \"%s\"\n", key);
+        } else {
+            node_id *ent = tack_hget(&c->rules, key);
+            node_id *export = id_new(c->arena, ent->name, ent->id);
+            tack_hset(&c->exports, key, export);
+            tack_push(&c->exports, export);
+        }
+    }
+
+    // lists only used by rules no export reaches are still declared, so g.list.set
+    // works on every list the grammar names
+    for (int i = 0; i < job_count; i++) {
+        rule_job *job = &jobs[i];
+        if (job->live || job->duplicate)
+            continue;
+        if (job->prev) {
+            const rule_def *def = (const rule_def *)(job->prev->data + sizeof(rule_header));
+            for (size_t k = 0; k < job->size / sizeof(rule_def); k++) {
+                node_id *list = def[k].type == list_type ? tack_get(&job->old->lists, def[k].val - 1) : NULL;
+                if (list) get_id(c->arena, &c->lists, list->name);
+            }
+        }
+        for (uint32_t k = 0; job->rule && k < job->rule->sym_count; k++) {
+            if (job->rule->syms[k].type == LIST) get_id(c->arena, &c->lists, job->rule->syms[k].name);
         }
     }
 
     // now create and export one big ALT rule for all public rules
-    Node *root = node_new(ALT, NULL);
-    tack_foreach(&g->exports, ent) {
-        // look up original rule ent for export
-        ent = tack_hget(&g->exports, ent->name);
-        node_push(root, node_new(RULE, strdup(ent->name)));
-    }
-    asprintf((char **)&g->main_rule, "%s::main", name);
-    if (root_compile(g, root, g->main_rule, err)) {
-        ret = -1;
-        goto cleanup;
+    // names are interned, so the nodes can use them as is
+    arena *nodes = arena_new(4 * 1024);
+    Node *root = node_new(nodes, ALT, NULL);
+    node_id *ent;
+    tack_foreach(&c->exports, ent) {
+        node_push(root, node_new(nodes, RULE, (char *)ent->name));
+    }
+    rule_job main_job = {.name = CORE_MAIN, .live = true, .rule = rule_build(root)};
+    main_job.size = main_job.rule->defs_size;
+    node_free(root);
+    arena_free(nodes);
+    rule_define(c, &main_job, jobs);
+    ent = tack_hget(&c->rules, CORE_MAIN);
+    // exports get their own entry, as they are renamed
+    ent = id_new(c->arena, ent->name, ent->id);
+    tack_hset(&c->exports, CORE_MAIN, ent);
+    tack_push(&c->exports, ent);
+
+    // autoimport global dragon rules. undefined rules were reported by rule_plan
+    bool *referenced = calloc(tack_len(&c->rules) + 1, sizeof(bool));
+    for (int i = 0; i < job_count; i++) {
+        rule_job *job = &jobs[i];
+        if (job->prev && job->live) {
+            const rule_def *def = (const rule_def *)(job->prev->data + sizeof(rule_header));
+            for (size_t k = 0; k < job->size / sizeof(rule_def); k++) {
+                if (def[k].type == rule_type) referenced[id_move(&job->old->rules, &c->rules, def[k].val)] = true;
+            }
+        }
+        for (uint32_t k = 0; job->ids && k < job->rule->sym_count; k++) {
+            if (job->rule->syms[k].type == RULE) referenced[job->ids[k]] = true;
+        }
+    }
+    tack_foreach(&c->rules, ent) {
+        if (ent->data == NULL && referenced[ent->id] && dragon_rule_id(ent->name))
+            tack_push(&c->imports, ent);
+    }
+    free(referenced);
+
+    // every id is known now, so the body is laid out once and rules are emitted into it
+    core_layout(c);
+    // inlined rules are emitted callees first, before the rules they're copied into
+    for (int n = 0; n < tack_len(&order); n++) {
+        rule_job *job = &jobs[tack_get_int(&order, n)];
+        if (job->inlined)
+            rule_emit(job);
+    }
+    for (int start = 0; start < job_count; start += RULE_BATCH) {
+        int count = job_count - start < RULE_BATCH ? job_count - start : RULE_BATCH;
+        pool_run(workers, count, rule_emit_job, jobs + start);
+    }
+    rule_emit_job(&main_job, 0);
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i].frag && !jobs[i].inlined)
+            tack_set(&frags, jobs[i].id - 1, jobs[i].frag);
+    }
+    tack_set(&frags, main_job.id - 1, main_job.frag);
+    // imports are matched by dragon's rule number, so they have no states
+    tack_foreach(&c->imports, ent) {
+        tack_set(&frags, ent->id - 1, nfa_import(dragon_rule_id(ent->name)));
+    }
+
+    c->dependent = arena_calloc(c->arena, tack_len(&c->rules) * sizeof(bool) + 1);
+    for (int i = 0; i < job_count; i++) {
+        rule_job *job = &jobs[i];
+        if (!job->live || job->inlined || job->duplicate)
+            continue;
+        bool dependent = job->inlines != NULL;
+        for (int k = 0; !dependent && k < tack_len(&job->calls); k++) {
+            dependent = rule_shared(jobs[tack_get_int(&job->calls, k)].name);
+        }
+        c->dependent[job->id - 1] = dependent;
     }
-    ent = tack_hget(&g->rules, g->main_rule);
-    // copy ent because exports are freed separately (as they are renamed)
-    ent = id_new(ent->name, ent->id);
-    tack_hset(&g->exports, g->main_rule, ent);
-    tack_push(&g->exports, ent);
 
-    // pack into binary grammar blob
+    // link rule nfas into one block. unused ids get an empty rule, so the nfa has one per id
+    if (tack_len(&frags) < tack_len(&c->rules))
+        tack_set(&frags, tack_len(&c->rules) - 1, NULL);
+    c->nfa = nfa_link(c->arena, &frags);
+    grammar_graph(c);
+cleanup:
+    for (int i = 0; i < job_count; i++) {
+        rule_cache_release(jobs[i].rule);
+        free(jobs[i].ids);
+        free(jobs[i].err);
+        tack_clear(&jobs[i].calls);
+        free(jobs[i].callees);
+        free(jobs[i].inlines);
+        free(jobs[i].defs);
+        if (jobs[i].inlined)
+            nfa_frag_free(jobs[i].frag);
+    }
+    free(jobs);
+    tack_clear(&names);
+    tack_clear(&order);
+    for (int i = 0; i < tack_len(&frags); i++) nfa_frag_free(tack_get(&frags, i));
+    tack_clear(&frags);
+    if (ret != 0) {
+        core_free(c);
+        *core = NULL;
+    }
+    return ret;
+}
+
+static bool sources_equal(grammar_core *c, json_t *public, json_t *private) {
+    if (!json_equal(c->public, public))
+        return false;
+    return c->private ? private && json_equal(c->private, private) : !private;
+}
+
+// returns a reference to the loaded core compiled from these sources, if there is one
+static grammar_core *core_find(cache_key *key, json_t *public, json_t *private) {
+    pthread_mutex_lock(&cores_lock);
+    grammar_core *c = tack_hget(&cores, key->name);
+    if (c && sources_equal(c, public, private)) {
+        c->refs++;
+    } else {
+        c = NULL;
+    }
+    pthread_mutex_unlock(&cores_lock);
+    return c;
+}
+
+// registers a new core under key, or hands back an identical one that was registered first
+static grammar_core *core_share(grammar_core *c, cache_key *key) {
+    pthread_mutex_lock(&cores_lock);
+    grammar_core *found = tack_hget(&cores, key->name);
+    if (found && sources_equal(found, c->public, c->private)) {
+        found->refs++;
+        pthread_mutex_unlock(&cores_lock);
+        core_free(c);
+        return found;
+    }
+    // on a hash collision, the newer core just isn't shared
+    if (!found) {
+        c->key = strdup(key->name);
+        tack_hset(&cores, c->key, c);
+    }
+    pthread_mutex_unlock(&cores_lock);
+    return c;
+}
+
+static void core_release(grammar_core *c) {
+    pthread_mutex_lock(&cores_lock);
+    bool last = --c->refs == 0;
+    if (last && c->key)
+        tack_hdel(&cores, c->key);
+    pthread_mutex_unlock(&cores_lock);
+    if (last)
+        core_free(c);
+}
+
+// wraps a core in the per-name state: the packed grammar, whose exports dragon needs
+// prefixed with the grammar's name, and list contents.
+// with old, its list contents carry over, as the server restores them in dragon
+static Grammar *grammar_new(grammar_core *core, const char *name, Grammar *old) {
+    Grammar *g = calloc(1, sizeof(Grammar));
+    g->core = core;
+    g->arena = arena_new(16 * 1024);
+    g->name = arena_strdup(g->arena, name);
+    char *main_rule;
+    asprintf(&main_rule, "%s:%s", name, CORE_MAIN);
+    g->main_rule = arena_strdup(g->arena, main_rule);
+    free(main_rule);
+
+    // the packed grammar is the header, the exports named "name:rule", then the core's body,
+    // written once into a buffer of exactly its size
+    // main_rule starts with the same prefix
+    const char *prefix = g->main_rule;
+    size_t prefix_len = strlen(name) + 1;
+    size_t exports_size = ids_size(&core->exports, prefix_len);
+    buffer *raw = g->raw = arena_alloc(g->arena, sizeof(buffer));
+    raw->size = sizeof(grammar_header) + exports_size + core->body->size;
+    raw->data = arena_alloc(g->arena, raw->size);
     grammar_header header = {.type = 0, .flags = 0};
-    buffer *hdrbuf = malloc(sizeof(buffer));
-    hdrbuf->data = (void *)&header;
-    hdrbuf->size = sizeof(grammar_header);
-    g->raw = buf_concat_free(
-        hdrbuf,
-        pack_ids(&g->exports, 4),
-        pack_ids(&g->imports, 5),
-        pack_ids(&g->lists, 6),
-        pack_ids(&g->words, 2),
-        pack_rules(&g->rules, 3),
-        NULL);
+    memcpy(raw->data, &header, sizeof(grammar_header));
+    write_ids(raw->data + sizeof(grammar_header), &core->exports, CHUNK_EXPORTS, prefix, prefix_len);
+    memcpy(raw->data + sizeof(grammar_header) + exports_size, core->body->data, core->body->size);
+    g->chunks[CHUNK_EXPORTS] = (chunk_span){.offset = sizeof(grammar_header), .size = exports_size};
+    for (int t = 0; t < CHUNK_COUNT; t++) {
+        if (core->chunks[t].size)
+            g->chunks[t] = (chunk_span){.offset = sizeof(grammar_header) + exports_size + core->chunks[t].offset,
+                                        .size = core->chunks[t].size};
+    }
     // printf("raw grammar: ");
     // pbuf(g->raw);
 
     tack_t *_;
-    tack_foreach(&g->lists, _) {
-        tack_push(&g->listdata, calloc(1, sizeof(tack_t)));
+    tack_foreach(&core->lists, _) {
+        tack_push(&g->listdata, arena_calloc(g->arena, sizeof(intern_set)));
     }
-cleanup:
-    if (ret != 0) {
-        grammar_free(g);
-        *grammar = NULL;
+    for (int i = 0; old && i < tack_len(&old->core->lists); i++) {
+        node_id *list = tack_get(&old->core->lists, i);
+        node_id *to = tack_hget(&core->lists, list->name);
+        if (!to) continue;
+        intern_set *from = tack_get(&old->listdata, list->id - 1), *set = tack_get(&g->listdata, to->id - 1);
+        for (int k = 0; k < from->cap; k++) {
+            if (from->keys[k] && intern_set_add(set, from->keys[k])) intern_retain(from->keys[k]);
+        }
+    }
+    return g;
+}
+
+// finds the core for j's rules: shared from a loaded grammar, from the disk cache, or compiled.
+// the rules are the public and private objects, or a whole grammar source text
+static int grammar_load(Grammar **grammar, Grammar *old, json_t *j, char **err) {
+    const char *name, *source = NULL;
+    json_t *public, *private = NULL;
+    json_error_t json_err;
+    if (json_unpack_ex(j, &json_err, 0, "{s:s}", "name", &name)) {
+        *err = strdup(json_err.text);
+        return -1;
+    }
+    if (json_unpack(j, "{s:s}", "source", &source) == 0) {
+        if (grammar_source_parse(source, &public, &private, err))
+            return -1;
+    } else if (json_unpack_ex(j, &json_err, 0, "{s:o}", "public", &public)) {
+        *err = strdup(json_err.text);
+        return -1;
+    } else {
+        json_unpack(j, "{s:o}", "private", &private);
+        json_incref(public);
+        json_incref(private);
     }
+
+    int ret = 0;
+    cache_key key;
+    cache_hash(public, private, &key);
+    grammar_core *core = core_find(&key, public, private);
+    if (!core && (core = cache_load(&key, public, private)))
+        core = core_share(core, &key);
+    if (!core) {
+        if (core_build(&core, old ? old->core : NULL, public, private, err)) {
+            ret = -1;
+            goto end;
+        }
+        // a core built from old can number its ids differently than a compile from
+        // scratch, so later loads of the same rules don't get it
+        if (!old) {
+            cache_store(&key, core);
+            core = core_share(core, &key);
+        }
+    }
+    *grammar = grammar_new(core, name, old);
+end:
+    json_decref(public);
+    json_decref(private);
     return ret;
 }
 
+int grammar_compile(Grammar **grammar, json_t *j, char **err) {
+    return grammar_load(grammar, NULL, j, err);
+}
+
+int grammar_update(Grammar **grammar, Grammar *old, json_t *j, char **err) {
+    return grammar_load(grammar, old, j, err);
+}
+
+int grammar_load_raw(Grammar **grammar, const char *name, const uint8_t *data, size_t size, json_t *rules,
+                     char **err) {
+    grammar_core *core = raw_load(data, size, rules, err);
+    if (!core)
+        return -1;
+    *grammar = grammar_new(core, name, NULL);
+    return 0;
+}
+
+void core_free(grammar_core *c) {
+    json_decref(c->public);
+    json_decref(c->private);
+    tack_clear(&c->imports);
+    tack_clear(&c->exports);
+    tack_clear(&c->rules);
+    tack_clear(&c->lists);
+    tack_clear(&c->words);
+    arena_free(c->arena);
+    if (c->map)
+        munmap(c->map, c->map_size);
+    free(c->key);
+    free(c);
+}
+
 void grammar_free(Grammar *g) {
-    if (g->raw) {
-        free(g->raw->data);
-        free(g->raw);
-    }
-    free((void *)g->main_rule);
-    free((void *)g->name);
     free((void *)g->appname);
+    dfa_free(g->dfa);
 
-    node_id *ent;
-    Node *node;
-    nfa *n;
-    // import id structs are reused from rules
-    // tack_foreach(&g->imports, ent) id_free(ent);
-    tack_foreach(&g->exports, ent) id_free(ent);
-    tack_foreach(&g->rules, ent) id_free(ent);
-    tack_foreach(&g->lists, ent) id_free(ent);
-    tack_foreach(&g->words, ent) id_free(ent);
-    tack_foreach(&g->nodes, node) node_free(node);
-    tack_foreach(&g->nfa, n) nfa_free(n);
-
-    char *word;
-    tack_t *listdata;
+    // list contents grow with g.list.set, so they aren't in the arena
+    intern_set *listdata;
     tack_foreach(&g->listdata, listdata) {
-        tack_foreach(listdata, word) {
-            free(word);
-        }
-        tack_clear(listdata);
+        intern_set_release(listdata);
     }
-
-    tack_clear(&g->imports);
-    tack_clear(&g->exports);
-    tack_clear(&g->rules);
-    tack_clear(&g->lists);
-    tack_clear(&g->words);
-    tack_clear(&g->nodes);
-    tack_clear(&g->nfa);
     tack_clear(&g->listdata);
-
+    arena_free(g->arena);
+    core_release(g->core);
     free(g);
 }
@@ -4,6 +4,7 @@
 #include <jansson.h>
 #include <stdbool.h>
 
+#include "arena.h"
 #include "node.h"
 #include "tack.h"
 #include "maclink.h"
@@ -13,8 +14,58 @@ typedef struct {
     char name[0];
 } __attribute__((packed)) id_entry;
 
+typedef struct {
+    uint32_t size, id;
+} __attribute__((packed)) rule_header;
+
+typedef struct {
+    uint32_t type, size;
+    uint8_t data[0];
+} __attribute__((packed)) chunk_header;
+
+typedef struct {
+    uint32_t type, flags;
+} __attribute__((packed)) grammar_header;
+
+enum gram_type {
+    start_type = 1,
+    end_type = 2,
+    word_type = 3,
+    rule_type = 4,
+    list_type = 6,
+};
+
+enum gram_val {
+    seq_val = 1,
+    alt_val = 2,
+    rep_val = 3,
+    opt_val = 4,
+};
+
+typedef struct {
+    uint16_t type, prob;
+    uint32_t val;
+} __attribute__((packed)) rule_def;
+
+// chunk types of the packed grammar
+enum {
+    CHUNK_WORDS = 2,
+    CHUNK_RULES = 3,
+    CHUNK_EXPORTS = 4,
+    CHUNK_IMPORTS = 5,
+    CHUNK_LISTS = 6,
+    CHUNK_COUNT,
+};
+
+// where a chunk is in a packed grammar, header included. size is 0 if there's no such chunk
+typedef struct {
+    uint32_t offset, size;
+} chunk_span;
+
+// name is interned, and sym is its intern id
 typedef struct {
     int id;
+    uint32_t sym, len;
     const char *name;
     void *data;
 } node_id;
@@ -24,16 +75,60 @@ typedef struct {
     size_t size;
 } buffer;
 
+// reverse rule references, for guided matching:
+// rules referencing rule id r are parents[index[r] .. index[r + 1] - 1]
 typedef struct {
-    const char *main_rule;
-    const char *name;
-    buffer *raw;
+    uint32_t *parents, *index;
+    bool *nullable;
+    int count;
+} rule_graph;
+
+// the compiled part of a grammar, which doesn't depend on its name. grammars
+// loaded from identical rules share one core, so it's immutable once built.
+// exports are unprefixed here, and the main rule is named CORE_MAIN
+typedef struct {
+    int refs;
+    // hash of the rule sources, NULL if the core isn't shared
+    char *key;
+    arena *arena;
+    // cache entry the core was loaded from, which body and the nfa point into
+    void *map;
+    size_t map_size;
+    // the packed grammar's chunks after exports, which are packed per name.
+    // defined rules' data are their slices of the rules chunk
+    buffer *body;
+    chunk_span chunks[CHUNK_COUNT];
     tack_t imports,
            exports,
            rules,
            lists,
            words;
-    tack_t nfa, nodes, listdata;
+    struct nfa *nfa;
+    rule_graph graph;
+    // by rule id - 1, whether the rule's rule_defs depend on other rules: inlined rules
+    // were expanded into them, or they call shared rules
+    bool *dependent;
+    // rule sources, kept to find unchanged rules on update
+    json_t *public, *private;
+} grammar_core;
+
+#define CORE_MAIN ":main"
+// rules split out of identical subtrees are named ':' and the subtree's hash
+bool rule_shared(const char *name);
+
+typedef struct {
+    grammar_core *core;
+    // holds the name, main rule, raw and listdata
+    arena *arena;
+    const char *main_rule;
+    const char *name;
+    buffer *raw;
+    chunk_span chunks[CHUNK_COUNT];
+    // listdata holds an intern_set of each list's items
+    tack_t listdata;
+    // built by the matcher, and reset when list_version changes
+    struct dfa_cache *dfa;
+    uint32_t list_version;
     drg_grammar *handle;
 
     bool active;
@@ -42,9 +137,24 @@ typedef struct {
     unsigned int endkey, beginkey, hypokey;
 } Grammar;
 
+node_id *id_new(arena *a, const char *name, int id);
+// shares the core of an already loaded grammar with the same rules, if there is one
 int grammar_compile(Grammar **grammar, json_t *j, char **err);
-Node *grammar_parse(const char *text, char **err);
+// recompiles only the rules whose source changed since old, keeping old's ids and list contents
+int grammar_update(Grammar **grammar, Grammar *old, json_t *j, char **err);
+// loads a packed grammar as g.load makes it, without compiling. rules names rule ids in order,
+// and may be NULL (see raw.h)
+int grammar_load_raw(Grammar **grammar, const char *name, const uint8_t *data, size_t size, json_t *rules,
+                     char **err);
+// parses one rule's text into a tree allocated from a
+Node *grammar_parse(arena *a, const char *text, char **err);
+// splits a whole grammar source into new rule objects as g.load takes them. private is NULL if it has no private rules
+int grammar_source_parse(const char *text, json_t **public, json_t **private, char **err);
 void grammar_free(Grammar *grammar);
+void core_free(grammar_core *core);
+// builds a core's rule graph from its linked nfa
+void grammar_graph(grammar_core *core);
+uint32_t dragon_rule_id(const char *name);
 
 #define align4(len) ((len + 4) & ~3);
 
@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfa.h"
+#include "intern.h"
+#include "nfa.h"
+
+// each dfa state is a sorted set of nfa states (NFA_END last if the rule can end),
+// built by subset construction the first time a word is seen from it
+
+typedef struct {
+    uint32_t *set;
+    int len;
+    uint32_t hash;
+    bool accept;
+    // transitions by interned word, open addressing with keys stored as sym + 1
+    uint32_t *keys;
+    int *next;
+    int cap, used;
+} dfa_state;
+
+struct dfa_cache {
+    Grammar *g;
+    uint32_t list_version;
+    bool full;
+    size_t size;
+    // per rule: whether it's regular, and its start state + 1
+    bool *regular;
+    int *start;
+
+    dfa_state *states;
+    int len, cap;
+    // set hash -> state index + 1
+    int *table;
+    int table_cap;
+    // scratch set for subset construction
+    uint32_t *scratch;
+    int scratch_cap;
+};
+
+static uint32_t set_hash(const uint32_t *set, int len) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ set[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void dfa_reset(dfa_cache *d) {
+    for (int i = 0; i < d->len; i++) {
+        free(d->states[i].set);
+        free(d->states[i].keys);
+        free(d->states[i].next);
+    }
+    free(d->states);
+    free(d->table);
+    d->states = NULL;
+    d->len = d->cap = 0;
+    d->table = NULL;
+    d->table_cap = 0;
+    memset(d->start, 0, d->g->core->nfa->rule_count * sizeof(int));
+    d->size = 0;
+    d->full = false;
+    d->list_version = d->g->list_version;
+}
+
+dfa_cache *dfa_get(Grammar *g) {
+    dfa_cache *d = g->dfa;
+    if (d == NULL) {
+        nfa *n = g->core->nfa;
+        d = g->dfa = calloc(1, sizeof(dfa_cache));
+        d->g = g;
+        d->regular = calloc(n->rule_count, sizeof(bool));
+        d->start = calloc(n->rule_count, sizeof(int));
+        for (uint32_t r = 0; r < n->rule_count; r++) {
+            nfa_rule *rule = &n->rules[r];
+            bool regular = !rule->import;
+            for (uint32_t s = rule->state; regular && s < rule->state + rule->state_count; s++) {
+                regular = n->states[s].type != NFA_RULE;
+            }
+            d->regular[r] = regular;
+        }
+        dfa_reset(d);
+    } else if (d->full || d->list_version != g->list_version) {
+        dfa_reset(d);
+    }
+    return d;
+}
+
+bool dfa_regular(dfa_cache *d, uint32_t rule) {
+    return d->regular[rule - 1];
+}
+
+static void table_insert(dfa_cache *d, int idx) {
+    uint32_t mask = d->table_cap - 1;
+    uint32_t h = d->states[idx].hash & mask;
+    while (d->table[h]) h = (h + 1) & mask;
+    d->table[h] = idx + 1;
+}
+
+// finds or adds the state for a sorted set, returning DFA_FULL past the memory limit
+static int dfa_state_for(dfa_cache *d, const uint32_t *set, int len) {
+    if (len == 0)
+        return DFA_DEAD;
+    uint32_t hash = set_hash(set, len);
+    if (d->table_cap) {
+        uint32_t mask = d->table_cap - 1;
+        for (uint32_t h = hash & mask; d->table[h]; h = (h + 1) & mask) {
+            dfa_state *s = &d->states[d->table[h] - 1];
+            if (s->hash == hash && s->len == len && memcmp(s->set, set, len * sizeof(uint32_t)) == 0)
+                return d->table[h] - 1;
+        }
+    }
+    d->size += sizeof(dfa_state) + 2 * sizeof(int) + len * sizeof(uint32_t);
+    if (d->size > DFA_CACHE_SIZE) {
+        d->full = true;
+        return DFA_FULL;
+    }
+
+    if (d->len == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 16;
+        d->states = realloc(d->states, d->cap * sizeof(dfa_state));
+    }
+    dfa_state *s = &d->states[d->len++];
+    memset(s, 0, sizeof(dfa_state));
+    s->set = malloc(len * sizeof(uint32_t));
+    memcpy(s->set, set, len * sizeof(uint32_t));
+    s->len = len;
+    s->hash = hash;
+    s->accept = set[len - 1] == NFA_END;
+
+    if (d->len * 2 > d->table_cap) {
+        free(d->table);
+        d->table_cap = d->table_cap ? d->table_cap * 2 : 32;
+        d->table = calloc(d->table_cap, sizeof(int));
+        for (int i = 0; i < d->len; i++) table_insert(d, i);
+    } else {
+        table_insert(d, d->len - 1);
+    }
+    return d->len - 1;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// sorts and dedups the first len entries of the scratch set
+static int scratch_sort(dfa_cache *d, int len) {
+    qsort(d->scratch, len, sizeof(uint32_t), cmp_u32);
+    int out = 0;
+    for (int i = 0; i < len; i++) {
+        if (out == 0 || d->scratch[out - 1] != d->scratch[i])
+            d->scratch[out++] = d->scratch[i];
+    }
+    return out;
+}
+
+static void scratch_reserve(dfa_cache *d, int len) {
+    if (len > d->scratch_cap) {
+        d->scratch_cap = len * 2;
+        d->scratch = realloc(d->scratch, d->scratch_cap * sizeof(uint32_t));
+    }
+}
+
+int dfa_start(dfa_cache *d, uint32_t rule) {
+    if (d->start[rule - 1])
+        return d->start[rule - 1] - 1;
+    if (d->full)
+        return DFA_FULL;
+    nfa *n = d->g->core->nfa;
+    nfa_rule *r = &n->rules[rule - 1];
+    scratch_reserve(d, r->entry_count);
+    memcpy(d->scratch, &n->edges[r->entry], r->entry_count * sizeof(uint32_t));
+    int state = dfa_state_for(d, d->scratch, scratch_sort(d, r->entry_count));
+    if (state >= 0)
+        d->start[rule - 1] = state + 1;
+    return state;
+}
+
+static void transition_set(dfa_cache *d, dfa_state *s, uint32_t sym, int next) {
+    if ((s->used + 1) * 2 > s->cap) {
+        int old_cap = s->cap;
+        uint32_t *old_keys = s->keys;
+        int *old_next = s->next;
+        s->cap = s->cap ? s->cap * 2 : 4;
+        s->keys = calloc(s->cap, sizeof(uint32_t));
+        s->next = malloc(s->cap * sizeof(int));
+        s->used = 0;
+        d->size += (s->cap - old_cap) * (sizeof(uint32_t) + sizeof(int));
+        for (int i = 0; i < old_cap; i++) {
+            if (old_keys[i]) transition_set(d, s, old_keys[i] - 1, old_next[i]);
+        }
+        free(old_keys);
+        free(old_next);
+    }
+    uint32_t mask = s->cap - 1;
+    uint32_t h = (sym * 2654435761u) & mask;
+    while (s->keys[h]) h = (h + 1) & mask;
+    s->keys[h] = sym + 1;
+    s->next[h] = next;
+    s->used++;
+}
+
+int dfa_step(dfa_cache *d, int state, uint32_t sym) {
+    dfa_state *s = &d->states[state];
+    if (s->cap) {
+        uint32_t mask = s->cap - 1;
+        for (uint32_t h = (sym * 2654435761u) & mask; s->keys[h]; h = (h + 1) & mask) {
+            if (s->keys[h] == sym + 1)
+                return s->next[h];
+        }
+    }
+    if (d->full)
+        return DFA_FULL;
+
+    // subset construction for this word
+    Grammar *g = d->g;
+    nfa *n = g->core->nfa;
+    int len = 0;
+    for (int i = 0; i < s->len; i++) {
+        if (s->set[i] == NFA_END)
+            continue;
+        nfa_state *ns = &n->states[s->set[i]];
+        bool accept;
+        if (ns->type == NFA_WORD) {
+            accept = ns->sym == sym;
+        } else {
+            intern_set *list = tack_get(&g->listdata, ns->id - 1);
+            accept = intern_set_has(list, sym);
+        }
+        if (accept) {
+            scratch_reserve(d, len + ns->count);
+            memcpy(d->scratch + len, &n->edges[ns->edge], ns->count * sizeof(uint32_t));
+            len += ns->count;
+        }
+    }
+    int next = dfa_state_for(d, d->scratch, scratch_sort(d, len));
+    if (next == DFA_FULL)
+        return DFA_FULL;
+    // states may have moved if the state array grew
+    transition_set(d, &d->states[state], sym, next);
+    return next;
+}
+
+bool dfa_accepting(dfa_cache *d, int state) {
+    return d->states[state].accept;
+}
+
+void dfa_free(dfa_cache *d) {
+    if (d == NULL)
+        return;
+    dfa_reset(d);
+    free(d->regular);
+    free(d->start);
+    free(d->scratch);
+    free(d);
+}
@@ -0,0 +1,27 @@
+#ifndef GRAMMAR_DFA_H
+#define GRAMMAR_DFA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "compile.h"
+
+// lazily built DFAs for rules without rule references, keyed by interned word
+// the cache is only touched by the matcher, and resets itself when lists change
+
+#define DFA_DEAD -1
+#define DFA_FULL -2
+
+// cache memory limit per grammar, after which matching falls back to the nfa
+#define DFA_CACHE_SIZE (1 << 20)
+
+typedef struct dfa_cache dfa_cache;
+
+dfa_cache *dfa_get(Grammar *g);
+bool dfa_regular(dfa_cache *d, uint32_t rule);
+int dfa_start(dfa_cache *d, uint32_t rule);
+int dfa_step(dfa_cache *d, int state, uint32_t sym);
+bool dfa_accepting(dfa_cache *d, int state);
+void dfa_free(dfa_cache *d);
+
+#endif
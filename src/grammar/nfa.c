@@ -1,50 +1,34 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
-#include "grammar/node.h"
+#include "intern.h"
 #include "node.h"
 #include "nfa.h"
 
-#define indent() for (int i = 0; i < level; i++) printf(" ")
-
-void nfa_dump(const nfa *n, int level) {
-    if (n) {
-        if (n->node) {
-            indent(); printf("-> ");
-            switch (n->node->type) {
-                case RULE:
-                    printf("<%s>", n->node->name);
-                    break;
-                case LIST:
-                    printf("{%s}", n->node->name);
-                    break;
-                case LITERAL:
-                    printf("\"%s\"", n->node->name);
-                    break;
-                default: break;
-            }
-            level += 2;
-            for (int i = 0; i < n->count; i++) {
-                if (n->edges[i] == NULL) {
-                    printf(" -> end");
-                    break;
-                }
-            }
-            printf("\n");
-        }
-        for (int i = 0; i < n->count; i++) {
-            if (n->edges[i] == n) {
-                indent(); printf("-> self\n");
-            } else {
-                nfa_dump(n->edges[i], level);
-            }
-        }
-    }
+// the nfa is first built with epsilon states for ALT/OPT/REP, then each leaf's
+// epsilon closure is resolved so only leaves remain. build states are 1-based,
+// and 0 is the end of the rule.
+
+typedef struct {
+    Node *node; // NULL = epsilon
+    tack_t edges;
+    uint32_t leaf, seen;
+} build_state;
+
+static int build_new(tack_t *states, Node *node) {
+    build_state *s = calloc(1, sizeof(build_state));
+    s->node = node;
+    tack_push(states, s);
+    return tack_len(states);
 }
 
-#undef indent
+static void build_edge(tack_t *states, int from, int to) {
+    build_state *s = tack_get(states, from - 1);
+    tack_push_int(&s->edges, to);
+}
 
-static nfa *nfa_recurse(Node *node, nfa *next) {
+static int nfa_recurse(tack_t *states, Node *node, int next) {
     Node *child;
     size_t count = tack_len(&node->children);
     switch (node->type) {
@@ -52,64 +36,378 @@ static nfa *nfa_recurse(Node *node, nfa *next) {
         case SEQ:
             for (int i = count - 1; i >= 0; i--) {
                 child = tack_get(&node->children, i);
-                next = nfa_recurse(child, next);
+                next = nfa_recurse(states, child, next);
             }
             return next;
         // ALT can reach all children, and all children can reach next
         case ALT: {
-            nfa *alt = calloc(1, sizeof(nfa) + count * sizeof(nfa *));
-            alt->count = count;
+            int alt = build_new(states, NULL);
             tack_foreach(&node->children, child) {
-                alt->edges[i] = nfa_recurse(child, next);
+                build_edge(states, alt, nfa_recurse(states, child, next));
             }
             return alt;
         }
         // OPT is a skippable SEQ (front has second edge pointing to end)
         case OPT: {
-            nfa *opt = calloc(1, sizeof(nfa) + 2 * sizeof(nfa *));
-            opt->count = 2;
-            opt->edges[1] = next;
+            int opt = build_new(states, NULL);
+            int body = next;
             for (int i = count - 1; i >= 0; i--) {
                 child = tack_get(&node->children, i);
-                next = nfa_recurse(child, next);
+                body = nfa_recurse(states, child, body);
             }
-            opt->edges[0] = next;
+            build_edge(states, opt, body);
+            build_edge(states, opt, next);
             return opt;
         }
         // REP is a SEQ which adds an extra edge back to the start
         case REP: {
-            nfa *rep = calloc(1, sizeof(nfa) + 2 * sizeof(nfa *));
-            rep->count = 2;
-            rep->edges[0] = rep;
-            rep->edges[1] = next;
-            next = rep;
+            int rep = build_new(states, NULL);
+            int body = rep;
             for (int i = count - 1; i >= 0; i--) {
                 child = tack_get(&node->children, i);
-                next = nfa_recurse(child, next);
+                body = nfa_recurse(states, child, body);
             }
-            return next;
+            build_edge(states, rep, body);
+            build_edge(states, rep, next);
+            return body;
         }
         case LITERAL:
         case RULE:
-        case LIST: {
-            nfa *leaf = calloc(1, sizeof(nfa) + sizeof(nfa *));
-            leaf->node = node;
-            leaf->edges[0] = next;
-            leaf->count = 1;
+        case LIST:
+        default: {
+            int leaf = build_new(states, node);
+            build_edge(states, leaf, next);
             return leaf;
         }
     }
 }
 
-nfa *nfa_compile(Node *root) {
-    return nfa_recurse(root, NULL);
+// collects the leaves (and end of rule) reachable from state through epsilon states
+static void nfa_closure(tack_t *states, int state, uint32_t stamp, bool *end, tack_t *out) {
+    if (state == 0) {
+        if (!*end) {
+            *end = true;
+            tack_push_int(out, NFA_END);
+        }
+        return;
+    }
+    build_state *s = tack_get(states, state - 1);
+    if (s->seen == stamp)
+        return;
+    s->seen = stamp;
+    if (s->node) {
+        tack_push_int(out, s->leaf);
+        return;
+    }
+    for (int i = 0; i < tack_len(&s->edges); i++) {
+        nfa_closure(states, tack_get_int(&s->edges, i), stamp, end, out);
+    }
+}
+
+static void nfa_closure_edges(tack_t *states, tack_t *edges, uint32_t stamp, tack_t *out) {
+    bool end = false;
+    for (int i = 0; i < tack_len(edges); i++) {
+        nfa_closure(states, tack_get_int(edges, i), stamp, &end, out);
+    }
+}
+
+nfa_frag *nfa_compile(Node *root) {
+    tack_t states = {0};
+    int start = nfa_recurse(&states, root, 0);
+
+    nfa_frag *frag = calloc(1, sizeof(nfa_frag));
+    build_state *s;
+    tack_foreach(&states, s) {
+        if (s->node) s->leaf = frag->state_count++;
+    }
+
+    // entry edges first, then each leaf's edges
+    tack_t edges = {0}, entry = {0};
+    uint32_t stamp = 1;
+    tack_push_int(&entry, start);
+    nfa_closure_edges(&states, &entry, stamp++, &edges);
+    frag->entry_count = tack_len(&edges);
+    tack_clear(&entry);
+
+    frag->states = calloc(frag->state_count, sizeof(nfa_state));
+    tack_foreach(&states, s) {
+        if (!s->node) continue;
+        nfa_state *state = &frag->states[s->leaf];
+        switch (s->node->type) {
+            case LITERAL:
+                state->type = NFA_WORD;
+                state->sym = intern(s->node->name);
+                break;
+            case LIST:
+                state->type = NFA_LIST;
+                break;
+            default:
+                state->type = NFA_RULE;
+                state->key = s->node->key ? intern(s->node->key) : 0;
+                break;
+        }
+        state->id = s->node->id;
+        state->edge = tack_len(&edges);
+        nfa_closure_edges(&states, &s->edges, stamp++, &edges);
+        state->count = tack_len(&edges) - state->edge;
+    }
+    frag->edge_count = tack_len(&edges);
+    frag->edges = malloc(frag->edge_count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < frag->edge_count; i++) {
+        frag->edges[i] = tack_get_int(&edges, i);
+    }
+    tack_clear(&edges);
+
+    tack_foreach(&states, s) {
+        tack_clear(&s->edges);
+        free(s);
+    }
+    tack_clear(&states);
+    return frag;
+}
+
+// imported rules are matched by dragon's rule number rather than by states
+nfa_frag *nfa_import(uint32_t dragon_id) {
+    nfa_frag *frag = calloc(1, sizeof(nfa_frag));
+    frag->import = dragon_id;
+    return frag;
+}
+
+// copies rule id back out of a linked nfa, so an unchanged rule can be relinked without recompiling
+nfa_frag *nfa_extract(const nfa *n, uint32_t id) {
+    const nfa_rule *rule = &n->rules[id - 1];
+    uint32_t edge_end = id < n->rule_count ? n->rules[id].entry : n->edge_count;
+    nfa_frag *frag = calloc(1, sizeof(nfa_frag));
+    frag->import = rule->import;
+    frag->entry_count = rule->entry_count;
+    frag->state_count = rule->state_count;
+    frag->edge_count = edge_end - rule->entry;
+    frag->states = malloc(frag->state_count * sizeof(nfa_state));
+    for (uint32_t i = 0; i < frag->state_count; i++) {
+        frag->states[i] = n->states[rule->state + i];
+        frag->states[i].edge -= rule->entry;
+    }
+    frag->edges = malloc(frag->edge_count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < frag->edge_count; i++) {
+        uint32_t target = n->edges[rule->entry + i];
+        frag->edges[i] = target == NFA_END ? NFA_END : target - rule->state;
+    }
+    return frag;
+}
+
+// state of a splice: where each of frag's states went, and stamps to dedup each edge list
+typedef struct {
+    const nfa_frag *frag;
+    nfa_frag *const *subs;
+    uint32_t *base, *seen, *visit;
+    uint32_t stamp, end;
+    tack_t *edges;
+} nfa_splice;
+
+static const nfa_frag *splice_sub(nfa_splice *sp, uint32_t state) {
+    const nfa_state *s = &sp->frag->states[state];
+    return s->type == NFA_RULE && sp->subs ? sp->subs[s->id] : NULL;
+}
+
+static void splice_push(nfa_splice *sp, uint32_t target) {
+    if (target == NFA_END) {
+        if (sp->end == sp->stamp)
+            return;
+        sp->end = sp->stamp;
+    } else {
+        if (sp->seen[target] == sp->stamp)
+            return;
+        sp->seen[target] = sp->stamp;
+    }
+    tack_push_int(sp->edges, target);
+}
+
+static void splice_edges(nfa_splice *sp, uint32_t first, uint32_t count);
+
+// an edge to a spliced state goes to its sub frag's entries instead, and
+// the sub frag's ends go wherever the spliced state did
+static void splice_edge(nfa_splice *sp, uint32_t target) {
+    const nfa_frag *sub = target == NFA_END ? NULL : splice_sub(sp, target);
+    if (!sub) {
+        splice_push(sp, target == NFA_END ? NFA_END : sp->base[target]);
+        return;
+    }
+    if (sp->visit[target] == sp->stamp)
+        return;
+    sp->visit[target] = sp->stamp;
+    for (uint32_t e = 0; e < sub->entry_count; e++) {
+        if (sub->edges[e] == NFA_END) {
+            const nfa_state *s = &sp->frag->states[target];
+            splice_edges(sp, s->edge, s->count);
+        } else {
+            splice_push(sp, sp->base[target] + sub->edges[e]);
+        }
+    }
+}
+
+static void splice_edges(nfa_splice *sp, uint32_t first, uint32_t count) {
+    for (uint32_t e = first; e < first + count; e++) {
+        splice_edge(sp, sp->frag->edges[e]);
+    }
+}
+
+// copies a frag compiled with local symbol numbers, replacing each state's id with ids[id].
+// a RULE state whose subs[id] is set is replaced by a copy of that frag (already relabeled),
+// which is how inlined rules are spliced into their callers
+nfa_frag *nfa_relabel(const nfa_frag *frag, const uint32_t *ids, nfa_frag *const *subs) {
+    nfa_frag *copy = malloc(sizeof(nfa_frag));
+    *copy = *frag;
+    nfa_splice sp = {.frag = frag, .subs = subs};
+    bool spliced = false;
+    for (uint32_t i = 0; subs && i < frag->state_count; i++) {
+        spliced = spliced || splice_sub(&sp, i);
+    }
+    if (!spliced) {
+        copy->states = malloc(frag->state_count * sizeof(nfa_state));
+        for (uint32_t i = 0; i < frag->state_count; i++) {
+            copy->states[i] = frag->states[i];
+            copy->states[i].id = ids[frag->states[i].id];
+        }
+        copy->edges = malloc(frag->edge_count * sizeof(uint32_t));
+        memcpy(copy->edges, frag->edges, frag->edge_count * sizeof(uint32_t));
+        return copy;
+    }
+
+    sp.base = malloc(frag->state_count * sizeof(uint32_t));
+    sp.visit = calloc(frag->state_count, sizeof(uint32_t));
+    copy->state_count = 0;
+    for (uint32_t i = 0; i < frag->state_count; i++) {
+        const nfa_frag *sub = splice_sub(&sp, i);
+        sp.base[i] = copy->state_count;
+        copy->state_count += sub ? sub->state_count : 1;
+    }
+    sp.seen = calloc(copy->state_count, sizeof(uint32_t));
+    copy->states = malloc(copy->state_count * sizeof(nfa_state));
+
+    // entry edges first, then each state's edges, as nfa_compile lays them out
+    tack_t edges = {0};
+    sp.edges = &edges;
+    sp.stamp++;
+    splice_edges(&sp, 0, frag->entry_count);
+    copy->entry_count = tack_len(&edges);
+    for (uint32_t i = 0; i < frag->state_count; i++) {
+        const nfa_state *s = &frag->states[i];
+        const nfa_frag *sub = splice_sub(&sp, i);
+        if (!sub) {
+            nfa_state *state = &copy->states[sp.base[i]];
+            *state = *s;
+            state->id = ids[s->id];
+            state->edge = tack_len(&edges);
+            sp.stamp++;
+            splice_edges(&sp, s->edge, s->count);
+            state->count = tack_len(&edges) - state->edge;
+            continue;
+        }
+        for (uint32_t j = 0; j < sub->state_count; j++) {
+            nfa_state *state = &copy->states[sp.base[i] + j];
+            *state = sub->states[j];
+            state->edge = tack_len(&edges);
+            sp.stamp++;
+            for (uint32_t e = sub->states[j].edge; e < sub->states[j].edge + sub->states[j].count; e++) {
+                if (sub->edges[e] == NFA_END) {
+                    splice_edges(&sp, s->edge, s->count);
+                } else {
+                    splice_push(&sp, sp.base[i] + sub->edges[e]);
+                }
+            }
+            state->count = tack_len(&edges) - state->edge;
+        }
+    }
+    copy->edge_count = tack_len(&edges);
+    copy->edges = malloc(copy->edge_count * sizeof(uint32_t) + 1);
+    for (uint32_t i = 0; i < copy->edge_count; i++) {
+        copy->edges[i] = tack_get_int(&edges, i);
+    }
+    tack_clear(&edges);
+    free(sp.base);
+    free(sp.seen);
+    free(sp.visit);
+    return copy;
+}
+
+void nfa_frag_free(nfa_frag *frag) {
+    if (frag == NULL)
+        return;
+    free(frag->states);
+    free(frag->edges);
+    free(frag);
+}
+
+// concatenates rule fragments (indexed by rule id - 1) into one grammar nfa
+nfa *nfa_link(arena *a, tack_t *frags) {
+    uint32_t rule_count = tack_len(frags), state_count = 0, edge_count = 0;
+    nfa_frag *frag;
+    for (uint32_t i = 0; i < rule_count; i++) {
+        if (!(frag = tack_get(frags, i))) continue;
+        state_count += frag->state_count;
+        edge_count += frag->edge_count;
+    }
+
+    size_t size = sizeof(nfa) + rule_count * sizeof(nfa_rule) + state_count * sizeof(nfa_state) +
+                  edge_count * sizeof(uint32_t);
+    nfa *n = arena_calloc(a, size);
+    n->rule_count = rule_count;
+    n->state_count = state_count;
+    n->edge_count = edge_count;
+    n->rules = (nfa_rule *)(n + 1);
+    n->states = (nfa_state *)(n->rules + rule_count);
+    n->edges = (uint32_t *)(n->states + state_count);
+
+    uint32_t state_base = 0, edge_base = 0;
+    for (uint32_t i = 0; i < rule_count; i++) {
+        nfa_rule *rule = &n->rules[i];
+        rule->state = state_base;
+        rule->entry = edge_base;
+        if (!(frag = tack_get(frags, i))) continue;
+        rule->state_count = frag->state_count;
+        rule->entry_count = frag->entry_count;
+        rule->import = frag->import;
+
+        for (uint32_t j = 0; j < frag->state_count; j++) {
+            nfa_state *state = &n->states[state_base + j];
+            *state = frag->states[j];
+            state->edge += edge_base;
+        }
+        for (uint32_t j = 0; j < frag->edge_count; j++) {
+            uint32_t target = frag->edges[j];
+            n->edges[edge_base + j] = target == NFA_END ? NFA_END : target + state_base;
+        }
+        state_base += frag->state_count;
+        edge_base += frag->edge_count;
+    }
+    return n;
 }
 
-void nfa_free(nfa *n) {
-    for (int i = 0; i < n->count; i++) {
-        if (n->edges[i] != n) {
-            free(n->edges[i]);
+void nfa_dump(const nfa *n) {
+    for (uint32_t i = 0; i < n->rule_count; i++) {
+        const nfa_rule *rule = &n->rules[i];
+        printf("rule %u", i + 1);
+        if (rule->import) printf(" (import %u)", rule->import);
+        printf(":");
+        for (uint32_t e = rule->entry; e < rule->entry + rule->entry_count; e++) {
+            if (n->edges[e] == NFA_END) printf(" end");
+            else printf(" %u", n->edges[e]);
+        }
+        printf("\n");
+        for (uint32_t s = rule->state; s < rule->state + rule->state_count; s++) {
+            const nfa_state *state = &n->states[s];
+            switch (state->type) {
+                case NFA_WORD: printf("  %u: word %u '%s'", s, state->id, intern_str(state->sym)); break;
+                case NFA_LIST: printf("  %u: {%u}", s, state->id); break;
+                case NFA_RULE: printf("  %u: <%u>", s, state->id); break;
+            }
+            if (state->type == NFA_RULE && state->key) printf(" key=%s", intern_str(state->key));
+            printf(" ->");
+            for (uint32_t e = state->edge; e < state->edge + state->count; e++) {
+                if (n->edges[e] == NFA_END) printf(" end");
+                else printf(" %u", n->edges[e]);
+            }
+            printf("\n");
         }
     }
-    free(n);
 }
@@ -2,16 +2,64 @@
 #define NFA_H
 
 #include <stdint.h>
+#include "arena.h"
+#include "node.h"
 
+enum nfa_type {
+    NFA_WORD,
+    NFA_LIST,
+    NFA_RULE,
+};
+
+// edge target for the end of a rule
+#define NFA_END UINT32_MAX
+
+// a leaf (word, list or rule reference), with epsilon hops already resolved:
+// its edges point straight at the leaves (or NFA_END) that can follow it
+typedef struct {
+    uint32_t type : 4, count : 28;
+    // word, list or rule id
+    uint32_t id;
+    uint32_t edge;
+    union {
+        // WORD: the interned word
+        uint32_t sym;
+        // RULE: the interned attribution key (0 = none)
+        uint32_t key;
+    };
+} nfa_state;
+
+typedef struct {
+    // this rule's states, and the edges out of its start
+    uint32_t state, state_count;
+    uint32_t entry, entry_count;
+    // dragon's rule number for imported rules, which have no states
+    uint32_t import;
+} nfa_rule;
+
+// the whole grammar's nfa, indexed by rule id - 1, in one arena allocation
 typedef struct nfa {
-    uint32_t count;
-    Node *node;
-    struct nfa *edges[0];
+    uint32_t rule_count, state_count, edge_count;
+    nfa_rule *rules;
+    nfa_state *states;
+    uint32_t *edges;
 } nfa;
 
-void nfa_dump(const nfa *n, int level);
-nfa *nfa_compile(Node *root);
-static nfa *nfa_recurse(Node *node, nfa *next);
-void nfa_free(nfa *n);
+// one rule's nfa, with state and edge indices local to the rule
+// entry edges come first in edges
+typedef struct {
+    nfa_state *states;
+    uint32_t *edges;
+    uint32_t state_count, edge_count, entry_count;
+    uint32_t import;
+} nfa_frag;
+
+nfa_frag *nfa_compile(Node *root);
+nfa_frag *nfa_import(uint32_t dragon_id);
+nfa_frag *nfa_extract(const nfa *n, uint32_t id);
+nfa_frag *nfa_relabel(const nfa_frag *frag, const uint32_t *ids, nfa_frag *const *subs);
+void nfa_frag_free(nfa_frag *frag);
+nfa *nfa_link(arena *a, tack_t *frags);
+void nfa_dump(const nfa *n);
 
 #endif
@@ -1,10 +1,13 @@
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "node.h"
 
-Node *node_new(int type, char *name) {
-    Node *node = calloc(1, sizeof(Node));
+Node *node_new(arena *a, int type, char *name) {
+    Node *node = arena_calloc(a, sizeof(Node));
+    node->arena = a;
     node->type = type;
     if (name != NULL) {
         node->name = name;
@@ -20,13 +23,11 @@ void node_push(Node *node, Node *child) {
 void node_free(Node *node) {
     if (node == NULL)
         return;
-    free(node->name);
     Node *child;
     node_foreach(node, child) {
         node_free(child);
     }
     tack_clear(&node->children);
-    free(node);
 }
 
 static void dump_children(Node *node) {
@@ -75,6 +76,25 @@ void node_dump(Node *node) {
     }
 }
 
+// joins the names of a run of literals with spaces
+static char *literal_join(arena *a, tack_t *names) {
+    size_t len = 0;
+    char *name;
+    tack_foreach(names, name) {
+        len += strlen(name) + 1;
+    }
+    char *str = arena_alloc(a, len), *pos = str;
+    tack_foreach(names, name) {
+        if (i > 0) *pos++ = ' ';
+        size_t size = strlen(name);
+        memcpy(pos, name, size);
+        pos += size;
+    }
+    *pos = 0;
+    tack_clear(names);
+    return str;
+}
+
 static void node_combine_literals(Node *node) {
     // combine adjacent literals
     // (can't be done with ALT, which doesn't matter because ALT will contain SEQ)
@@ -86,49 +106,37 @@ static void node_combine_literals(Node *node) {
         node_foreach(node, child) {
             if (child->type == LITERAL) {
                 tack_push(&strjoin, child->name);
-                free(child);
                 literal = true;
             } else {
-                if (literal) {
-                    char *str = tack_str_join(&strjoin, " ");
-                    tack_push(&tmp, node_new(LITERAL, str));
-                    for (int i = 0; (str = tack_get(&strjoin, i)); i++) {
-                        free(str);
-                    }
-                    tack_clear(&strjoin);
-                }
+                if (literal)
+                    tack_push(&tmp, node_new(node->arena, LITERAL, literal_join(node->arena, &strjoin)));
                 tack_push(&tmp, child);
                 literal = false;
             }
         }
-        if (literal) {
-            char *str = tack_str_join(&strjoin, " ");
-            tack_push(&tmp, node_new(LITERAL, str));
-            for (int i = 0; (str = tack_get(&strjoin, i)); i++) {
-                free(str);
-            }
-            tack_clear(&strjoin);
-        }
+        if (literal)
+            tack_push(&tmp, node_new(node->arena, LITERAL, literal_join(node->arena, &strjoin)));
         tack_clear(&node->children);
         memcpy(&node->children, &tmp, sizeof(tack_t));
     }
 }
 
-static Node *node_opt_priv(Node *node, bool top) {
+static Node *node_opt_priv(Node *node, bool top, bool literals) {
     if (node == NULL)
         return NULL;
 
     Node *child;
-    node_combine_literals(node);
+    if (literals)
+        node_combine_literals(node);
     // can't collapse OPT
     if ((node->type == SEQ || node->type == ALT) && tack_len(&node->children) == 1 && !top) {
         Node *top = tack_pop(&node->children);
         node_free(node);
-        node = node_opt_priv(top, false);
+        node = node_opt_priv(top, false, literals);
     } else {
         tack_t tmp = {0};
         node_foreach(node, child) {
-            child = node_opt_priv(child, false);
+            child = node_opt_priv(child, false, literals);
             child->parent = node;
             tack_push(&tmp, child);
         }
@@ -137,4 +145,347 @@ static Node *node_opt_priv(Node *node, bool top) {
     }
     return node;
 }
-Node *node_optimize(Node *node) { return node_opt_priv(node, true); }
+
+static pthread_once_t passes_once = PTHREAD_ONCE_INIT;
+static unsigned enabled_passes = PASS_ALL;
+
+static const struct {
+    const char *name;
+    unsigned pass;
+} pass_names[] = {
+    {"literals", PASS_LITERALS},
+    {"flatten", PASS_FLATTEN},
+    {"dedup", PASS_DEDUP},
+    {"factor", PASS_FACTOR},
+    {"repeat", PASS_REPEAT},
+    {"share", PASS_SHARE},
+    {NULL, 0},
+};
+
+static void passes_init(void) {
+    const char *env = getenv("MACLINK_PASSES");
+    if (env == NULL)
+        return;
+    enabled_passes = 0;
+    char *list = strdup(env), *save, *name;
+    for (name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        int i = 0;
+        while (pass_names[i].name && strcmp(pass_names[i].name, name) != 0) i++;
+        if (pass_names[i].name) {
+            enabled_passes |= pass_names[i].pass;
+        } else {
+            printf("warning: unknown optimizer pass \"%s\"\n", name);
+        }
+    }
+    free(list);
+}
+
+unsigned node_passes(void) {
+    pthread_once(&passes_once, passes_init);
+    return enabled_passes;
+}
+
+static uint64_t hash_str(uint64_t h, const char *str) {
+    for (; str && *str; str++) {
+        h = (h ^ (uint8_t)*str) * 0x100000001b3ull;
+    }
+    return (h ^ 0xff) * 0x100000001b3ull;
+}
+
+// structural hash and equality, which ignore ids
+uint64_t node_hash(Node *node, uint64_t seed) {
+    uint64_t h = (seed ^ node->type) * 0x100000001b3ull;
+    h = hash_str(hash_str(h, node->name), node->key);
+    Node *child;
+    node_foreach(node, child) {
+        h = (h ^ node_hash(child, seed)) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+static bool str_equal(const char *a, const char *b) {
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+bool node_equal(Node *a, Node *b) {
+    if (a->type != b->type || tack_len(&a->children) != tack_len(&b->children) ||
+            !str_equal(a->name, b->name) || !str_equal(a->key, b->key))
+        return false;
+    for (int i = 0; i < tack_len(&a->children); i++) {
+        if (!node_equal(tack_get(&a->children, i), tack_get(&b->children, i)))
+            return false;
+    }
+    return true;
+}
+
+static void node_adopt(Node *node) {
+    Node *child;
+    node_foreach(node, child) {
+        child->parent = node;
+    }
+}
+
+static void node_set_children(Node *node, tack_t *children) {
+    tack_clear(&node->children);
+    memcpy(&node->children, children, sizeof(tack_t));
+    node_adopt(node);
+}
+
+// moves child's children onto the end of node's, and frees child
+static void node_splice(Node *node, Node *child) {
+    for (int i = 0; i < tack_len(&child->children); i++) {
+        node_push(node, tack_get(&child->children, i));
+    }
+    tack_clear(&child->children);
+    node_free(child);
+}
+
+// splices SEQ into SEQ, OPT and REP (which are sequences too), and ALT into ALT
+static void node_flatten(Node *node) {
+    enum node_type inner = node->type == ALT ? ALT : SEQ;
+    Node *child;
+    bool found = false;
+    node_foreach(node, child) {
+        found = found || child->type == inner;
+    }
+    if (!found)
+        return;
+    tack_t children = node->children;
+    memset(&node->children, 0, sizeof(tack_t));
+    tack_foreach(&children, child) {
+        if (child->type == inner) {
+            node_splice(node, child);
+        } else {
+            node_push(node, child);
+        }
+    }
+    tack_clear(&children);
+}
+
+// drops alternatives equal to an earlier one
+static void node_dedup(Node *node) {
+    if (node->type != ALT || tack_len(&node->children) < 2)
+        return;
+    tack_t seen = {0}, children = {0};
+    char key[17];
+    Node *child;
+    node_foreach(node, child) {
+        snprintf(key, sizeof(key), "%016llx", (unsigned long long)node_hash(child, NODE_HASH_SEED));
+        Node *prev = tack_hget(&seen, key);
+        if (prev && node_equal(prev, child)) {
+            node_free(child);
+            continue;
+        }
+        if (!prev) tack_hset(&seen, key, child);
+        tack_push(&children, child);
+    }
+    tack_clear(&seen);
+    node_set_children(node, &children);
+}
+
+static Node *seq_wrap(Node *node) {
+    if (node->type == SEQ)
+        return node;
+    Node *seq = node_new(node->arena, SEQ, NULL);
+    node_push(seq, node);
+    return seq;
+}
+
+static Node *seq_unwrap(Node *seq) {
+    if (seq->type != SEQ || tack_len(&seq->children) != 1)
+        return seq;
+    Node *only = tack_pop(&seq->children);
+    node_free(seq);
+    return only;
+}
+
+// a term of seq counted from the front, or from the back for suffixes
+static Node *seq_term(Node *seq, int i, bool suffix) {
+    int len = tack_len(&seq->children);
+    if (i >= len)
+        return NULL;
+    return tack_get(&seq->children, suffix ? len - 1 - i : i);
+}
+
+static void alt_factor(Node *alt, bool suffix);
+
+// factors the common prefix (or suffix) out of a group of SEQs which share at least one term
+static Node *group_factor(tack_t *group, bool suffix) {
+    Node *first = tack_get(group, 0);
+    int common = 1;
+    for (;; common++) {
+        Node *term = seq_term(first, common, suffix);
+        bool shared = term != NULL;
+        for (int g = 1; shared && g < tack_len(group); g++) {
+            Node *other = seq_term(tack_get(group, g), common, suffix);
+            shared = other && node_equal(term, other);
+        }
+        if (!shared)
+            break;
+    }
+
+    // the common terms are kept from the first SEQ, and freed from the rest.
+    // what's left of each SEQ becomes an alternative, and an empty one makes them optional
+    Node *out = node_new(first->arena, SEQ, NULL), *rest = node_new(first->arena, ALT, NULL);
+    tack_t shared = {0};
+    bool empty = false;
+    for (int g = 0; g < tack_len(group); g++) {
+        Node *seq = tack_get(group, g);
+        int len = tack_len(&seq->children);
+        int start = suffix ? len - common : 0;
+        Node *remainder = node_new(first->arena, SEQ, NULL);
+        for (int k = 0; k < len; k++) {
+            Node *term = tack_get(&seq->children, k);
+            if (k < start || k >= start + common) {
+                node_push(remainder, term);
+            } else if (g == 0) {
+                tack_push(&shared, term);
+            } else {
+                node_free(term);
+            }
+        }
+        tack_clear(&seq->children);
+        node_free(seq);
+        if (tack_len(&remainder->children) == 0) {
+            empty = true;
+            node_free(remainder);
+        } else {
+            node_push(rest, seq_unwrap(remainder));
+        }
+    }
+
+    Node *body = NULL;
+    if (tack_len(&rest->children) > 0) {
+        alt_factor(rest, false);
+        alt_factor(rest, true);
+        body = rest;
+        if (tack_len(&rest->children) == 1) {
+            body = tack_pop(&rest->children);
+            node_free(rest);
+        }
+        // (x [y] | x) is already x [y]
+        if (empty && body->type != OPT) {
+            Node *opt = node_new(first->arena, OPT, NULL);
+            if (body->type == SEQ) {
+                node_splice(opt, body);
+            } else {
+                node_push(opt, body);
+            }
+            body = opt;
+        }
+    } else {
+        node_free(rest);
+    }
+
+    Node *term;
+    if (!suffix) {
+        tack_foreach(&shared, term) node_push(out, term);
+    }
+    if (body && body->type == SEQ) {
+        node_splice(out, body);
+    } else if (body) {
+        node_push(out, body);
+    }
+    if (suffix) {
+        tack_foreach(&shared, term) node_push(out, term);
+    }
+    tack_clear(&shared);
+    return out;
+}
+
+// groups alternatives by their first (or last) term, and factors each group with
+// more than one member: (a b | a c | d) becomes (a (b | c) | d)
+static void alt_factor(Node *alt, bool suffix) {
+    if (alt->type != ALT || tack_len(&alt->children) < 2)
+        return;
+    tack_t groups = {0}, index = {0};
+    char key[17];
+    bool factor = false;
+    Node *child;
+    node_foreach(alt, child) {
+        Node *seq = seq_wrap(child);
+        Node *term = seq_term(seq, 0, suffix);
+        tack_t *group = NULL;
+        if (term) {
+            snprintf(key, sizeof(key), "%016llx", (unsigned long long)node_hash(term, NODE_HASH_SEED));
+            group = tack_hget(&index, key);
+            if (group && !node_equal(seq_term(tack_get(group, 0), 0, suffix), term))
+                group = NULL;
+            else if (group)
+                factor = true;
+        }
+        if (!group) {
+            group = calloc(1, sizeof(tack_t));
+            tack_push(&groups, group);
+            if (term && !tack_hexists(&index, key)) tack_hset(&index, key, group);
+        }
+        tack_push(group, seq);
+    }
+    tack_clear(&index);
+
+    tack_t children = {0};
+    tack_t *group;
+    tack_foreach(&groups, group) {
+        if (factor && tack_len(group) > 1) {
+            tack_push(&children, seq_unwrap(group_factor(group, suffix)));
+        } else {
+            tack_push(&children, seq_unwrap(tack_get(group, 0)));
+        }
+        tack_clear(group);
+        free(group);
+    }
+    tack_clear(&groups);
+    node_set_children(alt, &children);
+}
+
+// [[x]] is [x], (x+)+ is x+, and ([x])+ is [x+], which is how x* is parsed
+static void node_repeat(Node *node) {
+    if ((node->type != OPT && node->type != REP) || tack_len(&node->children) != 1)
+        return;
+    Node *child = tack_get(&node->children, 0);
+    if (child->type == node->type) {
+        tack_clear(&node->children);
+        node_splice(node, child);
+        node_repeat(node);
+    } else if (node->type == REP && child->type == OPT) {
+        node->type = OPT;
+        child->type = REP;
+        node_repeat(child);
+    }
+}
+
+// the structural passes run bottom up, after literals are joined. words are
+// never split or joined here, so the words dragon reports don't change
+static Node *node_pass(Node *node, bool top, unsigned passes) {
+    if (node->type != SEQ && node->type != ALT && node->type != OPT && node->type != REP)
+        return node;
+    tack_t children = {0};
+    Node *child;
+    node_foreach(node, child) {
+        tack_push(&children, node_pass(child, false, passes));
+    }
+    node_set_children(node, &children);
+
+    if (passes & PASS_FLATTEN) node_flatten(node);
+    if (passes & PASS_DEDUP) node_dedup(node);
+    if (passes & PASS_FACTOR) {
+        alt_factor(node, false);
+        alt_factor(node, true);
+    }
+    if (passes & PASS_REPEAT) node_repeat(node);
+    // can't collapse OPT or REP, or the rule's top group
+    if ((node->type == SEQ || node->type == ALT) && tack_len(&node->children) == 1 && !top) {
+        Node *only = tack_pop(&node->children);
+        node_free(node);
+        return only;
+    }
+    return node;
+}
+
+Node *node_optimize(Node *node) {
+    unsigned passes = node_passes();
+    node = node_opt_priv(node, true, passes & PASS_LITERALS);
+    if (node && (passes & ~PASS_LITERALS))
+        node = node_pass(node, true, passes);
+    return node;
+}
@@ -2,6 +2,7 @@
 #define GRAMMAR_NODE_H
 
 #include <stdbool.h>
+#include "arena.h"
 #include "tack.h"
 
 enum node_type {
@@ -10,19 +11,49 @@ enum node_type {
     RULE, LIST,
 };
 
+// nodes and their names are allocated from an arena, which the rule's
+// compile frees at once. the optimizer adds nodes to the same arena
 typedef struct node {
     enum node_type type;
     char *name, *key;
     uint32_t id;
     struct node *parent;
     tack_t children;
+    arena *arena;
 } Node;
 
-Node *node_new(int type, char *name);
+// name isn't copied, so it must live as long as a
+Node *node_new(arena *a, int type, char *name);
+// frees the child lists of a tree, whose nodes go with their arena
 void node_free(Node *node);
 void node_push(Node *node, Node *other);
 void node_dump(Node *node);
+
+// optimizer passes, each of which can be switched off with $MACLINK_PASSES,
+// a comma separated list of the passes to run (default all)
+enum node_pass {
+    // adjacent literals are joined into one word
+    PASS_LITERALS = 1 << 0,
+    // SEQ in a sequence and ALT in ALT are spliced into their parent
+    PASS_FLATTEN = 1 << 1,
+    // alternatives equal to an earlier one are dropped
+    PASS_DEDUP = 1 << 2,
+    // common leading and trailing terms are factored out of alternatives
+    PASS_FACTOR = 1 << 3,
+    // nested OPT and REP are simplified, and x* becomes [x+]
+    PASS_REPEAT = 1 << 4,
+    // large subtrees become rules shared by every rule they appear in (run by the compiler)
+    PASS_SHARE = 1 << 5,
+    PASS_ALL = (1 << 6) - 1,
+};
+
+#define NODE_HASH_SEED 0xcbf29ce484222325ull
+
+unsigned node_passes(void);
 Node *node_optimize(Node *node);
+// structural hash and equality, which ignore ids
+uint64_t node_hash(Node *node, uint64_t seed);
+bool node_equal(Node *a, Node *b);
 
 #define node_foreach(root, name) tack_foreach(&root->children, name)
 #endif
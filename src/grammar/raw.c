@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+#include "nfa.h"
+#include "raw.h"
+
+// groups nested deeper than this are rejected rather than built
+#define RAW_DEPTH 10000
+// rule ids past this are taken for corruption rather than allocated
+#define RAW_RULES (1 << 20)
+
+typedef struct {
+    grammar_core *c;
+    const uint8_t *data;
+    size_t size;
+    // the packed grammar's chunks, header included
+    chunk_span chunks[CHUNK_COUNT];
+    uint32_t rule_count;
+    // by rule id - 1
+    const char **names;
+    bool *defined;
+    char **err;
+} raw_view;
+
+static const char *entry_kind[CHUNK_COUNT] = {
+    [CHUNK_WORDS] = "word",
+    [CHUNK_RULES] = "rule",
+    [CHUNK_EXPORTS] = "export",
+    [CHUNK_IMPORTS] = "import",
+    [CHUNK_LISTS] = "list",
+};
+
+static const uint8_t *chunk_start(raw_view *v, int type) {
+    return v->data + v->chunks[type].offset + sizeof(chunk_header);
+}
+
+static const uint8_t *chunk_end(raw_view *v, int type) {
+    return v->data + v->chunks[type].offset + v->chunks[type].size;
+}
+
+// finds each chunk, which must be one of the types g.load writes, at most once
+static int raw_chunks(raw_view *v) {
+    const grammar_header *header = (const grammar_header *)v->data;
+    if (v->size < sizeof(grammar_header) || header->type != 0) {
+        asprintf(v->err, "not a packed cfg grammar");
+        return -1;
+    }
+    size_t pos = sizeof(grammar_header);
+    while (pos < v->size) {
+        const chunk_header *chunk = (const chunk_header *)(v->data + pos);
+        if (v->size - pos < sizeof(chunk_header) || chunk->size > v->size - pos - sizeof(chunk_header)) {
+            asprintf(v->err, "truncated chunk at offset %zu", pos);
+            return -1;
+        }
+        if (chunk->type < CHUNK_WORDS || chunk->type >= CHUNK_COUNT) {
+            asprintf(v->err, "unknown chunk type %u at offset %zu", chunk->type, pos);
+            return -1;
+        }
+        if (v->chunks[chunk->type].size) {
+            asprintf(v->err, "more than one %s chunk", entry_kind[chunk->type]);
+            return -1;
+        }
+        v->chunks[chunk->type] = (chunk_span){.offset = pos, .size = sizeof(chunk_header) + chunk->size};
+        pos += sizeof(chunk_header) + chunk->size;
+    }
+    if (!v->chunks[CHUNK_EXPORTS].size || !v->chunks[CHUNK_RULES].size) {
+        asprintf(v->err, "packed grammar has no %s chunk", v->chunks[CHUNK_RULES].size ? "export" : "rule");
+        return -1;
+    }
+    return 0;
+}
+
+// reads an id chunk into list. word and list ids count up from 1, so they're indexed by id - 1.
+// exports lose their grammar name
+static int raw_ids(raw_view *v, int type, tack_t *list) {
+    const uint8_t *pos = chunk_start(v, type), *end = chunk_end(v, type);
+    while (pos < end) {
+        const id_entry *entry = (const id_entry *)pos;
+        if ((size_t)(end - pos) < sizeof(id_entry) + 4 || entry->size < sizeof(id_entry) + 4 ||
+                entry->size % 4 || entry->size > end - pos ||
+                !memchr(entry->name, 0, entry->size - sizeof(id_entry))) {
+            asprintf(v->err, "malformed %s entry", entry_kind[type]);
+            return -1;
+        }
+        const char *name = entry->name;
+        if (type == CHUNK_EXPORTS) {
+            const char *colon = strchr(name, ':');
+            if (!colon) {
+                asprintf(v->err, "export \"%s\" isn't named grammar:rule", name);
+                return -1;
+            }
+            name = colon + 1;
+        }
+        bool ordered = type == CHUNK_WORDS || type == CHUNK_LISTS;
+        if (entry->id == 0 || (ordered && entry->id != (uint32_t)tack_len(list) + 1)) {
+            asprintf(v->err, "%s \"%s\" has id %u out of order", entry_kind[type], name, entry->id);
+            return -1;
+        }
+        if (tack_hexists(list, name)) {
+            asprintf(v->err, "duplicate %s \"%s\"", entry_kind[type], name);
+            return -1;
+        }
+        node_id *ent = id_new(v->c->arena, name, entry->id);
+        tack_push(list, ent);
+        tack_hset(list, ent->name, ent);
+        pos += entry->size;
+    }
+    return 0;
+}
+
+// checks each rule's header, and finds the highest rule id
+static int raw_scan_rules(raw_view *v, uint32_t *max_id) {
+    const uint8_t *pos = chunk_start(v, CHUNK_RULES), *end = chunk_end(v, CHUNK_RULES);
+    while (pos < end) {
+        const rule_header *header = (const rule_header *)pos;
+        if ((size_t)(end - pos) < sizeof(rule_header) + sizeof(rule_def) ||
+                header->size < sizeof(rule_header) + sizeof(rule_def) || header->size > end - pos ||
+                (header->size - sizeof(rule_header)) % sizeof(rule_def) || header->id == 0) {
+            asprintf(v->err, "malformed rule at offset %zu", (size_t)(pos - v->data));
+            return -1;
+        }
+        if (header->id > *max_id) *max_id = header->id;
+        pos += header->size;
+    }
+    return 0;
+}
+
+// marks the rules the grammar defines, each at most once
+static int raw_defined(raw_view *v) {
+    const uint8_t *pos = chunk_start(v, CHUNK_RULES), *end = chunk_end(v, CHUNK_RULES);
+    while (pos < end) {
+        const rule_header *header = (const rule_header *)pos;
+        if (v->defined[header->id - 1]) {
+            asprintf(v->err, "rule %u is defined twice", header->id);
+            return -1;
+        }
+        v->defined[header->id - 1] = true;
+        pos += header->size;
+    }
+    return 0;
+}
+
+static int raw_name(raw_view *v, tack_t *list) {
+    node_id *ent;
+    tack_foreach(list, ent) {
+        if ((uint32_t)ent->id > v->rule_count)
+            continue;
+        const char **name = &v->names[ent->id - 1];
+        if (*name && strcmp(*name, ent->name) != 0) {
+            asprintf(v->err, "rule %d is named both \"%s\" and \"%s\"", ent->id, *name, ent->name);
+            return -1;
+        }
+        *name = ent->name;
+    }
+    return 0;
+}
+
+// names every rule id, from rules and then the exports and imports, which must agree.
+// ids nothing defines or names are gaps left by g.update, which get an empty name and no lookup
+static int raw_rules(raw_view *v, json_t *rules) {
+    grammar_core *c = v->c;
+    v->names = calloc(v->rule_count + 1, sizeof(char *));
+    size_t index;
+    json_t *value;
+    json_array_foreach(rules, index, value) {
+        if (!json_is_string(value) && !json_is_null(value)) {
+            asprintf(v->err, "rule names must be strings or null");
+            return -1;
+        }
+        const char *name = json_string_value(value);
+        if (name && *name) v->names[index] = name;
+    }
+    if (raw_name(v, &c->exports) || raw_name(v, &c->imports))
+        return -1;
+    for (uint32_t id = 1; id <= v->rule_count; id++) {
+        char unnamed[16];
+        const char *name = v->names[id - 1];
+        if (!name && !v->defined[id - 1]) {
+            tack_push(&c->rules, id_new(c->arena, "", id));
+            continue;
+        }
+        if (!name) {
+            snprintf(unnamed, sizeof(unnamed), ":%u", id);
+            name = unnamed;
+        }
+        if (tack_hexists(&c->rules, name)) {
+            asprintf(v->err, "duplicate rule \"%s\"", name);
+            return -1;
+        }
+        node_id *ent = id_new(c->arena, name, id);
+        if (!ent->name) {
+            asprintf(v->err, "no room to name rule %u", id);
+            return -1;
+        }
+        tack_push(&c->rules, ent);
+        tack_hset(&c->rules, ent->name, ent);
+    }
+    return 0;
+}
+
+// turns a rule's rule_defs back into a tree, checking that groups nest and ids exist.
+// nodes carry grammar ids, so the tree's nfa needs no relabelling
+static Node *raw_tree(raw_view *v, arena *a, node_id *rule, const rule_def *defs, size_t count) {
+    static const enum node_type group_types[] = {[seq_val] = SEQ, [alt_val] = ALT, [rep_val] = REP, [opt_val] = OPT};
+    grammar_core *c = v->c;
+    Node **stack = NULL;
+    int depth = 0, cap = 0;
+    Node *root = NULL, *node;
+    const char *problem = "unbalanced groups";
+    for (size_t i = 0; i < count; i++) {
+        const rule_def *def = &defs[i];
+        node = NULL;
+        if (def->type == end_type) {
+            if (depth == 0 || def->val < seq_val || def->val > opt_val ||
+                    stack[depth - 1]->type != group_types[def->val])
+                goto fail;
+            depth--;
+            continue;
+        }
+        if (depth == 0 && (root || def->type != start_type))
+            goto fail;
+        switch (def->type) {
+            case start_type:
+                if (def->val < seq_val || def->val > opt_val || depth == RAW_DEPTH)
+                    goto fail;
+                if (depth == cap) {
+                    cap = cap ? cap * 2 : 16;
+                    stack = realloc(stack, cap * sizeof(Node *));
+                }
+                node = node_new(a, group_types[def->val], NULL);
+                break;
+            case word_type: {
+                node_id *word = def->val && def->val <= (uint32_t)tack_len(&c->words) ? tack_get(&c->words, def->val - 1) : NULL;
+                if (!word) {
+                    problem = "an undefined word id";
+                    goto fail;
+                }
+                node = node_new(a, LITERAL, (char *)word->name);
+                break;
+            }
+            case rule_type: {
+                node_id *callee = def->val && def->val <= v->rule_count ? tack_get(&c->rules, def->val - 1) : NULL;
+                if (!callee || (!v->defined[def->val - 1] && !tack_hexists(&c->imports, callee->name))) {
+                    problem = "a reference to an undefined rule";
+                    goto fail;
+                }
+                node = node_new(a, RULE, (char *)callee->name);
+                break;
+            }
+            case list_type: {
+                node_id *list = def->val && def->val <= (uint32_t)tack_len(&c->lists) ? tack_get(&c->lists, def->val - 1) : NULL;
+                if (!list) {
+                    problem = "an undefined list id";
+                    goto fail;
+                }
+                node = node_new(a, LIST, (char *)list->name);
+                break;
+            }
+            default:
+                problem = "an unknown rule_def type";
+                goto fail;
+        }
+        node->id = def->val;
+        if (depth == 0) {
+            root = node;
+        } else {
+            node_push(stack[depth - 1], node);
+        }
+        if (def->type == start_type)
+            stack[depth++] = node;
+    }
+    if (depth == 0 && root) {
+        free(stack);
+        return root;
+    }
+fail:
+    free(stack);
+    node_free(root);
+    asprintf(v->err, "rule \"%s\" has %s", rule->name, problem);
+    return NULL;
+}
+
+// links each defined rule's nfa, and imports by dragon's rule number
+static int raw_link(raw_view *v) {
+    grammar_core *c = v->c;
+    tack_t frags = {0};
+    int ret = 0;
+    node_id *ent;
+    tack_foreach(&c->imports, ent) {
+        uint32_t dragon_id = dragon_rule_id(ent->name);
+        if (!dragon_id || v->defined[ent->id - 1]) {
+            asprintf(v->err, "can't import rule \"%s\"", ent->name);
+            ret = -1;
+            goto cleanup;
+        }
+        tack_set(&frags, ent->id - 1, nfa_import(dragon_id));
+    }
+    tack_foreach(&c->exports, ent) {
+        if (!v->defined[ent->id - 1]) {
+            asprintf(v->err, "exported rule \"%s\" isn't defined", ent->name);
+            ret = -1;
+            goto cleanup;
+        }
+    }
+    tack_foreach(&c->rules, ent) {
+        buffer *buf = ent->data;
+        if (!buf)
+            continue;
+        arena *nodes = arena_new(4 * 1024);
+        Node *root = raw_tree(v, nodes, ent, (const rule_def *)(buf->data + sizeof(rule_header)),
+                              (buf->size - sizeof(rule_header)) / sizeof(rule_def));
+        if (root) {
+            tack_set(&frags, ent->id - 1, nfa_compile(root));
+            node_free(root);
+        }
+        arena_free(nodes);
+        if (!root) {
+            ret = -1;
+            goto cleanup;
+        }
+    }
+    if (tack_len(&frags) < tack_len(&c->rules))
+        tack_set(&frags, tack_len(&c->rules) - 1, NULL);
+    c->nfa = nfa_link(c->arena, &frags);
+cleanup:
+    for (int i = 0; i < tack_len(&frags); i++) nfa_frag_free(tack_get(&frags, i));
+    tack_clear(&frags);
+    return ret;
+}
+
+grammar_core *raw_load(const uint8_t *data, size_t size, json_t *rules, char **err) {
+    grammar_core *c = calloc(1, sizeof(grammar_core));
+    c->refs = 1;
+    c->arena = arena_new(64 * 1024);
+    raw_view v = {.c = c, .data = data, .size = size, .err = err};
+    uint32_t max_id = json_array_size(rules);
+    if (raw_chunks(&v) || raw_ids(&v, CHUNK_EXPORTS, &c->exports))
+        goto fail;
+    if (!tack_hexists(&c->exports, CORE_MAIN)) {
+        asprintf(err, "packed grammar has no main rule export");
+        goto fail;
+    }
+    if ((v.chunks[CHUNK_IMPORTS].size && raw_ids(&v, CHUNK_IMPORTS, &c->imports)) ||
+            (v.chunks[CHUNK_WORDS].size && raw_ids(&v, CHUNK_WORDS, &c->words)) ||
+            (v.chunks[CHUNK_LISTS].size && raw_ids(&v, CHUNK_LISTS, &c->lists)) ||
+            raw_scan_rules(&v, &max_id))
+        goto fail;
+    node_id *ent;
+    tack_t *named[] = {&c->exports, &c->imports};
+    for (int t = 0; t < 2; t++) {
+        tack_foreach(named[t], ent) {
+            if ((uint32_t)ent->id > max_id) max_id = ent->id;
+        }
+    }
+    if (max_id > RAW_RULES) {
+        asprintf(err, "rule id %u out of range", max_id);
+        goto fail;
+    }
+    v.rule_count = max_id;
+    v.defined = calloc(v.rule_count + 1, sizeof(bool));
+    if (raw_defined(&v) || raw_rules(&v, rules))
+        goto fail;
+
+    // the body is every chunk but the exports, which grammar_new packs under the new name
+    c->body = arena_alloc(c->arena, sizeof(buffer));
+    c->body->size = size - sizeof(grammar_header) - v.chunks[CHUNK_EXPORTS].size;
+    c->body->data = arena_alloc(c->arena, c->body->size + 1);
+    size_t pos = 0;
+    for (size_t offset = sizeof(grammar_header); offset < size;) {
+        const chunk_header *chunk = (const chunk_header *)(data + offset);
+        size_t chunk_size = sizeof(chunk_header) + chunk->size;
+        if (chunk->type != CHUNK_EXPORTS) {
+            memcpy(c->body->data + pos, chunk, chunk_size);
+            c->chunks[chunk->type] = (chunk_span){.offset = pos, .size = chunk_size};
+            pos += chunk_size;
+        }
+        offset += chunk_size;
+    }
+    // defined rules point at their rule_defs in the body, as compiled ones do
+    uint8_t *rule = c->body->data + c->chunks[CHUNK_RULES].offset + sizeof(chunk_header);
+    uint8_t *rules_end = c->body->data + c->chunks[CHUNK_RULES].offset + c->chunks[CHUNK_RULES].size;
+    while (rule < rules_end) {
+        const rule_header *header = (const rule_header *)rule;
+        buffer *buf = arena_alloc(c->arena, sizeof(buffer));
+        buf->data = rule;
+        buf->size = header->size;
+        ent = tack_get(&c->rules, header->id - 1);
+        ent->data = buf;
+        rule += header->size;
+    }
+    if (raw_link(&v))
+        goto fail;
+    // with no rule sources, g.update compiles every rule again
+    c->dependent = arena_calloc(c->arena, v.rule_count * sizeof(bool) + 1);
+    grammar_graph(c);
+    free(v.names);
+    free(v.defined);
+    return c;
+
+fail:
+    free(v.names);
+    free(v.defined);
+    core_free(c);
+    return NULL;
+}
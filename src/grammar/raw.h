@@ -0,0 +1,20 @@
+#ifndef GRAMMAR_RAW_H
+#define GRAMMAR_RAW_H
+
+#include <jansson.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "compile.h"
+
+// packed grammars built ahead of time are loaded by checking their structure and
+// rebuilding the matcher's tables from their rule_defs, without any rule text.
+// exports are named "grammar:rule" as g.load packs them, and are renamed for the
+// new grammar. packed grammars don't name private rules, so those are named by
+// rules (a json array of names by rule id - 1), or ":id", which the matcher treats
+// as part of the rules calling them
+
+// returns NULL with err set if data isn't a well formed packed grammar
+grammar_core *raw_load(const uint8_t *data, size_t size, json_t *rules, char **err);
+
+#endif
@@ -0,0 +1,135 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rulecache.h"
+#include "tack.h"
+
+typedef struct rule_entry {
+    char *key;
+    tack_t *table;
+    cached_rule *rule;
+    struct rule_entry *prev, *next;
+} rule_entry;
+
+// string rules are keyed by their text, and arrays by their json, in separate
+// tables so a string can't collide with an array's dump. entries are in a list
+// from most to least recently used
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static tack_t strings, arrays;
+static rule_entry *head, *tail;
+static size_t total;
+
+static void entry_unlink(rule_entry *e) {
+    if (e->prev) e->prev->next = e->next;
+    else head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void entry_push(rule_entry *e) {
+    e->next = head;
+    if (head) head->prev = e;
+    head = e;
+    if (!tail) tail = e;
+}
+
+// returns the key for source, which the caller frees if it isn't the string's own text
+static const char *source_key(json_t *source, tack_t **table) {
+    if (json_is_string(source)) {
+        *table = &strings;
+        return json_string_value(source);
+    }
+    *table = &arrays;
+    return json_dumps(source, JSON_COMPACT);
+}
+
+static void rule_free(cached_rule *rule) {
+    for (uint32_t i = 0; i < rule->shared_count; i++) {
+        rule_cache_release(rule->shared[i]);
+    }
+    free(rule->shared);
+    nfa_frag_free(rule->frag);
+    free(rule->syms);
+    free(rule->defs);
+    free(rule);
+}
+
+cached_rule *rule_cache_get(json_t *source) {
+    tack_t *table;
+    const char *key = source_key(source, &table);
+    if (!key)
+        return NULL;
+    pthread_mutex_lock(&lock);
+    rule_entry *e = tack_hget(table, key);
+    cached_rule *rule = NULL;
+    if (e) {
+        entry_unlink(e);
+        entry_push(e);
+        rule = e->rule;
+        rule->refs++;
+    }
+    pthread_mutex_unlock(&lock);
+    if (table == &arrays)
+        free((char *)key);
+    return rule;
+}
+
+void rule_cache_put(json_t *source, cached_rule *rule) {
+    if (rule->size > RULE_CACHE_SIZE / 4)
+        return;
+    tack_t *table;
+    const char *key = source_key(source, &table);
+    if (!key)
+        return;
+    // evicted rules are freed after unlocking, as freeing releases their shared rules
+    tack_t evicted = {0};
+    pthread_mutex_lock(&lock);
+    // another worker may have compiled the same rule first
+    if (!tack_hexists(table, key)) {
+        rule_entry *e = calloc(1, sizeof(rule_entry));
+        e->key = strdup(key);
+        e->table = table;
+        e->rule = rule;
+        rule->refs++;
+        tack_hset(table, e->key, e);
+        entry_push(e);
+        total += rule->size;
+    }
+    while (total > RULE_CACHE_SIZE) {
+        rule_entry *old = tail;
+        entry_unlink(old);
+        tack_hdel(old->table, old->key);
+        total -= old->rule->size;
+        if (--old->rule->refs == 0)
+            tack_push(&evicted, old->rule);
+        free(old->key);
+        free(old);
+    }
+    pthread_mutex_unlock(&lock);
+    cached_rule *old;
+    tack_foreach(&evicted, old) {
+        rule_free(old);
+    }
+    tack_clear(&evicted);
+    if (table == &arrays)
+        free((char *)key);
+}
+
+void rule_cache_retain(cached_rule *rule) {
+    pthread_mutex_lock(&lock);
+    rule->refs++;
+    pthread_mutex_unlock(&lock);
+}
+
+void rule_cache_release(cached_rule *rule) {
+    if (rule == NULL)
+        return;
+    pthread_mutex_lock(&lock);
+    bool last = --rule->refs == 0;
+    pthread_mutex_unlock(&lock);
+    if (last)
+        rule_free(rule);
+}
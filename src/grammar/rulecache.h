@@ -0,0 +1,50 @@
+#ifndef GRAMMAR_RULECACHE_H
+#define GRAMMAR_RULECACHE_H
+
+#include <jansson.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nfa.h"
+
+// compiled rules by source, shared by every grammar compile so a rule seen
+// before skips parsing, optimizing and nfa compiling. a cached rule numbers its
+// words, lists and rule refs locally, in the order the tree first used them,
+// and is relinked to a grammar's ids when it's defined. the least recently used
+// rules are dropped past RULE_CACHE_SIZE bytes.
+
+#define RULE_CACHE_SIZE (16 << 20)
+
+typedef struct {
+    // LITERAL, RULE or LIST
+    uint32_t type;
+    // interned
+    const char *name;
+} rule_symbol;
+
+typedef struct cached_rule {
+    int refs;
+    // including the shared rules
+    size_t size;
+    rule_symbol *syms;
+    uint32_t sym_count;
+    // rule_defs without the rule header. word, rule and list values are symbol indices
+    uint8_t *defs;
+    size_t defs_size;
+    // state ids are symbol indices too
+    nfa_frag *frag;
+    // subtrees split out into shared rules, inner ones first. the rule holds a
+    // reference to each, and a shared rule's interned name is a hash of its subtree
+    struct cached_rule **shared;
+    uint32_t shared_count;
+    const char *name;
+} cached_rule;
+
+// returns a reference to the rule compiled from source, or NULL
+cached_rule *rule_cache_get(json_t *source);
+// the cache takes its own reference
+void rule_cache_put(json_t *source, cached_rule *rule);
+void rule_cache_retain(cached_rule *rule);
+void rule_cache_release(cached_rule *rule);
+
+#endif
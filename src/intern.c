@@ -0,0 +1,261 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+
+// strings are copied into blocks which are never freed, and found by id through
+// fixed-size pages, so intern_str doesn't need the lock. counted strings are
+// copied on their own, so they can be freed
+
+#define PAGE_BITS 12
+#define PAGE_SIZE (1 << PAGE_BITS)
+#define PAGE_COUNT 4096
+#define BLOCK_SIZE (64 * 1024)
+
+typedef struct {
+    uint32_t hash, id;
+} intern_slot;
+
+static struct {
+    pthread_rwlock_t lock;
+    const char **pages[PAGE_COUNT];
+    // reference counts by id, alongside pages. 0 = interned for good
+    uint32_t *refs[PAGE_COUNT];
+    uint32_t count;
+    // ids of freed counted strings, to reuse
+    uint32_t *free_ids;
+    uint32_t free_count, free_cap;
+    // open addressing by string hash, id 0 = empty
+    intern_slot *table;
+    uint32_t cap;
+    char *block;
+    size_t block_left;
+} interner = {.lock = PTHREAD_RWLOCK_INITIALIZER};
+
+static uint32_t str_hash(const char *str) {
+    uint32_t h = 2166136261u;
+    while (*str) h = (h ^ (uint8_t)*str++) * 16777619u;
+    return h;
+}
+
+const char *intern_str(uint32_t id) {
+    if (id == 0 || id > interner.count)
+        return NULL;
+    return interner.pages[id >> PAGE_BITS][id & (PAGE_SIZE - 1)];
+}
+
+static uint32_t *intern_refs(uint32_t id) {
+    return &interner.refs[id >> PAGE_BITS][id & (PAGE_SIZE - 1)];
+}
+
+static uint32_t intern_lookup(const char *str, uint32_t hash) {
+    if (interner.cap == 0)
+        return 0;
+    uint32_t mask = interner.cap - 1;
+    for (uint32_t h = hash & mask; interner.table[h].id; h = (h + 1) & mask) {
+        intern_slot *slot = &interner.table[h];
+        if (slot->hash == hash && strcmp(intern_str(slot->id), str) == 0)
+            return slot->id;
+    }
+    return 0;
+}
+
+static void intern_insert(intern_slot slot) {
+    uint32_t mask = interner.cap - 1;
+    uint32_t h = slot.hash & mask;
+    while (interner.table[h].id) h = (h + 1) & mask;
+    interner.table[h] = slot;
+}
+
+// backward shift deletion, so lookups don't stop at the emptied slot
+static void intern_remove(uint32_t hash, uint32_t id) {
+    uint32_t mask = interner.cap - 1;
+    uint32_t h = hash & mask;
+    while (interner.table[h].id != id) h = (h + 1) & mask;
+    for (uint32_t next = (h + 1) & mask; interner.table[next].id; next = (next + 1) & mask) {
+        uint32_t home = interner.table[next].hash & mask;
+        // entries whose home is cyclically in (h, next] stay put
+        if (h <= next ? (h < home && home <= next) : (h < home || home <= next))
+            continue;
+        interner.table[h] = interner.table[next];
+        h = next;
+    }
+    interner.table[h] = (intern_slot){0};
+}
+
+static const char *intern_copy(const char *str) {
+    size_t len = strlen(str) + 1;
+    if (len > BLOCK_SIZE / 4)
+        return strdup(str);
+    if (len > interner.block_left) {
+        interner.block = malloc(BLOCK_SIZE);
+        interner.block_left = BLOCK_SIZE;
+    }
+    char *copy = interner.block;
+    memcpy(copy, str, len);
+    interner.block += len;
+    interner.block_left -= len;
+    return copy;
+}
+
+uint32_t intern_find(const char *str) {
+    uint32_t hash = str_hash(str);
+    pthread_rwlock_rdlock(&interner.lock);
+    uint32_t id = intern_lookup(str, hash);
+    pthread_rwlock_unlock(&interner.lock);
+    return id;
+}
+
+// with the write lock held. returns 0 if the interner is full
+static uint32_t intern_add(const char *str, uint32_t hash, bool counted) {
+    uint32_t id;
+    if (interner.free_count) {
+        id = interner.free_ids[--interner.free_count];
+    } else {
+        if (interner.count + 1 >= PAGE_COUNT * PAGE_SIZE) {
+            fprintf(stderr, "warning: string interner is full\n");
+            return 0;
+        }
+        id = interner.count + 1;
+    }
+    if ((interner.count + 1) * 2 > interner.cap) {
+        intern_slot *old = interner.table;
+        uint32_t old_cap = interner.cap;
+        interner.cap = old_cap ? old_cap * 2 : 1024;
+        interner.table = calloc(interner.cap, sizeof(intern_slot));
+        for (uint32_t i = 0; i < old_cap; i++) {
+            if (old[i].id) intern_insert(old[i]);
+        }
+        free(old);
+    }
+    uint32_t page = id >> PAGE_BITS;
+    if (interner.pages[page] == NULL) {
+        interner.pages[page] = calloc(PAGE_SIZE, sizeof(char *));
+        interner.refs[page] = calloc(PAGE_SIZE, sizeof(uint32_t));
+    }
+    interner.pages[page][id & (PAGE_SIZE - 1)] = counted ? strdup(str) : intern_copy(str);
+    *intern_refs(id) = counted;
+    intern_insert((intern_slot){.hash = hash, .id = id});
+    if (id > interner.count)
+        interner.count = id;
+    return id;
+}
+
+uint32_t intern(const char *str) {
+    uint32_t hash = str_hash(str);
+    pthread_rwlock_rdlock(&interner.lock);
+    uint32_t id = intern_lookup(str, hash);
+    bool counted = id && *intern_refs(id);
+    pthread_rwlock_unlock(&interner.lock);
+    if (id && !counted)
+        return id;
+
+    pthread_rwlock_wrlock(&interner.lock);
+    // someone may have added or released it while we were unlocked
+    id = intern_lookup(str, hash);
+    if (id == 0) {
+        id = intern_add(str, hash, false);
+    } else {
+        // counted strings interned for good stay
+        *intern_refs(id) = 0;
+    }
+    pthread_rwlock_unlock(&interner.lock);
+    return id;
+}
+
+uint32_t intern_ref(const char *str) {
+    uint32_t hash = str_hash(str);
+    pthread_rwlock_wrlock(&interner.lock);
+    uint32_t id = intern_lookup(str, hash);
+    if (id == 0) {
+        id = intern_add(str, hash, true);
+    } else if (*intern_refs(id)) {
+        (*intern_refs(id))++;
+    }
+    pthread_rwlock_unlock(&interner.lock);
+    return id;
+}
+
+void intern_retain(uint32_t id) {
+    if (id == 0)
+        return;
+    pthread_rwlock_wrlock(&interner.lock);
+    if (*intern_refs(id))
+        (*intern_refs(id))++;
+    pthread_rwlock_unlock(&interner.lock);
+}
+
+void intern_release(uint32_t id) {
+    if (id == 0)
+        return;
+    pthread_rwlock_wrlock(&interner.lock);
+    uint32_t *refs = intern_refs(id);
+    if (*refs && --*refs == 0) {
+        const char **slot = &interner.pages[id >> PAGE_BITS][id & (PAGE_SIZE - 1)];
+        intern_remove(str_hash(*slot), id);
+        free((char *)*slot);
+        *slot = NULL;
+        if (interner.free_count == interner.free_cap) {
+            interner.free_cap = interner.free_cap ? interner.free_cap * 2 : 256;
+            interner.free_ids = realloc(interner.free_ids, interner.free_cap * sizeof(uint32_t));
+        }
+        interner.free_ids[interner.free_count++] = id;
+    }
+    pthread_rwlock_unlock(&interner.lock);
+}
+
+const char *intern_name(const char *str) {
+    return intern_str(intern(str));
+}
+
+static inline uint32_t set_slot(uint32_t id, uint32_t mask) {
+    return (id * 2654435761u) & mask;
+}
+
+bool intern_set_add(intern_set *set, uint32_t id) {
+    if (id == 0 || intern_set_has(set, id))
+        return false;
+    if ((set->len + 1) * 2 > set->cap) {
+        uint32_t *old = set->keys;
+        int old_cap = set->cap;
+        set->cap = old_cap ? old_cap * 2 : 16;
+        set->keys = calloc(set->cap, sizeof(uint32_t));
+        set->len = 0;
+        for (int i = 0; i < old_cap; i++) {
+            if (old[i]) intern_set_add(set, old[i]);
+        }
+        free(old);
+    }
+    uint32_t mask = set->cap - 1;
+    uint32_t h = set_slot(id, mask);
+    while (set->keys[h]) h = (h + 1) & mask;
+    set->keys[h] = id;
+    set->len++;
+    return true;
+}
+
+bool intern_set_has(const intern_set *set, uint32_t id) {
+    if (set->cap == 0 || id == 0)
+        return false;
+    uint32_t mask = set->cap - 1;
+    for (uint32_t h = set_slot(id, mask); set->keys[h]; h = (h + 1) & mask) {
+        if (set->keys[h] == id)
+            return true;
+    }
+    return false;
+}
+
+void intern_set_clear(intern_set *set) {
+    free(set->keys);
+    set->keys = NULL;
+    set->cap = set->len = 0;
+}
+
+void intern_set_release(intern_set *set) {
+    for (int i = 0; i < set->cap; i++) {
+        if (set->keys[i]) intern_release(set->keys[i]);
+    }
+    intern_set_clear(set);
+}
@@ -0,0 +1,37 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// process-wide string interner: every distinct string gets one id (> 0) and one
+// copy, which lives until exit. ids and strings are shared by the compiler, the
+// list store and the matcher, so comparisons there are integer compares.
+
+uint32_t intern(const char *str);
+// counted references, for strings that come and go like list items. the entry is
+// freed and its id reused once the last one is released, unless it was interned
+// for good too. a counted id is only valid while a reference to it is held
+uint32_t intern_ref(const char *str);
+void intern_retain(uint32_t id);
+void intern_release(uint32_t id);
+// returns 0 if str was never interned, without adding it
+uint32_t intern_find(const char *str);
+const char *intern_str(uint32_t id);
+// shorthand for intern_str(intern(str))
+const char *intern_name(const char *str);
+
+// set of interned ids, used for list contents
+typedef struct {
+    uint32_t *keys;
+    int cap, len;
+} intern_set;
+
+// returns false if id was in the set already
+bool intern_set_add(intern_set *set, uint32_t id);
+bool intern_set_has(const intern_set *set, uint32_t id);
+void intern_set_clear(intern_set *set);
+// releases a reference to each id in the set, then clears it
+void intern_set_release(intern_set *set);
+
+#endif
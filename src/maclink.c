@@ -63,6 +63,7 @@ static void cons() {
 void *DSXEngine_New() {
     _engine = _DSXEngine_New();
     printf("DSXEngine_New() = %p\n", _engine);
+    maclink_engine_ready();
     return _engine;
 }
 
@@ -70,6 +71,7 @@ int DSXEngine_Create(char *s, uint64_t val, drg_engine **engine) {
     int ret = _DSXEngine_Create(s, val, engine);
     _engine = *engine;
     printf("DSXEngine_Create(%s, %u, &%p) = %d\n", s, val, engine, ret);
+    maclink_engine_ready();
     return ret;
 }
 
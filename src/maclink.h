@@ -3,6 +3,7 @@
 
 #include <czmq.h>
 #include <stdint.h>
+#include "dsx.h"
 #include "tack.h"
 
 #ifdef VERBOSE
@@ -11,43 +12,6 @@
 #define dprintf(...)
 #endif
 
-typedef struct {
-    void *data;
-    uint32_t size;
-} dsx_dataptr;
-
-typedef struct {
-    uint32_t var1;
-    uint32_t var2;
-    uint32_t var3;
-    uint32_t var4;
-    uint32_t var5;
-    uint32_t var6;
-    uint64_t start_time;
-    uint64_t end_time;
-    uint32_t var9;
-    uint32_t var10;
-    uint32_t var11;
-    uint32_t var12;
-    uint32_t rule;
-    uint32_t var14;
-} __attribute__((packed)) dsx_word_node;
-
-typedef struct {} drg_grammar;
-typedef struct {} drg_engine;
-typedef struct {} dsx_result;
-
-typedef struct {
-    void *var0;
-    unsigned int var1;
-    unsigned int flags;
-    uint64_t var3;
-    uint64_t var4;
-    char *phrase;
-    dsx_result *result;
-    void *var7;
-} dsx_end_phrase;
-
 extern drg_engine *_engine;
 
 extern drg_engine *(*_DSXEngine_New)();
@@ -75,7 +39,15 @@ struct state {
     pthread_t tid;
     pthread_mutex_t publock;
 
+    // held while handling a command, and while a finished load is applied
+    pthread_mutex_t lock;
     tack_t grammars;
+    // g.loads still compiling, oldest first, and the ticket of the next one
+    struct pool *loader;
+    struct load_job *loads;
+    uint32_t ticket;
+    // signalled when loads are applied
+    pthread_cond_t loaded;
 };
 
 #endif
@@ -0,0 +1,526 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "grammar/compile.h"
+#include "grammar/dfa.h"
+#include "grammar/nfa.h"
+#include "intern.h"
+#include "match.h"
+
+// Earley-style chart matcher over the grammar's flat NFA
+//
+// set k holds every (nfa state, rule, origin) item reachable after consuming k
+// words. states are leaves with epsilon hops already resolved, so every item is a
+// word, list or rule reference. RULE leaves predict the referenced rule's entry
+// states at k, and a rule end item
+// with origin j advances every item in set j waiting on that rule. each item keeps
+// a single back-pointer to the first derivation found, which is walked at the end
+// to attribute words to rules. this is O(n^3) worst case and close to linear on
+// typical command grammars, and never recurses on the input.
+//
+// rules without rule references are run through a lazily built DFA instead of being
+// predicted: one run from k adds a rule end item at every position the rule can end,
+// and the words it spans are attributed as a block.
+//
+// guided mode uses the rule dragon attributed each word to: a rule is only predicted
+// if it can reach the next word's rule (or match nothing), and words are only scanned
+// by states in their own rule. if the attribution is unusable or doesn't lead to a
+// complete parse, the full search runs instead.
+
+enum item_kind {
+    ITEM_PREDICT,
+    ITEM_SCAN,
+    ITEM_COMPLETE,
+    ITEM_DFA,
+};
+
+// marks that a rule's DFA has already run from this set
+#define DFA_MARK (NFA_END - 1)
+
+typedef struct {
+    uint32_t state; // NFA_END = end of rule
+    uint32_t rule;
+    int origin, pos;
+    // back-pointer: previous item in this rule, and completed subrule end item
+    enum item_kind kind;
+    int prev, child;
+} chart_item;
+
+typedef struct {
+    Grammar *g;
+    const nfa *n;
+    result_node *words;
+    int count;
+
+    chart_item *items;
+    int len, cap;
+    // sets[k] is the index of the first item in set k
+    int *sets;
+    // scanned items waiting for the next set, and DFA ends waiting for later sets
+    chart_item *next, *later;
+    int next_len, next_cap, later_len, later_cap;
+    // dedup table for the current set, holding item index + 1
+    int *hash;
+    int hash_cap, hash_len;
+
+    // guided mode: each word's rule, its bit in mask, and the words' rules each rule can reach
+    bool guided;
+    uint32_t *word_rule, *mask, *reach;
+
+    // end positions of the current DFA run
+    dfa_cache *dfa;
+    int *ends;
+} chart;
+
+static inline bool nfa_accept(Grammar *g, const nfa_state *state, result_node *rnode) {
+    switch (state->type) {
+        case NFA_WORD:
+            return rnode->id == state->id || (rnode->id == 0 && rnode->sym == state->sym);
+        case NFA_LIST: {
+            intern_set *list = tack_get(&g->listdata, state->id - 1);
+            return intern_set_has(list, rnode->sym);
+        }
+        default: return false;
+    }
+}
+
+static inline uint32_t item_hash(uint32_t state, uint32_t rule, int origin) {
+    uint32_t h = state;
+    h = h * 31 + rule;
+    h = h * 31 + origin;
+    return h * 2654435761u;
+}
+
+static void hash_reset(chart *c, int size) {
+    int cap = 64;
+    while (cap < size * 2) cap <<= 1;
+    if (cap > c->hash_cap) {
+        free(c->hash);
+        c->hash = malloc(cap * sizeof(int));
+        c->hash_cap = cap;
+    }
+    memset(c->hash, 0, c->hash_cap * sizeof(int));
+    c->hash_len = 0;
+}
+
+// returns the slot for this item in the current set's dedup table
+static int *hash_slot(chart *c, uint32_t state, uint32_t rule, int origin) {
+    uint32_t mask = c->hash_cap - 1;
+    uint32_t h = item_hash(state, rule, origin) & mask;
+    while (c->hash[h]) {
+        chart_item *it = &c->items[c->hash[h] - 1];
+        if (it->state == state && it->rule == rule && it->origin == origin)
+            break;
+        h = (h + 1) & mask;
+    }
+    return &c->hash[h];
+}
+
+static int chart_find(chart *c, uint32_t state, uint32_t rule, int origin) {
+    return *hash_slot(c, state, rule, origin) - 1;
+}
+
+// adds an item to the current set unless it's already there
+static void chart_add(chart *c, chart_item item) {
+    if ((c->hash_len + 1) * 2 > c->hash_cap) {
+        int start = c->sets[item.pos];
+        hash_reset(c, c->hash_cap);
+        for (int i = start; i < c->len; i++) {
+            chart_item *it = &c->items[i];
+            *hash_slot(c, it->state, it->rule, it->origin) = i + 1;
+            c->hash_len++;
+        }
+    }
+    int *slot = hash_slot(c, item.state, item.rule, item.origin);
+    if (*slot)
+        return;
+    if (c->len == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 256;
+        c->items = realloc(c->items, c->cap * sizeof(chart_item));
+    }
+    c->items[c->len++] = item;
+    *slot = c->len;
+    c->hash_len++;
+}
+
+static void chart_queue(chart *c, chart_item item) {
+    if (c->next_len == c->next_cap) {
+        c->next_cap = c->next_cap ? c->next_cap * 2 : 64;
+        c->next = realloc(c->next, c->next_cap * sizeof(chart_item));
+    }
+    c->next[c->next_len++] = item;
+}
+
+static void chart_later(chart *c, chart_item item) {
+    if (c->later_len == c->later_cap) {
+        c->later_cap = c->later_cap ? c->later_cap * 2 : 64;
+        c->later = realloc(c->later, c->later_cap * sizeof(chart_item));
+    }
+    c->later[c->later_len++] = item;
+}
+
+// follows every edge out of an item's state, into the current set or (for scans) the next one
+static void chart_advance(chart *c, int from, enum item_kind kind, int child, int pos) {
+    chart_item it = c->items[from];
+    const nfa_state *state = &c->n->states[it.state];
+    for (uint32_t e = state->edge; e < state->edge + state->count; e++) {
+        chart_item next = {
+            .state = c->n->edges[e], .rule = it.rule, .origin = it.origin, .pos = pos,
+            .kind = kind, .prev = from, .child = child,
+        };
+        if (kind == ITEM_SCAN) {
+            chart_queue(c, next);
+        } else {
+            chart_add(c, next);
+        }
+    }
+}
+
+static void chart_complete(chart *c, int idx) {
+    chart_item end = c->items[idx];
+    int stop = end.origin == end.pos ? idx : c->sets[end.origin + 1];
+    for (int i = c->sets[end.origin]; i < stop; i++) {
+        uint32_t state = c->items[i].state;
+        if (state < c->n->state_count && c->n->states[state].type == NFA_RULE &&
+                c->n->states[state].id == end.rule) {
+            chart_advance(c, i, ITEM_COMPLETE, idx, end.pos);
+        }
+    }
+}
+
+// adds a rule's entry states to the current set
+static void chart_enter(chart *c, uint32_t id, int pos) {
+    const nfa_rule *rule = &c->n->rules[id - 1];
+    for (uint32_t e = rule->entry; e < rule->entry + rule->entry_count; e++) {
+        chart_add(c, (chart_item){
+            .state = c->n->edges[e], .rule = id, .origin = pos, .pos = pos,
+            .kind = ITEM_PREDICT, .prev = -1, .child = -1,
+        });
+    }
+}
+
+// runs a regular rule's DFA from pos, adding an end item wherever it can end
+// returns false if the DFA cache is full and the rule needs to be predicted instead
+static bool chart_dfa(chart *c, uint32_t id, int pos) {
+    if (chart_find(c, DFA_MARK, id, pos) >= 0)
+        return true;
+    int state = dfa_start(c->dfa, id);
+    int ends = 0;
+    for (int k = pos; state >= 0; k++) {
+        if (dfa_accepting(c->dfa, state))
+            c->ends[ends++] = k;
+        if (k == c->count || (c->guided && c->word_rule[k] != id))
+            break;
+        state = dfa_step(c->dfa, state, c->words[k].sym);
+    }
+    if (state == DFA_FULL)
+        return false;
+    chart_add(c, (chart_item){
+        .state = DFA_MARK, .rule = id, .origin = pos, .pos = pos,
+        .kind = ITEM_PREDICT, .prev = -1, .child = -1,
+    });
+    for (int i = 0; i < ends; i++) {
+        chart_item end = {
+            .state = NFA_END, .rule = id, .origin = pos, .pos = c->ends[i],
+            .kind = ITEM_DFA, .prev = -1, .child = -1,
+        };
+        if (end.pos == pos) {
+            chart_add(c, end);
+        } else {
+            chart_later(c, end);
+        }
+    }
+    return true;
+}
+
+static void chart_predict(chart *c, int idx) {
+    chart_item it = c->items[idx];
+    uint32_t id = c->n->states[it.state].id;
+    const nfa_rule *rule = &c->n->rules[id - 1];
+    if (rule->import) {
+        // imports match a run of words dragon attributed to its rule number
+        if (it.pos < c->count && c->words[it.pos].rule == rule->import) {
+            chart_item self = it;
+            self.pos++;
+            self.kind = ITEM_SCAN;
+            self.prev = idx;
+            chart_queue(c, self);
+            chart_advance(c, idx, ITEM_SCAN, -1, it.pos + 1);
+        }
+        return;
+    }
+    if (c->guided && !(c->reach[id] & c->mask[it.pos]) && !c->g->core->graph.nullable[id - 1])
+        return;
+    if (!c->dfa || !dfa_regular(c->dfa, id) || !chart_dfa(c, id, it.pos))
+        chart_enter(c, id, it.pos);
+    // the rule may have already completed empty in this set
+    int done = chart_find(c, NFA_END, id, it.pos);
+    if (done >= 0)
+        chart_advance(c, idx, ITEM_COMPLETE, done, it.pos);
+}
+
+static void chart_process(chart *c, int k) {
+    for (int i = c->sets[k]; i < c->len; i++) {
+        chart_item *it = &c->items[i];
+        if (it->state == DFA_MARK) {
+            continue;
+        } else if (it->state == NFA_END) {
+            chart_complete(c, i);
+        } else if (c->n->states[it->state].type == NFA_RULE) {
+            chart_predict(c, i);
+        } else if (k < c->count && (!c->guided || c->word_rule[k] == it->rule) &&
+                nfa_accept(c->g, &c->n->states[it->state], &c->words[k])) {
+            chart_advance(c, i, ITEM_SCAN, -1, k + 1);
+        }
+    }
+}
+
+static const char *rule_name_of(Grammar *g, uint32_t id) {
+    node_id *ent = tack_get(&g->core->rules, id - 1);
+    return ent->name;
+}
+
+// attr is a RULE state, or NFA_END for the main rule
+static const char *attr_name(chart *c, uint32_t attr) {
+    if (attr == NFA_END)
+        return c->g->main_rule;
+    const nfa_state *state = &c->n->states[attr];
+    return state->key ? intern_str(state->key) : rule_name_of(c->g, state->id);
+}
+
+// walks one rule's derivation back from its end item, attributing words the same way
+// the old recursive matcher did: words belong to the rule referenced from a public rule,
+// or to the public rule itself
+static void chart_attribute(chart *c, int idx, uint32_t attr, int level, const char **rule_name) {
+    while (idx >= 0) {
+        chart_item *it = &c->items[idx];
+        switch (it->kind) {
+            case ITEM_PREDICT:
+                return;
+            case ITEM_DFA:
+                for (int k = it->origin; k < it->pos; k++) {
+                    c->words[k].rule_name = attr_name(c, attr);
+                }
+                return;
+            case ITEM_SCAN: {
+                uint32_t state = c->items[it->prev].state;
+                uint32_t word_attr = attr;
+                if (c->n->states[state].type == NFA_RULE && level < 2)
+                    word_attr = state;
+                c->words[it->pos - 1].rule_name = attr_name(c, word_attr);
+                break;
+            }
+            case ITEM_COMPLETE: {
+                uint32_t state = c->items[it->prev].state;
+                const char *name = rule_name_of(c->g, c->n->states[state].id);
+                if (level == 0)
+                    *rule_name = name;
+                // shared rules stand in for part of their caller, so they're attributed as if inline
+                if (rule_shared(name))
+                    chart_attribute(c, it->child, attr, level, rule_name);
+                else
+                    chart_attribute(c, it->child, level < 2 ? state : attr, level + 1, rule_name);
+                break;
+            }
+        }
+        idx = it->prev;
+    }
+}
+
+// attributes the words of the longest prefix that no parse completes, as the old matcher did
+// for partial hypotheses. the first item in the furthest set is walked back through the items
+// waiting on its rule up to the main rule, and each rule's derivation is attributed from the
+// outside in. the first caller of a rule in a set was added before the rule's entries, so
+// following first callers always reaches the main rule
+static int chart_partial(chart *c, uint32_t main_id, const char **rule_name) {
+    int k = c->count;
+    while (k > 0 && c->sets[k] == c->sets[k + 1]) k--;
+    if (k == 0)
+        return 0;
+    tack_t chain = {0};
+    int idx = c->sets[k];
+    while (1) {
+        tack_push_int(&chain, idx);
+        chart_item *it = &c->items[idx];
+        if (it->rule == main_id && it->origin == 0)
+            break;
+        int caller = -1;
+        for (int i = c->sets[it->origin]; i < c->sets[it->origin + 1] && caller < 0; i++) {
+            uint32_t state = c->items[i].state;
+            if (state < c->n->state_count && c->n->states[state].type == NFA_RULE &&
+                    c->n->states[state].id == it->rule)
+                caller = i;
+        }
+        if (caller < 0)
+            break;
+        idx = caller;
+    }
+
+    uint32_t attr = NFA_END;
+    int level = 0;
+    for (int i = tack_len(&chain) - 1; i >= 0; i--) {
+        idx = tack_get_int(&chain, i);
+        if (i < tack_len(&chain) - 1) {
+            uint32_t state = c->items[tack_get_int(&chain, i + 1)].state;
+            const char *name = rule_name_of(c->g, c->items[idx].rule);
+            if (level == 0)
+                *rule_name = name;
+            if (!rule_shared(name)) {
+                attr = level < 2 ? state : attr;
+                level++;
+            }
+        }
+        chart_attribute(c, idx, attr, level, rule_name);
+    }
+    tack_clear(&chain);
+    return k;
+}
+
+// resolves the rule dragon attributed each word to, and marks every rule that can reach it
+// returns false if the attribution can't be used to guide the match
+static bool chart_guide(chart *c) {
+    Grammar *g = c->g;
+    rule_graph *graph = &g->core->graph;
+    uint32_t rules[32];
+    int distinct = 0;
+    c->word_rule = calloc(c->count, sizeof(uint32_t));
+    c->mask = calloc(c->count + 1, sizeof(uint32_t));
+    for (int k = 0; k < c->count; k++) {
+        uint32_t rule = c->words[k].rule;
+        if (rule > (uint32_t)graph->count) {
+            // imports are reported under dragon's own rule numbers
+            node_id *ent;
+            rule = 0;
+            tack_foreach(&g->core->imports, ent) {
+                if (c->n->rules[ent->id - 1].import == c->words[k].rule) rule = ent->id;
+            }
+        }
+        if (rule == 0)
+            return false;
+        int d = 0;
+        while (d < distinct && rules[d] != rule) d++;
+        if (d == distinct) {
+            if (distinct == 32) return false;
+            rules[distinct++] = rule;
+        }
+        c->word_rule[k] = rule;
+        c->mask[k] = 1u << d;
+    }
+
+    c->reach = calloc(graph->count + 1, sizeof(uint32_t));
+    tack_t stack = {0};
+    for (int d = 0; d < distinct; d++) {
+        tack_push_int(&stack, rules[d]);
+        while (tack_len(&stack) > 0) {
+            uint32_t rule = tack_pop_int(&stack);
+            if (c->reach[rule] & (1u << d))
+                continue;
+            c->reach[rule] |= 1u << d;
+            for (uint32_t i = graph->index[rule]; i < graph->index[rule + 1]; i++) {
+                tack_push_int(&stack, graph->parents[i]);
+            }
+        }
+    }
+    tack_clear(&stack);
+    return true;
+}
+
+// fills the chart, returning the end item of the longest prefix that completes the main rule
+static int chart_run(chart *c, uint32_t main_id, int *matched) {
+    int count = c->count;
+    c->sets = calloc(count + 2, sizeof(int));
+    c->ends = malloc((count + 1) * sizeof(int));
+    hash_reset(c, 32);
+    chart_enter(c, main_id, 0);
+    int k = 0;
+    while (1) {
+        chart_process(c, k);
+        if (k == count || (c->next_len == 0 && c->later_len == 0))
+            break;
+        k++;
+        c->sets[k] = c->len;
+        hash_reset(c, c->next_len + c->later_len);
+        for (int i = 0; i < c->next_len; i++) {
+            chart_add(c, c->next[i]);
+        }
+        c->next_len = 0;
+        int kept = 0;
+        for (int i = 0; i < c->later_len; i++) {
+            if (c->later[i].pos == k) {
+                chart_add(c, c->later[i]);
+            } else {
+                c->later[kept++] = c->later[i];
+            }
+        }
+        c->later_len = kept;
+    }
+    for (int i = k + 1; i <= count + 1; i++) {
+        c->sets[i] = c->len;
+    }
+
+    for (; k > 0; k--) {
+        for (int i = c->sets[k]; i < c->sets[k + 1]; i++) {
+            chart_item *it = &c->items[i];
+            if (it->state == NFA_END && it->rule == main_id && it->origin == 0) {
+                *matched = k;
+                return i;
+            }
+        }
+    }
+    *matched = 0;
+    return -1;
+}
+
+static void chart_free(chart *c) {
+    free(c->items);
+    free(c->sets);
+    free(c->next);
+    free(c->later);
+    free(c->ends);
+    free(c->hash);
+    free(c->word_rule);
+    free(c->mask);
+    free(c->reach);
+}
+
+// maps recognized words onto the grammar, setting each word's rule_name
+// returns the number of words matched by the longest complete parse
+int nfa_match(Grammar *g, result_node *words, int count, const char **rule_name) {
+    // main rule should be last nfa entry, but let's be safe and look it up
+    node_id *id = tack_hget(&g->core->rules, CORE_MAIN);
+
+    dfa_cache *dfa = dfa_get(g);
+    chart c = {.g = g, .n = g->core->nfa, .words = words, .count = count, .dfa = dfa};
+    int matched = 0, end = -1;
+    if (chart_guide(&c)) {
+        c.guided = true;
+        end = chart_run(&c, id->id, &matched);
+    }
+    if (matched < count) {
+        chart full = {.g = g, .n = g->core->nfa, .words = words, .count = count, .dfa = dfa};
+        int full_matched;
+        int full_end = chart_run(&full, id->id, &full_matched);
+        if (full_matched > matched || end < 0) {
+            chart_free(&c);
+            c = full;
+            end = full_end;
+            matched = full_matched;
+        } else {
+            chart_free(&full);
+        }
+    }
+    if (end >= 0) {
+        chart_attribute(&c, end, NFA_END, 0, rule_name);
+    } else if (count > 0) {
+        // nothing completes, as in most hypotheses. DFA rules only report where they end,
+        // so the prefix is found by predicting every rule
+        chart_free(&c);
+        c = (chart){.g = g, .n = g->core->nfa, .words = words, .count = count};
+        chart_run(&c, id->id, &matched);
+        chart_partial(&c, id->id, rule_name);
+    }
+    chart_free(&c);
+    return matched;
+}
@@ -0,0 +1,9 @@
+#ifndef MATCH_H
+#define MATCH_H
+
+#include "grammar/compile.h"
+#include "phrase.h"
+
+int nfa_match(Grammar *g, result_node *words, int count, const char **rule_name);
+
+#endif
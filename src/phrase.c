@@ -1,200 +1,11 @@
 #include <jansson.h>
 #include "maclink.h"
 #include "grammar/compile.h"
-#include "grammar/nfa.h"
+#include "intern.h"
+#include "match.h"
 #include "phrase.h"
 #include "server.h"
 
-typedef struct ll {
-    void *data;
-    Node *node;
-    struct ll *next;
-} ll;
-
-static ll *llink(ll *node, void *data) {
-    ll *next = calloc(1, sizeof(ll));
-    next->data = data;
-    if (node)
-        node->next = next;
-    return next;
-}
-
-void lfree(ll *node) {
-    while (node) {
-        ll *next = node->next;
-        free(node);
-        node = next;
-    }
-}
-
-#define printf(...)
-
-static inline bool nfa_accept(Grammar *g, const nfa *n, result_node *rnode) {
-    if (n->node == NULL)
-        return true;
-
-    printf("test \"%s\": ", rnode->word);
-    // node_dump(n->node);
-    switch (n->node->type) {
-        case LITERAL:
-            return rnode->id == n->node->id ||
-                   (rnode->id == 0 && strcmp(rnode->word, n->node->name) == 0);
-        case LIST: {
-            tack_t *list = tack_get(&g->listdata, n->node->id - 1);
-            return tack_hexists(list, rnode->word);
-        }
-        case RULE: return false;
-        default: return true;
-    }
-}
-
-#ifndef printf
-#define printf(...) do { for (int i = 0; i < level; i++) printf(" "); printf(__VA_ARGS__); } while (0)
-#endif
-
-// returns ll and length of longest path in terms of [nfa *] -> [nfa *] -> ...
-static int nfa_walk(Grammar *g, Node *rule_node, const nfa *n, ll *rnode, ll **rupdate, ll **path, ll **end, int level, int rule_level, bool *complete, char **rule_name) {
-    int add = 0;
-    // nfa_dump(n, level);
-    if (nfa_accept(g, n, rnode->data)) {
-        if (n->node != NULL) {
-            printf("accepted %s\n", ((result_node *)rnode->data)->word);
-            add = 1;
-            *end = llink(*end, (void *)n);
-            (*end)->node = rule_node;
-            if (!*path)
-                *path = *end;
-            rnode = rnode->next;
-            *rupdate = rnode;
-        }
-    } else if (n->node && n->node->type == RULE) {
-        Node *attributed_rule = rule_node;
-        if (rule_level < 2) {
-            attributed_rule = n->node;
-        }
-        printf("rule recurse: <%s>\n", n->node->name);
-        // recurse into rule, chaining back to this nfa node
-        // unless it's an imported rule, in which case we match by rule num
-        // (consume rnode until rule num changes)
-        int id = n->node->id;
-        // handle imports
-        if (id > tack_len(&g->rules)) {
-            node_id *nid = tack_hget(&g->rules, n->node->name);
-            if (!nid) {
-                printf("FATAL: rule <%s> referenced in nfa but not defined\n", n->node->name);
-                return add;
-            }
-            id = nid->id;
-        }
-        const nfa *rule = tack_get(&g->nfa, id - 1);
-        if (rule->count == 0) {
-            // no edges = import - we just need to check for <rule>+ based on the rule number instead
-            printf("%d %d\n", ((result_node *)rnode->data)->rule, n->node->id);
-            while (rnode && ((result_node *)rnode->data)->rule == n->node->id) {
-                *end = llink(*end, (void *)rule);
-                (*end)->node = attributed_rule;
-                if (!*path)
-                    *path = *end;
-                add++;
-                rnode = rnode->next;
-            }
-            printf("sim rule <%s> matched %d words\n", n->node->name, add);
-            // reject if no words matched rule
-            if (!add) return add;
-        } else {
-            bool rule_complete = false;
-            add = nfa_walk(g, attributed_rule, rule, rnode, &rnode, path, end, level + 1, rule_level + 1, &rule_complete, rule_name);
-            if (!rule_complete) {
-                printf("subrule <%s> incomplete: rejecting\n", n->node->name);
-                return add;
-            } else if (rule_level == 0) {
-                *rule_name = n->node->name;
-            }
-            printf("rule <%s> recursion matched %d words\n", n->node->name, add);
-        }
-    } else { // reject if no accepts
-        printf("no accepts: rejecting\n");
-        *complete = false;
-        return add;
-    }
-    // no more words: terminate this path
-    if (!rnode) {
-        if (n->count == 0) *complete = true;
-        for (int i = 0; i < n->count; i++) {
-            if (n->edges[i] == NULL) {
-                *complete = true;
-                break;
-            }
-        }
-        printf("no more words: terminating %d\n", n->count);
-        return add;
-    }
-    ll *best_path, *best_end, *best_rnode;
-    int longest = 0;
-    bool best_complete = false, zerocomplete = false;
-    for (int i = 0; i < n->count; i++) {
-        if (n->edges[i] == NULL) {
-            zerocomplete = true;
-            continue;
-        }
-        ll *child_rnode = NULL, *child_path = NULL, *child_pathend = NULL;
-        bool child_complete = false;
-        const nfa *edge = n->edges[i];
-        printf("taking edge %d\n", i);
-        int len = nfa_walk(g, rule_node, n->edges[i], rnode, &child_rnode, &child_path, &child_pathend, level + 1, rule_level, &child_complete, rule_name);
-        printf("took edge %d: %d  complete=%d\n", i, len, child_complete);
-        if (len > longest && ((!best_complete && !zerocomplete) || child_complete)) {
-            best_path = child_path;
-            best_end = child_pathend;
-            best_rnode = child_rnode;
-            best_complete = child_complete;
-            longest = len;
-        } else {
-            lfree(child_path);
-        }
-    }
-    if (longest && (best_complete || !zerocomplete)) {
-        if (*end == NULL) {
-            *path = best_path;
-        } else {
-            (*end)->next = best_path;
-        }
-        *end = best_end;
-        *rupdate = best_rnode;
-        *complete = best_complete;
-    } else if (zerocomplete) {
-        *complete = true;
-    }
-    printf("complete: %d\n", *complete);
-    return longest + add;
-}
-
-#undef printf
-
-static int nfa_match(Grammar *g, ll *rnode, char **rule_name) {
-    // main rule should be last nfa entry, but let's be safe and look it up
-    node_id *id = tack_hget(&g->rules, g->main_rule);
-    const nfa *main = tack_get(&g->nfa, id->id - 1);
-
-    ll *path = NULL, *end = NULL, *rend = NULL;
-    bool complete = false;
-    int len = nfa_walk(g, main->node, main, rnode, &rend, &path, &end, 0, 0, &complete, rule_name);
-    ll *pos = path;
-    while (pos && rnode) {
-        nfa *n = pos->data;
-        result_node *rn = rnode->data;
-        const char *name = g->main_rule;
-        if (pos->node != NULL) {
-            name = pos->node->key ? pos->node->key : pos->node->name;
-        }
-        rn->rule_name = name;
-        pos = pos->next;
-        rnode = rnode->next;
-    }
-    lfree(path);
-    return len;
-}
-
 json_t *phrase_to_json(char *phrase) {
     uint32_t len = *(uint32_t *)phrase;
     char *end = phrase + len;
@@ -221,35 +32,32 @@ json_t *result_to_json(Grammar *g, dsx_result *result) {
     json_t *groups = json_object();
     int rc = _DSXResult_BestPathWord(result, 0, paths, 1, &needed);
     if (rc == 33) {
-        ll *rnodes = NULL, *rend = NULL;
+        result_node *rnodes = NULL;
         int rcount = 0;
         uint32_t *paths = calloc(1, needed);
         rc = _DSXResult_BestPathWord(result, 0, paths, needed, &needed);
         if (rc == 0) {
             dsx_word_node node;
+            rcount = needed / sizeof(uint32_t);
+            rnodes = calloc(rcount, sizeof(result_node));
             // get the rule number and cfg node information for each word
-            for (uint32_t i = 0; i < needed / sizeof(uint32_t); i++) {
-                result_node *rnode = calloc(1, sizeof(result_node));
+            for (int i = 0; i < rcount; i++) {
+                result_node *rnode = &rnodes[i];
                 rc = _DSXResult_GetWordNode(result, paths[i], &node, &rnode->id, &rnode->word);
                 rnode->rule = node.rule;
-                rend = llink(rend, rnode);
-                if (!rnodes) rnodes = rend;
-                rcount++;
+                rnode->sym = intern_find(rnode->word);
             }
         }
         free(paths);
 
         // apply recognized word node list to grammar's nfa
-        char *rule_name = NULL;
-        int len = nfa_match(g, rnodes, &rule_name);
-        // printf("nfa match: %s %d == %d?\n", rule_name, len, rcount);
+        const char *rule_name = NULL;
+        nfa_match(g, rnodes, rcount, &rule_name);
 
         json_object_set_new(obj, "rule", json_string(rule_name));
-        while (rnodes) {
-            ll *next = rnodes->next;
-            result_node *rn = rnodes->data;
-
-            if (rn->rule_name != rule_name) {
+        for (int i = 0; i < rcount; i++) {
+            result_node *rn = &rnodes[i];
+            if (rn->rule_name && rn->rule_name != rule_name) {
                 json_t *array = json_object_get(groups, rn->rule_name);
                 if (!array) {
                     array = json_array();
@@ -257,10 +65,8 @@ json_t *result_to_json(Grammar *g, dsx_result *result) {
                 }
                 json_array_append_new(array, json_string(rn->word));
             }
-            free(rnodes->data);
-            free(rnodes);
-            rnodes = next;
         }
+        free(rnodes);
     }
     if (json_object_size(groups) > 0) {
         json_object_set_new(obj, "groups", groups);
@@ -6,6 +6,7 @@
 typedef struct {
     uint32_t id;
     char *word; // freed by DSXResult_Destroy
+    uint32_t sym; // interned word, 0 if no grammar uses it
     uint32_t rule;
     const char *rule_name;
 } result_node;
@@ -0,0 +1,157 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+typedef struct batch {
+    pool_fn fn;
+    void *ctx;
+    int count, next, done;
+    // submitted batches aren't waited on, and are freed by the worker that finishes them
+    bool detached;
+    pthread_cond_t finished;
+    struct batch *link;
+} batch;
+
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    // batches with indices left to hand out, oldest first
+    batch *queue;
+    pthread_t *threads;
+    int thread_count;
+    bool stop;
+};
+
+static void queue_remove(pool *p, batch *b) {
+    for (batch **cur = &p->queue; *cur; cur = &(*cur)->link) {
+        if (*cur == b) {
+            *cur = b->link;
+            return;
+        }
+    }
+}
+
+// takes the next index of b, with the lock held
+static int batch_take(pool *p, batch *b) {
+    int index = b->next++;
+    if (b->next == b->count)
+        queue_remove(p, b);
+    return index;
+}
+
+// returns true once b's last index is done. detached batches are then the caller's to free
+static bool batch_finish(batch *b) {
+    if (++b->done < b->count)
+        return false;
+    if (!b->detached)
+        pthread_cond_signal(&b->finished);
+    return true;
+}
+
+static void *pool_worker(void *arg) {
+    pool *p = arg;
+    pthread_mutex_lock(&p->lock);
+    while (true) {
+        while (!p->stop && p->queue == NULL)
+            pthread_cond_wait(&p->wake, &p->lock);
+        if (p->stop)
+            break;
+        batch *b = p->queue;
+        int index = batch_take(p, b);
+        pthread_mutex_unlock(&p->lock);
+        b->fn(b->ctx, index);
+        pthread_mutex_lock(&p->lock);
+        if (batch_finish(b) && b->detached)
+            free(b);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+pool *pool_new(int threads) {
+    pool *p = calloc(1, sizeof(pool));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    p->threads = calloc(threads, sizeof(pthread_t));
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&p->threads[i], NULL, pool_worker, p) != 0) {
+            printf("warning: pool could only start %d of %d threads\n", i, threads);
+            break;
+        }
+        p->thread_count++;
+    }
+    return p;
+}
+
+static pool *shared;
+static pthread_once_t shared_once = PTHREAD_ONCE_INIT;
+
+static void shared_init(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    shared = pool_new(cores > 1 ? cores - 1 : 0);
+}
+
+pool *pool_shared(void) {
+    pthread_once(&shared_once, shared_init);
+    return shared;
+}
+
+void pool_run(pool *p, int count, pool_fn fn, void *ctx) {
+    if (p == NULL || p->thread_count == 0 || count < 2) {
+        for (int i = 0; i < count; i++) fn(ctx, i);
+        return;
+    }
+    batch b = {.fn = fn, .ctx = ctx, .count = count};
+    pthread_cond_init(&b.finished, NULL);
+    pthread_mutex_lock(&p->lock);
+    batch **tail = &p->queue;
+    while (*tail) tail = &(*tail)->link;
+    *tail = &b;
+    pthread_cond_broadcast(&p->wake);
+    while (b.next < b.count) {
+        int index = batch_take(p, &b);
+        pthread_mutex_unlock(&p->lock);
+        fn(ctx, index);
+        pthread_mutex_lock(&p->lock);
+        batch_finish(&b);
+    }
+    while (b.done < b.count)
+        pthread_cond_wait(&b.finished, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+    pthread_cond_destroy(&b.finished);
+}
+
+void pool_submit(pool *p, pool_fn fn, void *ctx) {
+    if (p == NULL || p->thread_count == 0) {
+        fn(ctx, 0);
+        return;
+    }
+    batch *b = malloc(sizeof(batch));
+    *b = (batch){.fn = fn, .ctx = ctx, .count = 1, .detached = true};
+    pthread_mutex_lock(&p->lock);
+    batch **tail = &p->queue;
+    while (*tail) tail = &(*tail)->link;
+    *tail = b;
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pool_free(pool *p) {
+    if (p == NULL)
+        return;
+    pthread_mutex_lock(&p->lock);
+    p->stop = true;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->thread_count; i++) {
+        pthread_join(p->threads[i], NULL);
+    }
+    pthread_cond_destroy(&p->wake);
+    pthread_mutex_destroy(&p->lock);
+    free(p->threads);
+    free(p);
+}
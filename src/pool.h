@@ -0,0 +1,20 @@
+#ifndef POOL_H
+#define POOL_H
+
+// fixed set of worker threads for parallel loops. pool_run can be called from
+// several threads at once (including from inside a job), and the caller always
+// helps with its own loop, so nested runs can't deadlock.
+
+typedef struct pool pool;
+typedef void (*pool_fn)(void *ctx, int index);
+
+pool *pool_new(int threads);
+// process-wide pool with a worker per extra core, created on first use
+pool *pool_shared(void);
+// calls fn(ctx, i) for i in [0, count) across the pool, and returns when all are done
+void pool_run(pool *p, int count, pool_fn fn, void *ctx);
+// calls fn(ctx, 0) on a worker and returns without waiting, or calls it right away if p has no threads
+void pool_submit(pool *p, pool_fn fn, void *ctx);
+void pool_free(pool *p);
+
+#endif
@@ -5,13 +5,19 @@
 #include <stdio.h>
 
 #include "phrase.h"
+#include "pool.h"
 #include "server.h"
 #include "maclink.h"
 #include "tack.h"
+#include "intern.h"
+#include "watch.h"
 #include "grammar/compile.h"
 
 // #define NODRAGON
 
+// threads compiling g.loads. each load's rules are compiled on the shared pool
+#define LOAD_THREADS 2
+
 #ifndef streq
 #define streq(a, b) !strcmp(a, b)
 #endif
@@ -47,92 +53,488 @@ static void zjson_senderr(zsock_t *sock, const char *msg) {
     zjson_send_decref(sock, obj);
 }
 
+// a command on a grammar that's still loading. the client gets a ticket in place of the
+// reply, and the reply is published as a "g.deferred" event with it once the command runs
+typedef struct deferred {
+    uint32_t ticket;
+    char *msg;
+    struct deferred *link;
+} deferred;
+
+// the deferred command being run, if any
+static deferred *running;
+
+static void reply(json_t *obj) {
+    if (!running) {
+        zjson_send_decref(state.cmdsock, obj);
+        return;
+    }
+    json_t *event = json_pack("{s:i, s:o}", "ticket", running->ticket, "reply", obj);
+    char *str = json_dumps(event, 0);
+    maclink_publish("g.deferred", str);
+    free(str);
+    json_decref(event);
+}
+
+static void reply_err(const char *msg) {
+    json_t *obj = start_resp(false);
+    json_object_set_new(obj, "error", json_string(msg));
+    reply(obj);
+}
+
+// returns an error message, or NULL on success
+static const char *grammar_enable(Grammar *grammar) {
+    if (_DSXGrammar_Activate(grammar->handle, 0, false, grammar->main_rule)) {
+        return "error activating grammar";
+    }
+    if (_DSXGrammar_RegisterEndPhraseCallback(grammar->handle, phrase_end, grammar, &grammar->endkey)) {
+        return "error registering end phrase callback";
+    }
+    if (_DSXGrammar_RegisterPhraseHypothesisCallback(grammar->handle, phrase_hypothesis, grammar, &grammar->hypokey)) {
+        return "error registering phrase hypothesis callback";
+    }
+    if (_DSXGrammar_RegisterBeginPhraseCallback(grammar->handle, phrase_begin, grammar, &grammar->beginkey)) {
+        return "error registering begin phrase callback";
+    }
+    grammar->active = true;
+    return NULL;
+}
+
+static const char *grammar_disable(Grammar *grammar) {
+    if (_DSXGrammar_Deactivate(grammar->handle, 0, grammar->main_rule)) {
+        return "error deactivating grammar";
+    }
+    grammar->active = false;
+    if (_DSXGrammar_Unregister(grammar->handle, grammar->endkey)) {
+        return "error unregistering handler";
+    }
+    if (_DSXGrammar_Unregister(grammar->handle, grammar->hypokey)) {
+        return "error unregistering handler";
+    }
+    if (_DSXGrammar_Unregister(grammar->handle, grammar->beginkey)) {
+        return "error unregistering handler";
+    }
+    return NULL;
+}
+
+// with state.lock held. moves dragon's lists, priority and activation to updated, and puts it
+// in grammar's place. if dragon won't take updated, it's freed and grammar is left as it was
+static int grammar_replace(Grammar *grammar, Grammar *updated, bool set_priority, int priority, char **error) {
+#ifndef NODRAGON
+    dsx_dataptr sd = {.data = updated->raw->data, .size = updated->raw->size};
+    int ret = _DSXEngine_LoadGrammar(_engine, 1 /*cfg*/, &sd, &updated->handle);
+    if (ret > 0) {
+        asprintf(error, "error loading grammar: %d", ret);
+        grammar_free(updated);
+        return -1;
+    }
+    // dragon's copy of the lists, activation and priority move to the new handle
+    node_id *list;
+    tack_foreach(&grammar->core->lists, list) {
+        dsx_dataptr dp = {0};
+        if (_DSXGrammar_GetList(grammar->handle, list->name, &dp) == 0 && dp.size > 0) {
+            _DSXGrammar_SetList(updated->handle, list->name, &dp);
+        }
+    }
+    updated->priority = set_priority ? priority : grammar->priority;
+    if (updated->priority) {
+        _DSXGrammar_SetPriority(updated->handle, updated->priority);
+    }
+    if (grammar->active) {
+        grammar_disable(grammar);
+        const char *enable_error = grammar_enable(updated);
+        if (enable_error) {
+            // the old grammar is still loaded, so fall back to it
+            printf("warning: %s after update of %s\n", enable_error, grammar->name);
+            _DSXGrammar_Destroy(updated->handle);
+            grammar_free(updated);
+            grammar_enable(grammar);
+            *error = strdup(enable_error);
+            return -1;
+        }
+    }
+    _DSXGrammar_Destroy(grammar->handle);
+#endif
+    for (int i = 0; i < tack_len(&state.grammars); i++) {
+        if (tack_get(&state.grammars, i) == grammar) tack_set(&state.grammars, i, updated);
+    }
+    tack_hset(&state.grammars, updated->name, updated);
+    grammar_free(grammar);
+    return 0;
+}
+
+// with state.lock held
+static void grammar_unload(Grammar *grammar) {
+    int rc = _DSXGrammar_Destroy(grammar->handle);
+    printf("grammar destroy: %d\n", rc);
+    tack_hdel(&state.grammars, grammar->name);
+    tack_remove(&state.grammars, grammar);
+    grammar_free(grammar);
+}
+
+// g.load and g.update reply with a ticket and compile on the loader pool. finished grammars
+// are loaded into dragon in ticket order, under state.lock like any command, and a "g.load"
+// event with the ticket is published for each
+typedef struct load_job {
+    uint32_t ticket;
+    json_t *j;
+    const char *name;
+    // the grammar a g.update or grammar directory reload replaces. commands on it are
+    // deferred until the job is applied, so it stays loaded until then
+    Grammar *old;
+    int priority;
+    bool set_priority;
+    Grammar *grammar;
+    char *err;
+    // handed to the loader pool, which happens once state.lock is released
+    bool started;
+    bool done;
+    // commands to run once the job is applied, oldest first
+    deferred *deferred;
+    // g.load.batch compiles its loads across the shared pool
+    bool batch;
+    struct load_job *link;
+} load_job;
+
+// with state.lock held. j is the grammar as g.load takes it
+static load_job *load_queue(json_t *j, const char *name) {
+    load_job *job = calloc(1, sizeof(load_job));
+    job->ticket = state.ticket++;
+    job->j = json_incref(j);
+    job->name = name;
+    job->set_priority = !json_unpack(j, "{s:i}", "priority", &job->priority);
+    load_job **tail = &state.loads;
+    while (*tail) tail = &(*tail)->link;
+    *tail = job;
+    return job;
+}
+
+static bool load_pending(const char *name) {
+    for (load_job *job = state.loads; job; job = job->link) {
+        if (streq(job->name, name)) return true;
+    }
+    return false;
+}
+
+// with state.lock held. the last pending job for name, which commands on it wait for. a
+// deferred command being run is already behind the loads sent before it, so it only waits
+// for updates queued since, as they hold on to the grammar
+static load_job *load_last(const char *name) {
+    load_job *last = NULL;
+    for (load_job *job = state.loads; job; job = job->link) {
+        if (streq(job->name, name) && (!running || job->old)) last = job;
+    }
+    return last;
+}
+
+// with state.lock held. a command being run from the queue keeps its ticket
+static void load_defer(load_job *job, const char *msg) {
+    deferred *cmd = running;
+    if (cmd) {
+        running = NULL;
+    } else {
+        cmd = calloc(1, sizeof(deferred));
+        cmd->ticket = state.ticket++;
+        cmd->msg = strdup(msg);
+        json_t *resp = start_resp(true);
+        json_object_set_new(resp, "ticket", json_integer(cmd->ticket));
+        json_object_set_new(resp, "deferred", json_true());
+        reply(resp);
+    }
+    cmd->link = NULL;
+    deferred **tail = &job->deferred;
+    while (*tail) tail = &(*tail)->link;
+    *tail = cmd;
+}
+
+static void load_publish(load_job *job, const char *error) {
+    json_t *event = json_pack("{s:i, s:s, s:b}", "ticket", job->ticket, "name", job->name, "success", !error);
+    if (error) {
+        json_object_set_new(event, "error", json_string(error));
+    }
+    char *str = json_dumps(event, 0);
+    maclink_publish("g.load", str);
+    free(str);
+    json_decref(event);
+}
+
+// with state.lock held
+static void load_apply(load_job *job) {
+    Grammar *grammar = job->grammar;
+    if (!grammar) {
+        load_publish(job, job->err);
+        return;
+    }
+    if (job->old) {
+        char *err;
+        if (grammar_replace(job->old, grammar, job->set_priority, job->priority, &err)) {
+            load_publish(job, err);
+            free(err);
+            return;
+        }
+        load_publish(job, NULL);
+        return;
+    }
+    // queued behind a pending load of the same name, which may have loaded
+    if (tack_hexists(&state.grammars, job->name)) {
+        load_publish(job, "grammar by this name already exists");
+        grammar_free(grammar);
+        return;
+    }
+#ifndef NODRAGON
+    dsx_dataptr sd = {.data = grammar->raw->data, .size = grammar->raw->size};
+    int ret = _DSXEngine_LoadGrammar(_engine, 1 /*cfg*/, &sd, &grammar->handle);
+    if (ret > 0) {
+        char *err;
+        asprintf(&err, "error loading grammar: %d", ret);
+        load_publish(job, err);
+        free(err);
+        grammar_free(grammar);
+        return;
+    }
+    if (job->set_priority) {
+        grammar->priority = job->priority;
+        _DSXGrammar_SetPriority(grammar->handle, job->priority);
+    }
+    tack_push(&state.grammars, grammar);
+    tack_hset(&state.grammars, grammar->name, grammar);
+    // printf("%d\n", _DSXGrammar_SetApplicationName(grammar->handle, grammar->name));
+#else
+    grammar_free(grammar);
+#endif
+    load_publish(job, NULL);
+}
+
+static void handle(const char *msg);
+
+// with state.lock held. applies the finished loads at the head of the queue, in order, once
+// dragon's engine exists, and runs the commands deferred on each. grammar directory loads
+// can finish before it does
+static void load_flush(void) {
+#ifndef NODRAGON
+    if (!_engine)
+        return;
+#endif
+    while (state.loads && state.loads->done) {
+        load_job *head = state.loads;
+        state.loads = head->link;
+        load_apply(head);
+        while (head->deferred) {
+            running = head->deferred;
+            head->deferred = running->link;
+            handle(running->msg);
+            // unless it was deferred again, behind a later load
+            if (running) {
+                free(running->msg);
+                free(running);
+                running = NULL;
+            }
+        }
+        json_decref(head->j);
+        free(head->err);
+        free(head);
+    }
+    pthread_cond_broadcast(&state.loaded);
+}
+
+// with state.lock held. whichever load finishes last applies the finished ones ahead of it
+static void load_done(load_job *job) {
+    job->started = true;
+    job->done = true;
+    load_flush();
+}
+
+static void load_compile(void *ctx, int index);
+
+// hands queued loads to the loader pool. called without state.lock, as a pool without
+// threads compiles them in the caller
+static void load_start(void) {
+    tack_t jobs = {0};
+    pthread_mutex_lock(&state.lock);
+    for (load_job *job = state.loads; job; job = job->link) {
+        if (!job->started) {
+            job->started = true;
+            tack_push(&jobs, job);
+        }
+    }
+    pthread_mutex_unlock(&state.lock);
+    load_job *job;
+    tack_foreach(&jobs, job) {
+        pool_submit(job->batch ? pool_shared() : state.loader, load_compile, job);
+    }
+    tack_clear(&jobs);
+}
+
+static void load_compile(void *ctx, int index) {
+    load_job *job = ctx;
+    int ret = job->old ? grammar_update(&job->grammar, job->old, job->j, &job->err)
+                       : grammar_compile(&job->grammar, job->j, &job->err);
+    if (ret)
+        job->grammar = NULL;
+    pthread_mutex_lock(&state.lock);
+    load_done(job);
+    pthread_mutex_unlock(&state.lock);
+    // commands deferred on it may have queued updates
+    load_start();
+}
+
+// returns NULL if text isn't padded base64
+static uint8_t *base64_decode(const char *text, size_t *size) {
+    static int8_t values[256];
+    if (!values['B']) {
+        const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        memset(values, -1, sizeof(values));
+        for (int i = 0; i < 64; i++) values[(uint8_t)alphabet[i]] = i;
+    }
+    size_t len = strlen(text);
+    if (len % 4)
+        return NULL;
+    uint8_t *data = malloc(len / 4 * 3 + 1), *out = data;
+    for (size_t i = 0; i < len; i += 4) {
+        const uint8_t *in = (const uint8_t *)text + i;
+        // padding only ends the last group
+        int pad = i + 4 == len ? (in[3] == '=') + (in[2] == '=' && in[3] == '=') : 0;
+        int32_t a = values[in[0]], b = values[in[1]];
+        int32_t c = pad > 1 ? 0 : values[in[2]], d = pad > 0 ? 0 : values[in[3]];
+        if ((a | b | c | d) < 0) {
+            free(data);
+            return NULL;
+        }
+        uint32_t group = a << 18 | b << 12 | c << 6 | d;
+        *out++ = group >> 16;
+        if (pad < 2) *out++ = group >> 8;
+        if (pad < 1) *out++ = group;
+    }
+    *size = out - data;
+    return data;
+}
+
+static json_t *batch_error(const char *name, const char *error) {
+    json_t *result = json_pack("{s:b, s:s}", "success", false, "error", error);
+    if (name) {
+        json_object_set_new(result, "name", json_string(name));
+    }
+    return result;
+}
+
+// g.load.batch queues its grammars like g.loads, and replies right away with a ticket or an
+// error for each, in order. a "g.load" event is published for each ticket
+static void load_batch(json_t *grammars) {
+    bool success = true;
+    json_t *results = json_array();
+    tack_t names = {0};
+    size_t index;
+    json_t *def;
+    json_array_foreach(grammars, index, def) {
+        const char *name;
+        if (json_unpack(def, "{s:s}", "name", &name)) {
+            json_array_append_new(results, batch_error(NULL, "grammar name missing"));
+            success = false;
+            continue;
+        }
+        bool repeated = false;
+        const char *queued;
+        tack_foreach(&names, queued) {
+            repeated |= streq(queued, name);
+        }
+        if (repeated) {
+            json_array_append_new(results, batch_error(name, "grammar name repeated in batch"));
+            success = false;
+            continue;
+        }
+        if (tack_hexists(&state.grammars, name)) {
+            json_array_append_new(results, batch_error(name, "grammar by this name already exists"));
+            success = false;
+            continue;
+        }
+        load_job *job = load_queue(def, name);
+        job->batch = true;
+        tack_push(&names, (void *)name);
+        json_array_append_new(results, json_pack("{s:b, s:s, s:i}", "success", true, "name", name, "ticket", job->ticket));
+    }
+    tack_clear(&names);
+    json_t *resp = start_resp(success);
+    json_object_set_new(resp, "results", results);
+    reply(resp);
+}
+
+// with state.lock held. loads it queues are started by load_start once the lock is released
 static void handle(const char *msg) {
     json_error_t err;
+    load_job *load = NULL;
     json_t *j = json_loads(msg, 0, &err);
-    if (j == NULL) return zjson_senderr(state.cmdsock, err.text);
+    if (j == NULL) {
+        reply_err(err.text);
+        return;
+    }
+    char *cmd;
+    if (json_unpack_ex(j, &err, 0, "{s:s}", "cmd", &cmd)) {
+        reply_err(err.text);
+        goto end;
+    }
 
-    // look up the grammar object if json "name" is set
+    // look up the grammar object if json "name" is set. commands on a grammar that's still
+    // loading are deferred until it's loaded, so they apply in the order they were sent
+    // without holding up commands on other grammars. loads just queue behind it
     char *name;
     int name_err = json_unpack_ex(j, &err, 0, "{s:s}", "name", &name);
     Grammar *grammar = NULL;
     if (name_err == 0) {
+        load_job *pending = load_last(name);
+        if (pending && !streq(cmd, "g.load") && !streq(cmd, "g.load.raw")) {
+            load_defer(pending, msg);
+            goto end;
+        }
         grammar = tack_hget(&state.grammars, name);
     }
     int priority = 0;
     int set_priority = !json_unpack(j, "{s:i}", "priority", &priority);
 
-    char *cmd;
-    if (json_unpack_ex(j, &err, 0, "{s:s}", "cmd", &cmd)) {
-        zjson_senderr(state.cmdsock, err.text);
-        goto end;
-    }
     if (streq(cmd, "g.enable")) {
         if (!grammar) goto no_grammar;
         if (grammar->active) {
-            zjson_senderr(state.cmdsock, "grammar already enabled");
+            reply_err("grammar already enabled");
             goto end;
         }
-        if (_DSXGrammar_Activate(grammar->handle, 0, false, grammar->main_rule)) {
-            zjson_senderr(state.cmdsock, "error activating grammar");
+        const char *error = grammar_enable(grammar);
+        if (error) {
+            reply_err(error);
             goto end;
         }
-        if (_DSXGrammar_RegisterEndPhraseCallback(grammar->handle, phrase_end, grammar, &grammar->endkey)) {
-            zjson_senderr(state.cmdsock, "error registering end phrase callback");
-            goto end;
-        }
-        if (_DSXGrammar_RegisterPhraseHypothesisCallback(grammar->handle, phrase_hypothesis, grammar, &grammar->hypokey)) {
-            zjson_senderr(state.cmdsock, "error registering phrase hypothesis callback");
-            goto end;
-        }
-        if (_DSXGrammar_RegisterBeginPhraseCallback(grammar->handle, phrase_begin, grammar, &grammar->beginkey)) {
-            zjson_senderr(state.cmdsock, "error registering begin phrase callback");
-            goto end;
-        }
-        grammar->active = true;
         if (set_priority) {
             grammar->priority = priority;
             _DSXGrammar_SetPriority(grammar->handle, priority);
         }
-        zjson_send_decref(state.cmdsock, start_resp(true));
+        reply(start_resp(true));
     } else if (streq(cmd, "g.disable")) {
         if (!grammar) goto no_grammar;
-        if (_DSXGrammar_Deactivate(grammar->handle, 0, grammar->main_rule)) {
-            zjson_senderr(state.cmdsock, "error deactivating grammar");
-            goto end;
-        }
-        grammar->active = false;
-        if (_DSXGrammar_Unregister(grammar->handle, grammar->endkey)) {
-            zjson_senderr(state.cmdsock, "error unregistering handler");
-            goto end;
-        }
-        if (_DSXGrammar_Unregister(grammar->handle, grammar->hypokey)) {
-            zjson_senderr(state.cmdsock, "error unregistering handler");
+        const char *error = grammar_disable(grammar);
+        if (error) {
+            reply_err(error);
             goto end;
         }
-        if (_DSXGrammar_Unregister(grammar->handle, grammar->beginkey)) {
-            zjson_senderr(state.cmdsock, "error unregistering handler");
-            goto end;
-        }
-        zjson_send_decref(state.cmdsock, start_resp(true));
+        reply(start_resp(true));
     } else if (streq(cmd, "g.list.set")) {
         if (!grammar) goto no_grammar;
         const char *list;
         json_t *items;
         if (json_unpack_ex(j, &err, 0, "{s:s, s:o}", "list", &list, "items", &items)) {
-            zjson_senderr(state.cmdsock, err.text);
+            reply_err(err.text);
             goto end;
         }
         if (json_typeof(items) != JSON_ARRAY) {
-            zjson_senderr(state.cmdsock, "items must be an array");
+            reply_err("items must be an array");
             goto end;
         }
-        node_id *listid = tack_hget(&grammar->lists, list);
-        if (!tack_hexists(&grammar->lists, list)) {
-            zjson_senderr(state.cmdsock, "list does not exist in grammar");
+        node_id *listid = tack_hget(&grammar->core->lists, list);
+        if (!tack_hexists(&grammar->core->lists, list)) {
+            reply_err("list does not exist in grammar");
             goto end;
         }
-        tack_t *listdata = tack_get(&grammar->listdata, listid->id - 1);
+        intern_set *listdata = tack_get(&grammar->listdata, listid->id - 1);
+        // dragon replaces the list, so the matcher's copy is replaced too. items hold counted
+        // references, so words that drop out of every list don't stay interned
+        intern_set items_set = {0};
 
         // get size of the new list's data block
         dsx_dataptr dp = {.data = NULL, .size = 0};
@@ -151,30 +553,35 @@ static void handle(const char *msg) {
             strcpy(ent->name, word);
             pos += ent->size;
 
-            char *dataword = strdup(word);
-            tack_push(listdata, dataword);
-            tack_hset(listdata, dataword, NULL);
+            uint32_t id = intern_ref(word);
+            if (!intern_set_add(&items_set, id))
+                intern_release(id);
         }
+        // new references are taken first, so words kept in the list keep their ids
+        intern_set_release(listdata);
+        *listdata = items_set;
+        // the matcher's cached dfas depend on list contents
+        grammar->list_version++;
         if (_DSXGrammar_SetList(grammar->handle, list, &dp)) {
-            zjson_senderr(state.cmdsock, "error setting list");
+            reply_err("error setting list");
         } else {
-            zjson_send_decref(state.cmdsock, start_resp(true));
+            reply(start_resp(true));
         }
         free(dp.data);
     } else if (streq(cmd, "g.list.get")) {
         if (!grammar) goto no_grammar;
         const char *list;
         if (json_unpack_ex(j, &err, 0, "{s:s}", "list", &list)) {
-            zjson_senderr(state.cmdsock, err.text);
+            reply_err(err.text);
             goto end;
         }
-        if (!tack_hexists(&grammar->lists, list)) {
-            zjson_senderr(state.cmdsock, "list does not exist");
+        if (!tack_hexists(&grammar->core->lists, list)) {
+            reply_err("list does not exist");
             goto end;
         }
         dsx_dataptr dp = {0};
         if (_DSXGrammar_GetList(grammar->handle, list, &dp)) {
-            zjson_senderr(state.cmdsock, "error getting list");
+            reply_err("error getting list");
         } else {
             json_t *array = json_array();
             uintptr_t pos = (uintptr_t)dp.data;
@@ -185,16 +592,12 @@ static void handle(const char *msg) {
             }
             json_t *resp = start_resp(true);
             json_object_set_new(resp, "items", array);
-            zjson_send_decref(state.cmdsock, resp);
+            reply(resp);
         }
     } else if (streq(cmd, "g.unload")) {
         if (!grammar) goto no_grammar;
-        int rc = _DSXGrammar_Destroy(grammar->handle);
-        printf("grammar destroy: %d\n", rc);
-        tack_hdel(&state.grammars, name);
-        tack_remove(&state.grammars, grammar);
-        grammar_free(grammar);
-        zjson_send_decref(state.cmdsock, start_resp(true));
+        grammar_unload(grammar);
+        reply(start_resp(true));
     } else if (streq(cmd, "g.show")) {
         json_t *resp = start_resp(true);
         json_t *grammars = json_array();
@@ -205,11 +608,21 @@ static void handle(const char *msg) {
                 "active", grammar->active);
             json_array_append_new(grammars, obj);
         }
+        // updates are of grammars listed already
+        for (load_job *job = state.loads; job; job = job->link) {
+            if (job->old)
+                continue;
+            json_array_append_new(grammars, json_pack(
+                "{s:s, s:b, s:b}",
+                "name", job->name,
+                "active", false,
+                "loading", true));
+        }
         json_object_set_new(resp, "grammars", grammars);
-        zjson_send_decref(state.cmdsock, resp);
+        reply(resp);
     } else if (streq(cmd, "g.load")) {
         if (grammar) {
-            zjson_senderr(state.cmdsock, "grammar by this name already exists");
+            reply_err("grammar by this name already exists");
             goto end;
         }
 #ifndef NODRAGON
@@ -217,46 +630,106 @@ static void handle(const char *msg) {
 #else
         if (true) {
 #endif
-            char *err;
-            if (grammar_compile(&grammar, j, &err)) {
-                zjson_senderr(state.cmdsock, err);
-                free(err);
+            if (name_err) {
+                reply_err("grammar name missing");
                 goto end;
             }
-#ifdef NODRAGON
-            zjson_send_decref(state.cmdsock, start_resp(true));
+            load = load_queue(j, name);
+            json_t *resp = start_resp(true);
+            json_object_set_new(resp, "ticket", json_integer(load->ticket));
+            reply(resp);
+        } else {
+            reply_err("engine not loaded");
+        }
+    } else if (streq(cmd, "g.load.raw")) {
+        // a packed grammar in base64, as g.load makes it, and optionally its rule names by id
+        if (grammar) {
+            reply_err("grammar by this name already exists");
             goto end;
+        }
+#ifndef NODRAGON
+        if (!_engine) {
+            reply_err("engine not loaded");
+            goto end;
+        }
 #endif
-            dsx_dataptr sd = {.data = grammar->raw->data, .size = grammar->raw->size};
-            int ret = _DSXEngine_LoadGrammar(_engine, 1 /*cfg*/, &sd, &grammar->handle);
-            if (ret > 0) {
-                char *err;
-                asprintf(&err, "error loading grammar: %d", ret);
-                zjson_senderr(state.cmdsock, err);
-                free(err);
-                grammar_free(grammar);
-                goto end;
-            }
-            if (set_priority) {
-                grammar->priority = priority;
-                _DSXGrammar_SetPriority(grammar->handle, priority);
-            }
-            tack_push(&state.grammars, grammar);
-            tack_hset(&state.grammars, grammar->name, grammar);
-            // printf("%d\n", _DSXGrammar_SetApplicationName(grammar->handle, grammar->name));
-            zjson_send_decref(state.cmdsock, start_resp(true));
-        } else {
-            zjson_senderr(state.cmdsock, "engine not loaded");
+        const char *data;
+        json_t *rules = NULL;
+        if (name_err) {
+            reply_err("grammar name missing");
+            goto end;
+        }
+        if (json_unpack_ex(j, &err, 0, "{s:s}", "data", &data)) {
+            reply_err(err.text);
+            goto end;
+        }
+        json_unpack(j, "{s:o}", "rules", &rules);
+        if (rules && json_typeof(rules) != JSON_ARRAY) {
+            reply_err("rules must be an array");
+            goto end;
+        }
+        size_t size;
+        uint8_t *blob = base64_decode(data, &size);
+        if (!blob) {
+            reply_err("data must be base64");
+            goto end;
+        }
+        Grammar *loaded;
+        char *error;
+        int ret = grammar_load_raw(&loaded, name, blob, size, rules, &error);
+        free(blob);
+        if (ret) {
+            reply_err(error);
+            free(error);
+            goto end;
         }
+        // nothing to compile, so it's loaded now unless g.loads before it are pending
+        load_job *job = load_queue(j, name);
+        uint32_t ticket = job->ticket;
+        job->grammar = loaded;
+        load_done(job);
+        json_t *resp = start_resp(true);
+        json_object_set_new(resp, "ticket", json_integer(ticket));
+        reply(resp);
+    } else if (streq(cmd, "g.load.batch")) {
+#ifndef NODRAGON
+        if (!_engine) {
+            reply_err("engine not loaded");
+            goto end;
+        }
+#endif
+        json_t *grammars;
+        if (json_unpack_ex(j, &err, 0, "{s:o}", "grammars", &grammars)) {
+            reply_err(err.text);
+            goto end;
+        }
+        if (json_typeof(grammars) != JSON_ARRAY) {
+            reply_err("grammars must be an array");
+            goto end;
+        }
+        load_batch(grammars);
+    } else if (streq(cmd, "g.update")) {
+        if (!grammar) goto no_grammar;
+#ifndef NODRAGON
+        if (!_engine) {
+            reply_err("engine not loaded");
+            goto end;
+        }
+#endif
+        load = load_queue(j, name);
+        load->old = grammar;
+        json_t *resp = start_resp(true);
+        json_object_set_new(resp, "ticket", json_integer(load->ticket));
+        reply(resp);
     } else {
-        zjson_senderr(state.cmdsock, "unsupported command");
+        reply_err("unsupported command");
     }
 end:
     json_decref(j);
     return;
 
 no_grammar:
-    zjson_senderr(state.cmdsock, "grammar not found");
+    reply_err("grammar not found");
     goto end;
 }
 
@@ -266,14 +739,51 @@ static void *maclink_thread(void *user) {
         char *msg = zstr_recv(state.cmdsock);
         if (msg != NULL) {
             printf("<- %s\n", msg);
+            pthread_mutex_lock(&state.lock);
             handle(msg);
+            pthread_mutex_unlock(&state.lock);
+            load_start();
             maclink_publish("cmd", msg);
             zstr_free(&msg);
         }
     }
 }
 
+void maclink_engine_ready() {
+    pthread_mutex_lock(&state.lock);
+    load_flush();
+    pthread_mutex_unlock(&state.lock);
+    load_start();
+}
+
+void maclink_reload(json_t *j) {
+    const char *name = json_string_value(json_object_get(j, "name"));
+    pthread_mutex_lock(&state.lock);
+    while (load_pending(name))
+        pthread_cond_wait(&state.loaded, &state.lock);
+    load_job *job = load_queue(j, name);
+    job->old = tack_hget(&state.grammars, name);
+    pthread_mutex_unlock(&state.lock);
+    load_start();
+}
+
+void maclink_unload(const char *name) {
+    pthread_mutex_lock(&state.lock);
+    while (load_pending(name))
+        pthread_cond_wait(&state.loaded, &state.lock);
+    Grammar *grammar = tack_hget(&state.grammars, name);
+    if (grammar)
+        grammar_unload(grammar);
+    pthread_mutex_unlock(&state.lock);
+}
+
 void maclink_init() {
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.loaded, NULL);
+    state.loader = pool_new(LOAD_THREADS);
+    const char *dir = getenv("MACLINK_GRAMMARS");
+    if (dir && *dir)
+        watch_start(dir);
     state.pubsock = zsock_new_pub("ipc:///tmp/ml_pub");
     state.cmdsock = zsock_new_rep("ipc:///tmp/ml_cmd");
     if (state.pubsock == NULL || state.cmdsock == NULL) {
@@ -1,2 +1,9 @@
+#include <jansson.h>
+
 void maclink_init();
 void maclink_publish(const char *topic, const char *msg);
+// applies grammar loads that finished before dragon's engine was created
+void maclink_engine_ready();
+// loads j (as g.load takes it) through the g.load queue, replacing the loaded grammar by its name if there is one
+void maclink_reload(json_t *j);
+void maclink_unload(const char *name);
@@ -12,15 +12,16 @@
 #endif
 
 #define TACK_DEFAULT_SIZE 8
-// must be a power of two
-#define TACK_HASH_SIZE 2048
+
+struct tack_hash;
+static void tack_hfree(struct tack_hash *h);
 
 static bool tack_pop_bad(tack_t *tack)   { return (tack == NULL || tack->len <= 0); }
 static bool tack_shift_bad(tack_t *tack) { return (tack == NULL || tack->pos >= tack->len); }
 
 static bool tack_grow(tack_t *tack, int idx) {
     if (tack->data == NULL) {
-        tack->cap = TACK_DEFAULT_SIZE;
+        tack->cap = MAX(TACK_DEFAULT_SIZE, idx + 1);
         tack->data = malloc(sizeof(void *) * tack->cap);
         if (tack->data != NULL) {
             return true;
@@ -32,7 +33,7 @@ static bool tack_grow(tack_t *tack, int idx) {
                 return false;
             }
         } else {
-            tack->cap = MAX(tack->cap * 2, tack->len + idx);
+            tack->cap = MAX(tack->cap * 2, MAX(tack->len, idx) + 1);
         }
         void **new = realloc(tack->data, sizeof(void *) * tack->cap);
         if (new != NULL) {
@@ -71,10 +72,7 @@ void tack_clear(tack_t *tack) {
     free(tack->data);
     tack->data = NULL;
     if (tack->hash) {
-        for (int i = 0; i < TACK_HASH_SIZE; i++) {
-            tack_clear(&tack->hash[i]);
-        }
-        free(tack->hash);
+        tack_hfree(tack->hash);
     }
     tack->hash = NULL;
     tack->pos = 0;
@@ -170,85 +168,170 @@ void tack_set_int(tack_t *tack, int idx, uintptr_t val) { tack_set(tack, idx, (v
 
 /* hash table implementation */
 
-uint32_t djb_hash(const char *key) {
-    uint32_t h = 0;
-    while (*key) h = 33 * h ^ ((uint8_t)*key++);
-    return h & (TACK_HASH_SIZE-1);
-}
+// robin hood open addressing: each entry caches its full hash (0 = empty slot),
+// and entries are kept sorted by probe distance so lookups can stop early.
+// short keys are stored inline in the entry.
+
+#define TACK_HASH_MIN 8
+#define TACK_KEY_INLINE 16
 
-// TODO: make this a linked list rather than a tack_t
 typedef struct {
-    const char *key;
+    uint32_t hash;
+    uint32_t len;
     void *data;
+    union {
+        char inline_key[TACK_KEY_INLINE];
+        char *ptr;
+    } key;
 } tack_hash_entry;
 
-void *tack_hset(tack_t *tack, const char *key, void *val) {
-    if (tack->hash == NULL)
-        tack->hash = calloc(1, sizeof(tack_t) * TACK_HASH_SIZE);
-
-    tack_t *slot = &tack->hash[djb_hash(key)];
-    tack_hash_entry *entry;
-    // collision - make sure we're not already in this slot
-    tack_foreach(slot, entry) {
-        // colliding slot found
-        if (strcmp(entry->key, key) == 0) {
-            // return the old data so it can be caller-freed
-            void *tmp = entry->data;
-            entry->data = val;
-            return tmp;
-        }
+struct tack_hash {
+    tack_hash_entry *entries;
+    uint32_t cap, len;
+};
+
+static uint32_t tack_strhash(const char *key, size_t len) {
+    const uint8_t *p = (const uint8_t *)key;
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ len;
+    size_t left = len;
+    while (left >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        h = (h ^ v) * 0xbf58476d1ce4e5b9ull;
+        h ^= h >> 31;
+        p += 8;
+        left -= 8;
     }
-    // no collision - need to push a new entry
-    entry = malloc(sizeof(tack_hash_entry));
-    entry->key = strdup(key);
-    entry->data = val;
-    tack_push(slot, entry);
-    return NULL;
+    uint64_t v = 0;
+    memcpy(&v, p, left);
+    h = (h ^ v) * 0x94d049bb133111ebull;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 32;
+    // 0 marks an empty slot
+    return (uint32_t)h | 1;
 }
 
-void *tack_hget(tack_t *tack, const char *key) {
-    if (! tack->hash)
+static inline const char *entry_key(const tack_hash_entry *entry) {
+    return entry->len < TACK_KEY_INLINE ? entry->key.inline_key : entry->key.ptr;
+}
+
+static inline uint32_t probe_dist(const struct tack_hash *h, const tack_hash_entry *entry, uint32_t slot) {
+    return (slot - entry->hash) & (h->cap - 1);
+}
+
+static tack_hash_entry *tack_hfind(tack_t *tack, const char *key) {
+    struct tack_hash *h = tack->hash;
+    if (h == NULL || h->len == 0)
         return NULL;
+    size_t len = strlen(key);
+    uint32_t hash = tack_strhash(key, len);
+    uint32_t mask = h->cap - 1;
+    for (uint32_t dist = 0, slot = hash & mask;; dist++, slot = (slot + 1) & mask) {
+        tack_hash_entry *entry = &h->entries[slot];
+        if (entry->hash == 0 || probe_dist(h, entry, slot) < dist)
+            return NULL;
+        if (entry->hash == hash && entry->len == len && memcmp(entry_key(entry), key, len) == 0)
+            return entry;
+    }
+}
 
-    tack_t *slot = &tack->hash[djb_hash(key)];
-    tack_hash_entry *entry;
-    tack_foreach(slot, entry) {
-        if (strcmp(entry->key, key) == 0) {
-            return entry->data;
+// places an entry which is known not to be in the table
+static void tack_hinsert(struct tack_hash *h, tack_hash_entry entry) {
+    uint32_t mask = h->cap - 1;
+    uint32_t slot = entry.hash & mask;
+    for (uint32_t dist = 0;; dist++, slot = (slot + 1) & mask) {
+        tack_hash_entry *cur = &h->entries[slot];
+        if (cur->hash == 0) {
+            *cur = entry;
+            h->len++;
+            return;
+        }
+        // steal the slot from entries closer to their home
+        uint32_t cur_dist = probe_dist(h, cur, slot);
+        if (cur_dist < dist) {
+            tack_hash_entry tmp = *cur;
+            *cur = entry;
+            entry = tmp;
+            dist = cur_dist;
         }
     }
-    return NULL;
 }
 
-bool tack_hexists(tack_t *tack, const char *key) {
-    if (! tack->hash)
-        return NULL;
+static void tack_hresize(struct tack_hash *h, uint32_t cap) {
+    tack_hash_entry *old = h->entries;
+    uint32_t old_cap = h->cap;
+    h->entries = calloc(cap, sizeof(tack_hash_entry));
+    h->cap = cap;
+    h->len = 0;
+    for (uint32_t i = 0; i < old_cap; i++) {
+        if (old[i].hash) tack_hinsert(h, old[i]);
+    }
+    free(old);
+}
 
-    tack_t *slot = &tack->hash[djb_hash(key)];
-    tack_hash_entry *entry;
-    tack_foreach(slot, entry) {
-        if (strcmp(entry->key, key) == 0) {
-            return true;
-        }
+static void tack_hfree(struct tack_hash *h) {
+    for (uint32_t i = 0; i < h->cap; i++) {
+        if (h->entries[i].hash && h->entries[i].len >= TACK_KEY_INLINE)
+            free(h->entries[i].key.ptr);
     }
-    return false;
+    free(h->entries);
+    free(h);
+}
+
+void *tack_hset(tack_t *tack, const char *key, void *val) {
+    tack_hash_entry *found = tack_hfind(tack, key);
+    if (found) {
+        // return the old data so it can be caller-freed
+        void *tmp = found->data;
+        found->data = val;
+        return tmp;
+    }
+    if (tack->hash == NULL)
+        tack->hash = calloc(1, sizeof(struct tack_hash));
+    struct tack_hash *h = tack->hash;
+    // keep load under 7/8
+    if ((h->len + 1) * 8 > h->cap * 7)
+        tack_hresize(h, h->cap ? h->cap * 2 : TACK_HASH_MIN);
+
+    size_t len = strlen(key);
+    tack_hash_entry entry = {.hash = tack_strhash(key, len), .len = len, .data = val};
+    if (len < TACK_KEY_INLINE) {
+        memcpy(entry.key.inline_key, key, len + 1);
+    } else {
+        entry.key.ptr = strdup(key);
+    }
+    tack_hinsert(h, entry);
+    return NULL;
+}
+
+void *tack_hget(tack_t *tack, const char *key) {
+    tack_hash_entry *entry = tack_hfind(tack, key);
+    return entry ? entry->data : NULL;
+}
+
+bool tack_hexists(tack_t *tack, const char *key) {
+    return tack_hfind(tack, key) != NULL;
 }
 
 void tack_hdel(tack_t *tack, const char *key) {
-    if (! tack->hash)
+    tack_hash_entry *entry = tack_hfind(tack, key);
+    if (entry == NULL)
         return;
-
-    tack_t *slot = &tack->hash[djb_hash(key)];
-    tack_hash_entry *entry;
-    tack_foreach(slot, entry) {
-        if (strcmp(entry->key, key) == 0) {
-            free(entry);
-            if (tack_len(slot) == 0) {
-                tack_clear(slot);
-            } else {
-                tack_del(slot, i);
-            }
+    struct tack_hash *h = tack->hash;
+    if (entry->len >= TACK_KEY_INLINE)
+        free(entry->key.ptr);
+    // backward shift the following entries so no tombstone is needed
+    uint32_t mask = h->cap - 1;
+    uint32_t slot = entry - h->entries;
+    while (1) {
+        uint32_t next = (slot + 1) & mask;
+        tack_hash_entry *cur = &h->entries[next];
+        if (cur->hash == 0 || probe_dist(h, cur, next) == 0)
             break;
-        }
+        h->entries[slot] = *cur;
+        slot = next;
     }
+    memset(&h->entries[slot], 0, sizeof(tack_hash_entry));
+    h->len--;
 }
@@ -6,7 +6,7 @@
 
 typedef struct tack_t {
     void **data;
-    struct tack_t *hash;
+    struct tack_hash *hash;
     int len, cap, pos;
 } tack_t;
 
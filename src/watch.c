@@ -0,0 +1,179 @@
+#include <dirent.h>
+#include <errno.h>
+#include <jansson.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "server.h"
+#include "tack.h"
+#include "watch.h"
+
+// seconds between rescans where the directory can't be watched
+#define WATCH_POLL 2
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+// a grammar file, as of its last load
+typedef struct {
+    char *file;
+    struct timespec mtime;
+    off_t size;
+    // the g.load object loaded from it, and its grammar's name. NULL until it loads
+    json_t *j;
+    char *name;
+    bool seen;
+} watch_file;
+
+// only touched by the watch thread
+static char *watch_dir;
+static tack_t files;
+
+static void watch_file_free(watch_file *f) {
+    json_decref(f->j);
+    free(f->name);
+    free(f->file);
+    free(f);
+}
+
+// whether a file other than f loaded the grammar by this name, as when a file is renamed
+static bool watch_claimed(const char *name, watch_file *f) {
+    watch_file *other;
+    tack_foreach(&files, other) {
+        if (other != f && other->name && strcmp(other->name, name) == 0)
+            return true;
+    }
+    return false;
+}
+
+// loads the file again if it changed since the last scan. files that don't parse are
+// skipped until they change again, and their grammar stays as it was
+static void watch_check(const char *file, const char *path, struct stat *st) {
+    watch_file *f = tack_hget(&files, file);
+    if (!f) {
+        f = calloc(1, sizeof(watch_file));
+        f->file = strdup(file);
+        tack_push(&files, f);
+        tack_hset(&files, f->file, f);
+    } else if (f->size == st->st_size && f->mtime.tv_sec == st->st_mtim.tv_sec &&
+               f->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+        f->seen = true;
+        return;
+    }
+    f->seen = true;
+    f->size = st->st_size;
+    f->mtime = st->st_mtim;
+
+    json_error_t err;
+    json_t *j = json_load_file(path, 0, &err);
+    if (!json_is_object(j)) {
+        printf("warning: grammar file %s: %s\n", path, j ? "not a json object" : err.text);
+        json_decref(j);
+        return;
+    }
+    json_t *name = json_object_get(j, "name");
+    if (!name) {
+        name = json_stringn(file, strlen(file) - strlen(".json"));
+        json_object_set_new(j, "name", name);
+    } else if (!json_is_string(name)) {
+        printf("warning: grammar file %s: name must be a string\n", path);
+        json_decref(j);
+        return;
+    }
+    // saving a file unchanged doesn't reload it
+    if (f->j && json_equal(f->j, j)) {
+        json_decref(j);
+        return;
+    }
+    if (f->name && strcmp(f->name, json_string_value(name)) != 0 && !watch_claimed(f->name, f))
+        maclink_unload(f->name);
+    printf("[-] loading grammar %s from %s\n", json_string_value(name), file);
+    maclink_reload(j);
+    json_decref(f->j);
+    free(f->name);
+    f->j = j;
+    f->name = strdup(json_string_value(name));
+}
+
+static void watch_scan(void) {
+    static bool warned = false;
+    DIR *dir = opendir(watch_dir);
+    if (!dir) {
+        if (!warned)
+            printf("warning: can't read grammar directory %s: %s\n", watch_dir, strerror(errno));
+        warned = true;
+        return;
+    }
+    warned = false;
+    watch_file *f;
+    tack_foreach(&files, f) {
+        f->seen = false;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        size_t len = strlen(de->d_name);
+        if (de->d_name[0] == '.' || len <= strlen(".json") || strcmp(de->d_name + len - strlen(".json"), ".json"))
+            continue;
+        char *path;
+        asprintf(&path, "%s/%s", watch_dir, de->d_name);
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+            watch_check(de->d_name, path, &st);
+        free(path);
+    }
+    closedir(dir);
+    // files that are gone take their grammars with them
+    for (int i = tack_len(&files) - 1; i >= 0; i--) {
+        f = tack_get(&files, i);
+        if (f->seen)
+            continue;
+        if (f->name && !watch_claimed(f->name, f)) {
+            printf("[-] unloading grammar %s, %s was removed\n", f->name, f->file);
+            maclink_unload(f->name);
+        }
+        tack_hdel(&files, f->file);
+        tack_del(&files, i);
+        watch_file_free(f);
+    }
+}
+
+static void *watch_thread(void *user) {
+#ifdef __linux__
+    // watched before the first scan, so no change is missed in between. any change
+    // rescans the directory, which only loads files whose size or mtime changed
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd >= 0 && inotify_add_watch(fd, watch_dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) >= 0) {
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        watch_scan();
+        while (read(fd, events, sizeof(events)) > 0 || errno == EINTR)
+            watch_scan();
+    }
+    printf("warning: can't watch grammar directory %s, polling it instead\n", watch_dir);
+    if (fd >= 0)
+        close(fd);
+#endif
+    while (1) {
+        watch_scan();
+        sleep(WATCH_POLL);
+    }
+    return NULL;
+}
+
+void watch_start(const char *dir) {
+    pthread_t tid;
+    watch_dir = strdup(dir);
+    if (pthread_create(&tid, NULL, watch_thread, NULL)) {
+        printf("warning: grammar directory %s not loaded, thread creation failed\n", dir);
+        return;
+    }
+    pthread_detach(tid);
+}
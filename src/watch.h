@@ -0,0 +1,12 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+// grammar directory: with $MACLINK_GRAMMARS set, every *.json file in it is loaded at startup
+// through the g.load queue, so grammars compile while dragon boots instead of waiting for
+// clients to send them. each file is a g.load object, named after the file if it has no name.
+// the directory is watched (with inotify on linux, polled elsewhere): changed files are loaded
+// again in place of their grammar, as g.update would, and deleted files' grammars are unloaded
+
+void watch_start(const char *dir);
+
+#endif
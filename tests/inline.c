@@ -0,0 +1,68 @@
+// dead rule elimination and inlining of small private rules (user-016)
+#include "test.h"
+
+static const char *source = "{\"name\": \"i\", \"public\": {"
+    "\"a\": \"go <helper>\","
+    "\"b\": \"stop <shared> <shared> <once>\"},"
+    "\"private\": {"
+    "\"helper\": \"x <tiny>\","
+    "\"tiny\": \"(y | z)\","
+    "\"dead\": \"zebra {items}\","
+    "\"shared\": \"(left | right)\","
+    "\"once\": \"done\"}}";
+
+static bool has_rule(Grammar *g, const char *name) {
+    return tack_hexists(&g->core->rules, name);
+}
+
+int main() {
+    Grammar *g = test_grammar(source);
+    check(g != NULL);
+    if (!g)
+        return test_done();
+
+    // rules called straight from a public rule keep their ids, so words are still reported
+    // under them. tiny is inlined into helper, and nothing reaches dead
+    check(has_rule(g, "helper"));
+    check(has_rule(g, "shared"));
+    check(has_rule(g, "once"));
+    check(!has_rule(g, "tiny"));
+    check(!has_rule(g, "dead"));
+    check(!tack_hexists(&g->core->words, "zebra"));
+    check(tack_hexists(&g->core->words, "y"));
+    // but the dead rule's list can still be set
+    check(tack_hexists(&g->core->lists, "items"));
+    test_list(g, "items", "one,two");
+
+    check_str(test_match(g, "go,x,y"), "a: go=a x=helper y=helper");
+    check_str(test_match(g, "go,x,z"), "a: go=a x=helper z=helper");
+    check_str(test_match(g, "stop,left,right,done"), "b: stop=b left=shared right=shared done=once");
+    check_str(test_match(g, "stop,right,left,done"), "b: stop=b right=shared left=shared done=once");
+
+    // an update that makes the dead rule reachable brings it back
+    json_t *j = json_loads("{\"name\": \"i\", \"public\": {"
+        "\"a\": \"go <helper>\","
+        "\"b\": \"stop <dead>\"},"
+        "\"private\": {"
+        "\"helper\": \"x <tiny>\","
+        "\"tiny\": \"(y | z)\","
+        "\"dead\": \"zebra {items}\"}}", 0, NULL);
+    Grammar *next;
+    char *err = NULL;
+    check(grammar_update(&next, g, j, &err) == 0);
+    json_decref(j);
+    if (err) {
+        printf("update error: %s\n", err);
+        free(err);
+    } else {
+        check(has_rule(next, "dead"));
+        check(tack_hexists(&next->core->words, "zebra"));
+        test_list(next, "items", "one,two");
+        check_str(test_match(next, "stop,zebra,two"), "b: stop=b zebra=dead two=dead");
+        check_str(test_match(next, "go,x,z"), "a: go=a x=helper z=helper");
+        grammar_free(next);
+    }
+
+    grammar_free(g);
+    return test_done();
+}
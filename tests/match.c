@@ -0,0 +1,40 @@
+// chart matcher results and attribution (user-002), with and without dragon's rule numbers
+#include "test.h"
+
+int main() {
+    Grammar *g = test_grammar("{\"name\": \"m\", \"public\": {"
+        "\"a\": \"hello <b>\", \"c\": \"count <num>+\", \"d\": \"set level:<num>\","
+        "\"e\": \"call {names} [now]\", \"f\": \"note <dgndictation>\"},"
+        "\"private\": {\"b\": \"(one | two)\", \"num\": \"(one | two | three)\"}}");
+    check(g != NULL);
+    if (!g)
+        return test_done();
+
+    // words go to the innermost rule that matched them, or its key
+    check_str(test_match(g, "hello,two"), "a: hello=a two=b");
+    check_str(test_match(g, "count,two,one,three"), "c: count=c two=num one=num three=num");
+    check_str(test_match(g, "set,three"), "d: set=d three=level");
+    check_str(test_match(g, "note,this@dgndictation,down@dgndictation"), "f: note=f this=dgndictation down=dgndictation");
+
+    // dragon's rule numbers only guide the match
+    check_str(test_match(g, "hello@a,two@b"), "a: hello=a two=b");
+    check_str(test_match(g, "count@c,one@num,one@num"), "c: count=c one=num one=num");
+
+    // lists match their current items only
+    check_str(test_match(g, "call,alice"), "e: call=e alice=-");
+    test_list(g, "names", "bob,alice");
+    check_str(test_match(g, "call,alice"), "e: call=e alice=e");
+    check_str(test_match(g, "call,bob,now"), "e: call=e bob=e now=e");
+    test_list(g, "names", "carol");
+    check_str(test_match(g, "call,alice"), "e: call=e alice=-");
+    check_str(test_match(g, "call,carol"), "e: call=e carol=e");
+
+    // without a complete parse, the longest prefix is attributed
+    check_str(test_match(g, "hello,three"), "a: hello=a three=-");
+    check_str(test_match(g, "hello,one,two"), "a: hello=a one=b two=-");
+    check_str(test_match(g, "count"), "c: count=c");
+    check_str(test_match(g, "one"), "-: one=-");
+
+    grammar_free(g);
+    return test_done();
+}
@@ -0,0 +1,62 @@
+// the optimizer's passes over parsed rule trees (user-015), with every pass on
+#include "test.h"
+
+static void check_opt(const char *text, const char *want) {
+    const char *got = test_parse(text, true);
+    if (strcmp(got, want) != 0) {
+        printf("optimizing %s\n    got:  %s\n    want: %s\n", text, got, want);
+        test_failures++;
+    }
+}
+
+int main() {
+    unsetenv("MACLINK_PASSES");
+
+    // literals
+    check_opt("hello there", "(seq 'hello there')");
+    check_opt("a (b c) d", "(seq 'a' 'b c' 'd')");
+    check_opt("k:<r> v:{l}", "(seq k:<r> v:{l})");
+
+    // flatten
+    check_opt("((a))", "(seq 'a')");
+    check_opt("(a | (b | c))", "(seq (alt 'a' 'b' 'c'))");
+
+    // dedup
+    check_opt("(a | b | a)", "(seq (alt 'a' 'b'))");
+    check_opt("(<a> | <a>)", "(seq <a>)");
+    check_opt("hello there (you | you)", "(seq 'hello there' 'you')");
+
+    // factor
+    check_opt("(open <door> | open <window> | close <door>)",
+              "(seq (alt (seq 'open' (alt <door> <window>)) (seq 'close' <door>)))");
+    check_opt("(a <b> | c <b>)", "(seq (alt 'a' 'c') <b>)");
+    check_opt("(a <b> <c> | a <c> <b>)", "(seq 'a' (alt (seq <b> <c>) (seq <c> <b>)))");
+    check_opt("(go <a> | go)", "(seq 'go' (opt <a>))");
+    check_opt("(x [y] | x)", "(seq 'x' (opt 'y'))");
+    check_opt("(x | x [y])", "(seq 'x' (opt 'y'))");
+    // words stay whole, so joined literals aren't factored
+    check_opt("(open the door | open the window)", "(seq (alt 'open the door' 'open the window'))");
+
+    // repeat
+    check_opt("[[x]]", "(seq (opt 'x'))");
+    check_opt("(x+)+", "(seq (rep 'x'))");
+    check_opt("([x])+", "(seq (opt (rep 'x')))");
+    check_opt("(x)*", "(seq (opt (rep 'x')))");
+    check_opt("[x]*", "(seq (opt (rep 'x')))");
+    check_opt("[(x+)]", "(seq (opt (rep 'x')))");
+    check_opt("{l}+", "(seq (rep {l}))");
+
+    // the optimized rules still match what they did
+    Grammar *g = test_grammar("{\"name\": \"o\", \"public\": {"
+        "\"a\": \"(open <thing> | open <thing> now | close <thing>)\"},"
+        "\"private\": {\"thing\": \"(door | window)\"}}");
+    check(g != NULL);
+    if (g) {
+        check_str(test_match(g, "open,door"), "a: open=a door=thing");
+        check_str(test_match(g, "open,window,now"), "a: open=a window=thing now=a");
+        check_str(test_match(g, "close,door"), "a: close=a door=thing");
+        check_str(test_match(g, "close,door,now"), "a: close=a door=thing now=-");
+        grammar_free(g);
+    }
+    return test_done();
+}
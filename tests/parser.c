@@ -0,0 +1,140 @@
+// rule text parsed into trees, and its syntax errors, checked against what the bison parser
+// this one replaced gave for the same text (user-019). then whole grammar sources
+#include "test.h"
+
+static const struct {
+    const char *text, *want;
+} cases[] = {
+    {"hello", "(seq 'hello')"},
+    {"hello there", "(seq 'hello' 'there')"},
+    {"hello\nthere", "(seq 'hello' 'there')"},
+    {"\nhello\n\tthere\n", "(seq 'hello' 'there')"},
+    {"(home |\n work)", "(seq (alt (seq 'home') (seq 'work')))"},
+    {"  padded  ", "(seq 'padded')"},
+    {"a <b> {c}", "(seq 'a' <b> {c})"},
+    {"k:<r> v:{l}", "(seq k:<r> v:{l})"},
+    {"key:word", "(seq 'key:word')"},
+    {"a:b:<r>", "(seq a:<r>)"},
+    {"a : b", "(seq 'a:b')"},
+    {"[optional words]", "(seq (opt 'optional' 'words'))"},
+    {"(one | two | three)", "(seq (alt (seq 'one') (seq 'two') (seq 'three')))"},
+    {"(a|b)", "(seq (alt (seq 'a') (seq 'b')))"},
+    {"((a))", "(seq (alt (seq (alt (seq 'a')))))"},
+    {"(x+)+", "(seq (rep (alt (seq (rep 'x')))))"},
+    {"x*", "(seq (rep (opt 'x')))"},
+    {"[x]*", "(seq (rep (opt (opt 'x'))))"},
+    {"<rule>+", "(seq (rep <rule>))"},
+    {"a (b (c | d) [e]) f", "(seq 'a' (alt (seq 'b' (alt (seq 'c') (seq 'd')) (opt 'e'))) 'f')"},
+    {"'quoted'", "(seq ''quoted'')"},
+    {"it's <fine>", "(seq 'it's' <fine>)"},
+    {"num 1 2 3", "(seq 'num' '1' '2' '3')"},
+    {"hyphen-word under_score", "(seq 'hyphen-word' 'under_score')"},
+
+    {"", "error: syntax error, unexpected end of file"},
+    {"(a | b) [c | d]", "error: syntax error, unexpected '|'"},
+    {"[a|b]", "error: syntax error, unexpected '|'"},
+    {"a | b", "error: syntax error, unexpected '|', expecting end of file"},
+    {"(a | )", "error: syntax error, unexpected ')'"},
+    {"( | a)", "error: syntax error, unexpected '|'"},
+    {"()", "error: syntax error, unexpected ')'"},
+    {"[]", "error: syntax error, unexpected ']'"},
+    {"(a", "error: syntax error, unexpected end of file, expecting ')' or '|'"},
+    {"(a | b", "error: syntax error, unexpected end of file, expecting ')' or '|'"},
+    {"a)", "error: syntax error, unexpected ')', expecting end of file"},
+    {"[a", "error: syntax error, unexpected end of file"},
+    {"a]", "error: syntax error, unexpected ']', expecting end of file"},
+    {"<a", "error: syntax error, unexpected end of file, expecting '>'"},
+    {"{a", "error: syntax error, unexpected end of file, expecting '}'"},
+    {"<>", "error: syntax error, unexpected '>', expecting WORD"},
+    {"{}", "error: syntax error, unexpected '}', expecting WORD"},
+    {"<a b>", "error: syntax error, unexpected WORD, expecting '>'"},
+    {"a:", "error: syntax error, unexpected end of file, expecting '<' or WORD or '{'"},
+    {":a", "error: syntax error, unexpected ':'"},
+    {"+", "error: syntax error, unexpected '+'"},
+    {"a ++", "error: syntax error, unexpected '+', expecting end of file"},
+    {"*x", "error: syntax error, unexpected '*'"},
+    {"\"double\"", "error: syntax error, unexpected UNKNOWN"},
+    {"dotted.word", "error: syntax error, unexpected UNKNOWN, expecting end of file"},
+    {"a # comment", "error: syntax error, unexpected UNKNOWN, expecting end of file"},
+    {"a, b", "error: syntax error, unexpected UNKNOWN, expecting end of file"},
+    {"\xc3\xa9", "error: syntax error, unexpected UNKNOWN"},
+};
+
+// n groups around a word, which ran bison's stack out past 9996
+static char *nested(int n) {
+    char *text = malloc(2 * n + 2);
+    memset(text, '(', n);
+    text[n] = 'a';
+    memset(text + n + 1, ')', n);
+    text[2 * n + 1] = 0;
+    return text;
+}
+
+// n words joined by ':', which the right recursive Literal kept on the stack
+static char *chain(int n) {
+    char *text = malloc(2 * n);
+    for (int i = 0; i < n; i++) {
+        text[2 * i] = 'w';
+        text[2 * i + 1] = ':';
+    }
+    text[2 * n - 1] = 0;
+    return text;
+}
+
+static void check_source(const char *text, const char *public, const char *private, const char *err) {
+    json_t *got_public = NULL, *got_private = NULL;
+    char *got_err = NULL;
+    int rc = grammar_source_parse(text, &got_public, &got_private, &got_err);
+    if (err) {
+        check(rc == -1);
+        check_str(got_err, err);
+        free(got_err);
+        return;
+    }
+    check(rc == 0);
+    json_t *want_public = json_loads(public, 0, NULL);
+    check(got_public && json_equal(got_public, want_public));
+    json_decref(want_public);
+    if (private) {
+        json_t *want_private = json_loads(private, 0, NULL);
+        check(got_private && json_equal(got_private, want_private));
+        json_decref(want_private);
+    } else {
+        check(got_private == NULL);
+    }
+    json_decref(got_public);
+    json_decref(got_private);
+}
+
+int main() {
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        const char *got = test_parse(cases[i].text, false);
+        if (strcmp(got, cases[i].want) != 0) {
+            printf("parsing \"%s\"\n    got:  %s\n    want: %s\n", cases[i].text, got, cases[i].want);
+            test_failures++;
+        }
+    }
+
+    char *text = nested(9996);
+    check(strncmp(test_parse(text, false), "(seq (alt ", 10) == 0);
+    free(text);
+    text = nested(9997);
+    check_str(test_parse(text, false), "error: memory exhausted");
+    free(text);
+    text = chain(4999);
+    check(strncmp(test_parse(text, false), "(seq 'w:w:", 10) == 0);
+    free(text);
+    text = chain(5000);
+    check_str(test_parse(text, false), "error: memory exhausted");
+    free(text);
+
+    check_source("# a comment\npublic <a> = go <b>;\n<b> = (home |\n work) | away;\n",
+                 "{\"a\": \"go <b>\"}", "{\"b\": [\"(home |\\n work)\", \"away\"]}", NULL);
+    check_source("public<a>=x;", "{\"a\": \"x\"}", NULL, NULL);
+    check_source("<a> = x", NULL, NULL, "grammar source line 1: expecting ';' after <a>");
+    check_source("<a> x;", NULL, NULL, "grammar source line 1: expecting '=' after <a>");
+    check_source("\n\n<> = x;", NULL, NULL, "grammar source line 3: expecting a rule name in <>");
+    check_source("public <a> = x;\npublic <a> = y;", NULL, NULL,
+                 "grammar source line 2: public rule <a> defined twice");
+    return test_done();
+}
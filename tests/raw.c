@@ -0,0 +1,129 @@
+// packed grammars loaded with g.load.raw (user-023): a compiled grammar's own blob loads back
+// and matches the same, and damaged blobs are refused with an error rather than read past
+#include "test.h"
+
+static const char *source = "{\"name\": \"r\", \"public\": {"
+    "\"a\": \"go <place> [now]\","
+    "\"b\": \"set <level> {device}\"},"
+    "\"private\": {"
+    "\"place\": \"(home | work)\","
+    "\"level\": \"(low | high)+\"}}";
+
+static const char *phrases[] = {
+    "go,home", "go,work,now", "set,low,high,lamp", "set,high,fan", "go,now",
+};
+
+// loads data, and returns the error if it was refused. a blob that loads must match
+static char *load(const uint8_t *data, size_t size, json_t *rules) {
+    Grammar *g;
+    char *err = NULL;
+    if (grammar_load_raw(&g, "raw", data, size, rules, &err)) {
+        if (!err)
+            err = strdup("(no error set)");
+        return err;
+    }
+    check(err == NULL);
+    for (size_t i = 0; i < sizeof(phrases) / sizeof(phrases[0]); i++)
+        test_match(g, phrases[i]);
+    grammar_free(g);
+    return NULL;
+}
+
+// want is how the error starts
+static void check_refused(const uint8_t *data, size_t size, const char *want) {
+    char *err = load(data, size, NULL);
+    if (!err || strncmp(err, want, strlen(want)) != 0) {
+        printf("loading %zu bytes\n    got:  %s\n    want: %s...\n", size, err ? err : "(loaded)", want);
+        test_failures++;
+    }
+    free(err);
+}
+
+int main() {
+    Grammar *g = test_grammar(source);
+    check(g != NULL);
+    if (!g)
+        return test_done();
+    test_list(g, "device", "lamp,fan");
+    size_t size = g->raw->size;
+    uint8_t *blob = malloc(2 * size);
+    memcpy(blob, g->raw->data, size);
+
+    // private rules are named by id, as the client passes them
+    json_t *rules = json_array();
+    for (uint32_t id = 1;; id++) {
+        const char *name = NULL;
+        node_id *ent;
+        tack_foreach(&g->core->rules, ent) {
+            if (ent->id == (int)id) name = ent->name;
+        }
+        if (!name)
+            break;
+        json_array_append_new(rules, json_string(name));
+    }
+    Grammar *r;
+    char *err = NULL;
+    check(grammar_load_raw(&r, "raw", blob, size, rules, &err) == 0);
+    if (err) {
+        printf("load error: %s\n", err);
+        free(err);
+    } else {
+        test_list(r, "device", "lamp,fan");
+        for (size_t i = 0; i < sizeof(phrases) / sizeof(phrases[0]); i++) {
+            char *want = strdup(test_match(g, phrases[i]));
+            check_str(test_match(r, phrases[i]), want);
+            free(want);
+        }
+        grammar_free(r);
+    }
+    // unnamed private rules go with the rules calling them
+    err = NULL;
+    check(grammar_load_raw(&r, "raw", blob, size, NULL, &err) == 0);
+    if (err) {
+        printf("load error: %s\n", err);
+        free(err);
+    } else {
+        test_list(r, "device", "lamp,fan");
+        check_str(test_match(r, "go,work,now"), "a: go=a work=a now=a");
+        check_str(test_match(r, "set,low,high,lamp"), "b: set=b low=b high=b lamp=b");
+        grammar_free(r);
+    }
+
+    check_refused(blob, 0, "not a packed cfg grammar");
+    check_refused(blob, sizeof(grammar_header) - 1, "not a packed cfg grammar");
+    check_refused(blob, sizeof(grammar_header), "packed grammar has no rule chunk");
+    check_refused(blob, size - 1, "truncated chunk at offset ");
+    ((grammar_header *)blob)->type = 1;
+    check_refused(blob, size, "not a packed cfg grammar");
+    ((grammar_header *)blob)->type = 0;
+
+    // a chunk after the last one, which is either of an unknown type or repeats one
+    chunk_header *extra = (chunk_header *)(blob + size);
+    *extra = (chunk_header){.type = 9, .size = 0};
+    check_refused(blob, size + sizeof(chunk_header), "unknown chunk type 9 at offset ");
+    const chunk_header *first = (const chunk_header *)(blob + sizeof(grammar_header));
+    memcpy(extra, first, sizeof(chunk_header) + first->size);
+    check_refused(blob, size + sizeof(chunk_header) + first->size, "more than one ");
+
+    // every shorter blob, and every byte flipped, either loads or is refused with an error
+    int refused = 0;
+    for (size_t len = 0; len < size; len++) {
+        char *err = load(blob, len, NULL);
+        refused += err != NULL;
+        free(err);
+    }
+    check(refused > 0);
+    for (size_t i = 0; i < size; i++) {
+        for (int bit = 0; bit < 8; bit++) {
+            blob[i] ^= 1 << bit;
+            free(load(blob, size, NULL));
+            blob[i] ^= 1 << bit;
+        }
+    }
+    check(memcmp(blob, g->raw->data, size) == 0);
+
+    json_decref(rules);
+    free(blob);
+    grammar_free(g);
+    return test_done();
+}
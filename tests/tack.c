@@ -0,0 +1,93 @@
+// tack's list operations, and its hash checked against a plain array model through growth and
+// backward shift deletion (user-007)
+#include <stdint.h>
+
+#include "tack.h"
+#include "test.h"
+
+#define KEYS 3000
+
+int main() {
+    tack_t list = {0};
+    for (uintptr_t i = 0; i < 100; i++)
+        tack_push_int(&list, i);
+    check(tack_len(&list) == 100);
+    check(tack_get_int(&list, 42) == 42);
+    tack_del(&list, 0);
+    check(tack_get_int(&list, 0) == 1);
+    tack_remove(&list, (void *)(uintptr_t)50);
+    check(tack_len(&list) == 98);
+    check(tack_get_int(&list, 49) == 51);
+    check(tack_pop_int(&list) == 99);
+    check(tack_peek_int(&list) == 98);
+    tack_clear(&list);
+    check(tack_len(&list) == 0);
+
+    // keys are copied, both the inline short ones and the long ones
+    tack_t hash = {0};
+    char key[64];
+    strcpy(key, "short");
+    tack_hset(&hash, key, (void *)1);
+    strcpy(key, "a key too long to be stored inline in its entry");
+    tack_hset(&hash, key, (void *)2);
+    memset(key, 'x', sizeof(key) - 1);
+    check(tack_hget(&hash, "short") == (void *)1);
+    check(tack_hget(&hash, "a key too long to be stored inline in its entry") == (void *)2);
+    check(tack_hset(&hash, "short", (void *)3) == (void *)1);
+    check(tack_hget(&hash, "missing") == NULL);
+    tack_clear(&hash);
+
+    // random sets, gets and deletes of keys of mixed lengths, with a full sweep now and then
+    char *keys[KEYS];
+    void *vals[KEYS] = {0};
+    bool present[KEYS] = {0};
+    srand(7);
+    for (int i = 0; i < KEYS; i++) {
+        keys[i] = calloc(1, 64);
+        int len = i % 3 == 0 ? rand() % 6 : rand() % 40;
+        int pos = sprintf(keys[i], "k%d_", i);
+        for (; pos < len; pos++)
+            keys[i][pos] = 'a' + rand() % 26;
+    }
+    for (int op = 0; op < 400000; op++) {
+        int k = rand() % KEYS;
+        switch (rand() % 4) {
+        case 0:
+        case 1: {
+            void *val = (void *)(uintptr_t)(rand() + 1);
+            check(tack_hset(&hash, keys[k], val) == (present[k] ? vals[k] : NULL));
+            vals[k] = val;
+            present[k] = true;
+            break;
+        }
+        case 2:
+            tack_hdel(&hash, keys[k]);
+            present[k] = false;
+            vals[k] = NULL;
+            break;
+        default:
+            check(tack_hget(&hash, keys[k]) == (present[k] ? vals[k] : NULL));
+            check(tack_hexists(&hash, keys[k]) == present[k]);
+        }
+        if (op % 50000 == 0) {
+            for (int i = 0; i < KEYS; i++)
+                check(tack_hexists(&hash, keys[i]) == present[i]);
+        }
+        if (test_failures)
+            break;
+    }
+    // emptied and refilled past its old size
+    for (int i = 0; i < KEYS; i++)
+        tack_hdel(&hash, keys[i]);
+    for (int i = 0; i < KEYS; i++)
+        check(!tack_hexists(&hash, keys[i]));
+    for (int i = 0; i < KEYS; i++)
+        tack_hset(&hash, keys[i], keys[i]);
+    for (int i = 0; i < KEYS; i++)
+        check(tack_hget(&hash, keys[i]) == keys[i]);
+
+    tack_clear(&hash);
+    for (int i = 0; i < KEYS; i++)
+        free(keys[i]);
+    return test_done();
+}
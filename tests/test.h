@@ -0,0 +1,158 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "grammar/compile.h"
+#include "intern.h"
+#include "match.h"
+
+// each test is a program that prints its failed checks and exits nonzero if there were any
+
+static int test_failures;
+
+#define check(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define check_str(got, want) do { \
+    const char *_got = (got), *_want = (want); \
+    if (!_got || strcmp(_got, _want) != 0) { \
+        printf("%s:%d: %s\n    got:  %s\n    want: %s\n", __FILE__, __LINE__, #got, _got ? _got : "(null)", _want); \
+        test_failures++; \
+    } \
+} while (0)
+
+static inline int test_done(void) {
+    if (test_failures)
+        printf("%d checks failed\n", test_failures);
+    return test_failures != 0;
+}
+
+// compiles a g.load object, without the disk cache
+static inline Grammar *test_grammar(const char *text) {
+    setenv("MACLINK_CACHE", "", 1);
+    json_error_t jerr;
+    json_t *j = json_loads(text, 0, &jerr);
+    if (!j) {
+        printf("bad test json: %s\n", jerr.text);
+        exit(1);
+    }
+    Grammar *g;
+    char *err;
+    if (grammar_compile(&g, j, &err)) {
+        printf("compile error: %s\n", err);
+        free(err);
+        g = NULL;
+    }
+    json_decref(j);
+    return g;
+}
+
+// replaces a list's items, comma separated, as g.list.set does
+static inline void test_list(Grammar *g, const char *list, const char *items) {
+    node_id *ent = tack_hget(&g->core->lists, list);
+    intern_set *set = tack_get(&g->listdata, ent->id - 1), next = {0};
+    char *copy = strdup(items), *save;
+    for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        uint32_t id = intern_ref(item);
+        if (!intern_set_add(&next, id))
+            intern_release(id);
+    }
+    free(copy);
+    intern_set_release(set);
+    *set = next;
+    g->list_version++;
+}
+
+// appends node to out as an s-expression, stopping short of size
+static inline void test_sexp(char *out, size_t size, Node *node) {
+    static const char *groups[] = {"seq", "alt", "opt", "rep"};
+    size_t len = strlen(out);
+    if (len + 1 >= size)
+        return;
+    out += len, size -= len;
+    len = node->key ? snprintf(out, size, "%s:", node->key) : 0;
+    if (len >= size)
+        return;
+    switch (node->type) {
+    case LITERAL: snprintf(out + len, size - len, "'%s'", node->name); return;
+    case RULE: snprintf(out + len, size - len, "<%s>", node->name); return;
+    case LIST: snprintf(out + len, size - len, "{%s}", node->name); return;
+    default: break;
+    }
+    snprintf(out + len, size - len, "(%s", groups[node->type]);
+    Node *child;
+    node_foreach(node, child) {
+        len = strlen(out);
+        snprintf(out + len, size - len, " ");
+        test_sexp(out, size, child);
+    }
+    len = strlen(out);
+    snprintf(out + len, size - len, ")");
+}
+
+// parses one rule's text, and optimizes it if asked. returns the tree as an s-expression like
+// "(seq 'a' key:<b> {c})", or "error: ..." if it didn't parse, which is freed by the next call
+static inline const char *test_parse(const char *text, bool optimize) {
+    static char out[4096];
+    arena *a = arena_new(4096);
+    char *err = NULL;
+    Node *root = grammar_parse(a, text, &err);
+    if (err) {
+        snprintf(out, sizeof(out), "error: %s", err);
+        free(err);
+    } else if (!root) {
+        snprintf(out, sizeof(out), "(null)");
+    } else {
+        if (optimize)
+            root = node_optimize(root);
+        out[0] = 0;
+        test_sexp(out, sizeof(out), root);
+        node_free(root);
+    }
+    arena_free(a);
+    return out;
+}
+
+// matches a phrase of comma separated words, as dragon recognized them. "word@rule" gives the
+// rule dragon reports the word under. returns "rule: word=attribution ...", which is freed by
+// the next call
+static inline const char *test_match(Grammar *g, const char *phrase) {
+    static char out[1024];
+    result_node words[64] = {{0}};
+    char *copy = strdup(phrase), *save;
+    int count = 0;
+    for (char *word = strtok_r(copy, ",", &save); word && count < 64; word = strtok_r(NULL, ",", &save)) {
+        result_node *w = &words[count++];
+        char *at = strchr(word, '@');
+        if (at) {
+            *at = 0;
+            // imports go by dragon's own rule numbers
+            node_id *rule = tack_hget(&g->core->rules, at + 1);
+            w->rule = dragon_rule_id(at + 1);
+            if (!w->rule && rule)
+                w->rule = rule->id;
+        }
+        node_id *ent = tack_hget(&g->core->words, word);
+        w->id = ent ? ent->id : 0;
+        w->word = word;
+        w->sym = intern_find(word);
+    }
+    const char *rule = NULL;
+    nfa_match(g, words, count, &rule);
+    int len = snprintf(out, sizeof(out), "%s:", rule ? rule : "-");
+    for (int i = 0; i < count; i++) {
+        len += snprintf(out + len, sizeof(out) - len, " %s=%s", words[i].word,
+                        words[i].rule_name ? words[i].rule_name : "-");
+    }
+    free(copy);
+    return out;
+}
+
+#endif
@@ -0,0 +1,171 @@
+// offline grammar compiler: compiles g.load json files with the same code as the
+// command server, without Dragon, and reports how long each took and what it made.
+// with -o, writes each grammar's packed cfg and its rule names (as g.load.raw takes
+// them) as name.cfg and name.rules.json. with -c, stores compiled cores in that cache
+// directory; otherwise the disk cache is off, so timings are of compiling.
+#include <errno.h>
+#include <getopt.h>
+#include <jansson.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "grammar/compile.h"
+#include "grammar/nfa.h"
+#include "pool.h"
+
+typedef struct {
+    const char *path;
+    Grammar *grammar;
+    char *err;
+    double ms;
+} compile_job;
+
+typedef struct {
+    compile_job *jobs;
+    const char *outdir;
+} compile_run;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int write_file(const char *dir, const char *base, const char *ext, const void *data, size_t size) {
+    char *path;
+    asprintf(&path, "%s/%s%s", dir, base, ext);
+    FILE *f = fopen(path, "wb");
+    int ret = f && fwrite(data, 1, size, f) == size ? 0 : -1;
+    if (f && fclose(f))
+        ret = -1;
+    if (ret)
+        fprintf(stderr, "error: can't write %s: %s\n", path, strerror(errno));
+    free(path);
+    return ret;
+}
+
+// the file name without its directory or .json
+static char *base_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *base = strdup(slash ? slash + 1 : path);
+    size_t len = strlen(base);
+    if (len > 5 && strcmp(base + len - 5, ".json") == 0)
+        base[len - 5] = '\0';
+    return base;
+}
+
+static int write_outputs(const char *dir, compile_job *job) {
+    Grammar *g = job->grammar;
+    char *base = base_name(job->path);
+    json_t *names = json_array();
+    node_id *rule;
+    tack_foreach(&g->core->rules, rule) {
+        json_array_append_new(names, json_string(rule->name));
+    }
+    char *text = json_dumps(names, JSON_COMPACT);
+    int ret = write_file(dir, base, ".cfg", g->raw->data, g->raw->size);
+    if (!ret)
+        ret = write_file(dir, base, ".rules.json", text, strlen(text));
+    free(text);
+    json_decref(names);
+    free(base);
+    return ret;
+}
+
+static void compile_one(void *ctx, int index) {
+    compile_run *run = ctx;
+    compile_job *job = &run->jobs[index];
+    json_error_t json_err;
+    json_t *j = json_load_file(job->path, 0, &json_err);
+    if (!j) {
+        if (json_err.line > 0)
+            asprintf(&job->err, "line %d: %s", json_err.line, json_err.text);
+        else
+            job->err = strdup(json_err.text);
+        return;
+    }
+    // timed from the parsed json, as the command server gets it
+    double start = now_ms();
+    if (grammar_compile(&job->grammar, j, &job->err))
+        job->grammar = NULL;
+    job->ms = now_ms() - start;
+    json_decref(j);
+    if (job->grammar && run->outdir && write_outputs(run->outdir, job)) {
+        grammar_free(job->grammar);
+        job->grammar = NULL;
+        job->err = strdup("output not written");
+    }
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-j jobs] [-o outdir] [-c cachedir] grammar.json...\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *outdir = NULL, *cachedir = NULL;
+    int threads = 0, opt;
+    while ((opt = getopt(argc, argv, "j:o:c:h")) != -1) {
+        switch (opt) {
+            case 'j':
+                threads = atoi(optarg);
+                if (threads < 1)
+                    usage(argv[0]);
+                break;
+            case 'o':
+                outdir = optarg;
+                break;
+            case 'c':
+                cachedir = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    int count = argc - optind;
+    if (count == 0)
+        usage(argv[0]);
+    // read once by the cache on first use
+    setenv("MACLINK_CACHE", cachedir ? cachedir : "", 1);
+    if (outdir && mkdir(outdir, 0755) && errno != EEXIST) {
+        fprintf(stderr, "error: can't create %s: %s\n", outdir, strerror(errno));
+        return 1;
+    }
+
+    compile_run run = {.jobs = calloc(count, sizeof(compile_job)), .outdir = outdir};
+    for (int i = 0; i < count; i++) run.jobs[i].path = argv[optind + i];
+    // grammars compile in parallel, and so do each grammar's rules, on the shared pool.
+    // -j limits how many grammars are in flight at once
+    pool *p = threads ? pool_new(threads - 1) : pool_shared();
+    double start = now_ms();
+    pool_run(p, count, compile_one, &run);
+    double total = now_ms() - start;
+
+    int failed = 0;
+    uint64_t rules = 0, bytes = 0;
+    for (int i = 0; i < count; i++) {
+        compile_job *job = &run.jobs[i];
+        if (!job->grammar) {
+            printf("%s: error: %s\n", job->path, job->err);
+            free(job->err);
+            failed++;
+            continue;
+        }
+        grammar_core *c = job->grammar->core;
+        printf("%s: %.1fms, %d rules, %d words, %d lists, %u states, %zu bytes\n", job->path, job->ms,
+               tack_len(&c->rules), tack_len(&c->words), tack_len(&c->lists), c->nfa->state_count,
+               job->grammar->raw->size);
+        rules += tack_len(&c->rules);
+        bytes += job->grammar->raw->size;
+        grammar_free(job->grammar);
+    }
+    printf("%d grammars (%d failed), %llu rules, %llu bytes in %.1fms, %.0f rules/s\n", count, failed,
+           (unsigned long long)rules, (unsigned long long)bytes, total, total > 0 ? rules * 1000 / total : 0);
+    if (threads)
+        pool_free(p);
+    free(run.jobs);
+    return failed ? 1 : 0;
+}